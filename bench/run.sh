@@ -0,0 +1,117 @@
+#!/bin/sh
+#
+#   Benchmark suite.
+#
+#   Measures command launch latency, cat pipeline throughput,
+#   redirect throughput and parser cost, and writes one JSON
+#   object per measurement to stdout (JSON Lines), so runs can
+#   be compared across versions. Every measurement runs mysh in
+#   batch mode on a generated script, timed with date +%s%N.
+#
+#   Usage: bench/run.sh [count] [megabytes]
+#
+#   count is the number of launches and parsed lines per test,
+#   megabytes the size of the file pushed through cat.
+#
+
+MYSH=${MYSH:-./mysh}
+COUNT=${1:-2000}
+MB=${2:-256}
+WORDS=${WORDS:-1000}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+REV=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+
+# Run mysh on a script and print the elapsed nanoseconds.
+elapsed()
+{
+    start=$(date +%s%N)
+    "$MYSH" "$1" > /dev/null
+    end=$(date +%s%N)
+    echo $((end - start))
+}
+
+# Print one result line: bench, params, ops, ns, and
+# whether to report MB/s (bytes) or ns per op.
+result()
+{
+    awk -v rev="$REV" -v bench="$1" -v params="$2" -v ops="$3" -v ns="$4" -v bytes="$5" 'BEGIN {
+        printf "{\"rev\":\"%s\",\"bench\":\"%s\",%s\"ops\":%d,\"ms\":%.3f", rev, bench, params, ops, ns / 1e6
+        if (bytes > 0)
+            printf ",\"mb_per_s\":%.1f}\n", (bytes * ops / 1048576) / (ns / 1e9)
+        else
+            printf ",\"ns_per_op\":%.0f}\n", ns / ops
+    }'
+}
+
+# Write count copies of a line to a script file.
+repeat()
+{
+    i=0
+    while [ "$i" -lt "$COUNT" ]; do
+        echo "$1"
+        i=$((i + 1))
+    done > "$2"
+}
+
+# Write count copies of a line to a script file, each
+# with its line number added as a last word, so that no
+# two lines are the same and none hits the parse cache.
+numbered()
+{
+    i=0
+    while [ "$i" -lt "$COUNT" ]; do
+        echo "$1 n$i"
+        i=$((i + 1))
+    done > "$2"
+}
+
+# Launch latency: an external true under each backend, and the builtin.
+repeat /bin/true "$DIR/launch.sh"
+for backend in fork vfork posix_spawn; do
+    result launch "\"command\":\"/bin/true\",\"backend\":\"$backend\"," "$COUNT" "$(MYSH_SPAWN=$backend elapsed "$DIR/launch.sh")" 0
+done
+repeat true "$DIR/builtin.sh"
+result launch "\"command\":\"true\",\"backend\":\"builtin\"," "$COUNT" "$(elapsed "$DIR/builtin.sh")" 0
+
+# Pipeline throughput through 2, 4 and 8 stage cat chains.
+head -c $((MB * 1048576)) /dev/zero > "$DIR/data"
+BYTES=$((MB * 1048576))
+for stages in 2 4 8; do
+    line="cat $DIR/data"
+    i=1
+    while [ "$i" -lt "$stages" ]; do
+        line="$line | cat"
+        i=$((i + 1))
+    done
+    echo "$line > /dev/null" > "$DIR/pipe.sh"
+    result pipeline "\"stages\":$stages," 1 "$(elapsed "$DIR/pipe.sh")" "$BYTES"
+done
+
+# Redirect throughput for <, > and >>.
+echo "cat < $DIR/data > /dev/null" > "$DIR/redir.sh"
+result redirect "\"op\":\"<\"," 1 "$(elapsed "$DIR/redir.sh")" "$BYTES"
+echo "cat $DIR/data > $DIR/out" > "$DIR/redir.sh"
+result redirect "\"op\":\">\"," 1 "$(elapsed "$DIR/redir.sh")" "$BYTES"
+: > "$DIR/out"
+echo "cat $DIR/data >> $DIR/out" > "$DIR/redir.sh"
+result redirect "\"op\":\">>\"," 1 "$(elapsed "$DIR/redir.sh")" "$BYTES"
+rm -f "$DIR/out"
+
+# Parser cost: long lines of words, quotes and list operators that
+# run one builtin (the && chain is skipped after false), less the
+# cost of running : alone. Every line is numbered, so each one is
+# parsed afresh rather than found in the parse cache; bytes counts
+# the line without its number.
+words=$(awk -v n="$WORDS" 'BEGIN { for (i = 0; i < n; i++) printf " word%d", i }')
+quoted=$(awk -v n="$WORDS" 'BEGIN { for (i = 0; i < n; i++) printf " \"quoted %d\" '\''single'\'' esc\\ aped", i }')
+lists=$(awk -v n="$WORDS" 'BEGIN { printf "false"; for (i = 0; i < n; i++) printf " && : w%d", i }')
+numbered : "$DIR/empty.sh"
+base=$(elapsed "$DIR/empty.sh")
+numbered ":$words" "$DIR/parse.sh"
+result parse "\"line\":\"words\",\"bytes\":$(printf ':%s' "$words" | wc -c)," "$COUNT" $(($(elapsed "$DIR/parse.sh") - base)) 0
+numbered ":$quoted" "$DIR/parse.sh"
+result parse "\"line\":\"quoted\",\"bytes\":$(printf ':%s' "$quoted" | wc -c)," "$COUNT" $(($(elapsed "$DIR/parse.sh") - base)) 0
+numbered "$lists" "$DIR/parse.sh"
+result parse "\"line\":\"lists\",\"bytes\":$(printf '%s' "$lists" | wc -c)," "$COUNT" $(($(elapsed "$DIR/parse.sh") - base)) 0
@@ -0,0 +1,30 @@
+#!/bin/sh
+#
+#   Spawn microbenchmark.
+#
+#   Feeds mysh N copies of a trivial command under each spawn
+#   backend (MYSH_SPAWN=fork|vfork|posix_spawn) and reports the
+#   number of commands launched per second.
+#
+#   Usage: bench/spawn.sh [count] [command]
+#
+
+MYSH=${MYSH:-./mysh}
+COUNT=${1:-2000}
+CMD=${2:-/bin/true}
+INPUT=$(mktemp)
+trap 'rm -f "$INPUT"' EXIT
+
+i=0
+while [ "$i" -lt "$COUNT" ]; do
+    echo "$CMD"
+    i=$((i + 1))
+done > "$INPUT"
+
+for backend in fork vfork posix_spawn; do
+    start=$(date +%s%N)
+    MYSH_SPAWN=$backend "$MYSH" < "$INPUT" > /dev/null
+    end=$(date +%s%N)
+    ns=$((end - start))
+    echo "$backend: $COUNT spawns in $((ns / 1000000)) ms, $((COUNT * 1000000000 / ns)) spawns/s"
+done
@@ -10,19 +10,39 @@
 */
 
 /* Header files. */
+#define _GNU_SOURCE
 #include <string.h>
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/wait.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <time.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/signalfd.h>
 
 /* Shell Constants */
 #define MAX_PATH 1024
-#define MAX_INPUT 4096
-#define MAX_ARGS 10
-#define COMMAND_SEPARATOR " " 
 #define EXEC_SUCCESS 0
 #define EXEC_FAILURE -1
 #define REG_CMD 0
@@ -30,50 +50,1206 @@
 #define OUTPUT 2
 #define OUTPUT_APPEND 3
 #define PIPE 4
+#define READ_WRITE 5
+#define DUP_FD 6
+#define CLOSE_FD 7
+#define MAX_REDIRECTS 16
+#define TOK_END 0
+#define TOK_WORD 1
+#define TOK_PIPE 2
+#define TOK_INPUT 3
+#define TOK_OUTPUT 4
+#define TOK_OUTPUT_APPEND 5
+#define TOK_BACKGROUND 6
+#define TOK_SEMI 7
+#define TOK_AND 8
+#define TOK_OR 9
+#define TOK_HEREDOC 10
+#define TOK_HEREDOC_STRIP 11
+#define TOK_HERESTRING 12
+#define TOK_READ_WRITE 13
+#define TOK_DUP_INPUT 14
+#define TOK_DUP_OUTPUT 15
+#define TOK_OUTPUT_ALL 16
+#define TOK_APPEND_ALL 17
+#define CONTINUATION_PROMPT "> "
+#define FD_PATH "/dev/fd/%d"
+#define SYNTAX_ERROR 2
+#define WORD_BREAKS " \t|&<>;"
+#define DQUOTE_ESCAPES "\\\"$`"
+#define INIT_TOKENS 16
+#define INIT_COMMANDS 4
+#define INIT_HEREDOC_SIZE 256
+#define INIT_JOB_PROCS 4
+#define INIT_JOBS 64
+#define JOB_FREE 0
+#define JOB_RUNNING 1
+#define JOB_DONE 2
+#define JOB_STOPPED 3
+#define SPAWN_ENV "MYSH_SPAWN"
+#define SPAWN_FORK 0
+#define SPAWN_VFORK 1
+#define SPAWN_POSIX 2
+#define SPAWN_OPEN 0
+#define SPAWN_DUP2 1
+#define SPAWN_CLOSE 2
+#define MAX_SPAWN_ACTIONS 24
+#define EXEC_NOT_FOUND 127
+#define EXEC_NOT_EXECUTABLE 126
+#define HASH_BUCKETS 128
+#define SAVED_FD_BASE 10
+#define TEST_ERROR 2
+#define TIME_KEYWORD "time"
+#define STATS_ENV "MYSH_STATS"
+#define BUILTIN_STREAMS_STDIN 1
+#define BUILTIN_PURE 2
+#define COPY_SPLICE 0
+#define COPY_RANGE 1
+#define COPY_SENDFILE 2
+#define COPY_READ_WRITE 3
+#define COPY_DONE 0
+#define COPY_ERROR -1
+#define COPY_UNSUPPORTED 1
+#define COPY_CHUNK (1 << 30)
+#define COPY_BUF_SIZE 131072
+#define PIPESIZE_ENV "MYSH_PIPESIZE"
+#define PIPESIZE_DEFAULT 0
+#define PLACE_NONE 0
+#define PLACE_SET 1
+#define PLACE_COMPACT 2
+#define CPU_SYSFS "/sys/devices/system/cpu/cpu%d/topology/%s"
+#define NODE_SYSFS "/sys/devices/system/node/node%d/cpulist"
+#define NICE_DEFAULT INT_MIN
+#define OUTBUF_DEFAULT 0
+#define OUTBUF_ALIGN 4096
+#define OUTBUF_DIRECT "direct"
+#define OUTBUF_TEE "tee"
+#define IOPRIO_NONE -1
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_RT 1
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define PARALLEL_SEPARATOR ":::"
+#define PARALLEL_ARG "{}"
+#define PARALLEL_MAX_FAILED 101
+#define SUBST_MARK '\001'
+#define QSUBST_MARK '\002'
+#define SUBST_END '\003'
+#define VAR_MARK '\004'
+#define QVAR_MARK '\005'
+#define EXPAND_MARKS "\001\002\004\005"
+#define GLOB_MARK '\006'
+#define GLOB_ESCAPE '\007'
+#define GLOB_CHARS "*?[]\\"
+#define GLOB_BRACKET_BREAKS "] \t|&<>;"
+#define GLOB_LITERAL 0
+#define GLOB_PATTERN 1
+#define GLOB_STAR 2
+#define GLOB_CACHE_SIZE 16
+#define GLOB_CACHE_SLACK 2
+#define PARSE_CACHE_SIZE 32
+#define OP_PIPELINE 0
+#define OP_JUMP 1
+#define OP_JUMP_FAIL 2
+#define OP_JUMP_OK 3
+#define OP_STATUS 4
+#define OP_LOOP 5
+#define OP_FOR 6
+#define OP_NEXT 7
+#define OP_REPEAT 8
+#define OP_LOOP_END 9
+#define INIT_CODE 16
+#define UNWIND_NONE 0
+#define UNWIND_BREAK 1
+#define UNWIND_CONTINUE 2
+#define UNWIND_RETURN 3
+#define FUNCTION_BUCKETS 64
+#define FUNCTION_MAX_DEPTH 1000
+#define SPECIAL_PARAMS "?$#@*0123456789"
+#define POSITIONAL_ALL "\005@\003"
+#define COPROC_KEYWORD "coproc"
+#define COPROC_NAME "COPROC"
+#define COPROC_FD_BASE 60
+#define READ_CHUNK 128
+#define EVENT_CHILD 0
+#define EVENT_SIGNAL 1
+#define EVENT_INPUT 2
+#define EVENT_BATCH 64
+#define VAR_BUCKETS 64
+#define FIELD_SEPARATORS " \t\n"
+#define INIT_EXPAND_SIZE 256
+#define HISTFILE_ENV "MYSH_HISTFILE"
+#define HISTFILE_NAME ".mysh_history"
+#define HISTINDEX_SUFFIX ".idx"
+#define HISTINDEX_BATCH 1024
+#define HISTORY_CHAR '!'
+#define HISTORY_SCAN_LIMIT 4096
+#define HISTORY_SEGMENT 16384
+#define HISTORY_SLICE_MS 2.0
+#define CTRL_KEY(key) ((key) & 0x1f)
+#define KEY_ESC 27
+#define KEY_BACKSPACE 127
+#define KEY_UP 1000
+#define KEY_DOWN 1001
+#define KEY_RIGHT 1002
+#define KEY_LEFT 1003
+#define KEY_HOME 1004
+#define KEY_END 1005
+#define KEY_DELETE 1006
+#define KEY_WORD_LEFT 1007
+#define KEY_WORD_RIGHT 1008
+#define KEY_KILL_WORD 1009
+#define KEY_RUBOUT_WORD 1010
+#define EDIT_CONTINUE 0
+#define EDIT_ACCEPT 1
+#define EDIT_EOF 2
+#define EDIT_INTERRUPT 3
+#define EDITOR_READ_SIZE 256
+#define EDITOR_COLUMNS 80
+#define SEARCH_PROMPT "(reverse-i-search)`"
+#define SEARCH_FAILED_PROMPT "(failed reverse-i-search)`"
+#define COMPLETE_BREAKS " \t|&<>;()"
+#define COMPLETE_ESCAPES " \t|&<>;()\\'\"$`*?#"
+#define COMPLETE_ASK_LIMIT 100
+#define INIT_DIR_NAMES 256
+#define ARENA_BLOCK_SIZE 65536
+#define ARENA_ALIGN 16
+#define INIT_ARGV_SIZE 8
+#define INIT_LINE_SIZE 256
+#define READ_BUF_SIZE 65536
+#define READ_EOF -1
+#define READ_ERROR -2
+#define PROMPT_ENV "MYSH_PS1"
+#define DEFAULT_PROMPT "[\\u@\\H \\W] JSHELL$ "
+#define BASIC_PROMPT "SHELL$ "
+#define PROMPT_BUF_SIZE 4096
+#define USAGE "usage: mysh [-c command | script-file]\n"
+
+/* A single child process of a job, with its resource 
+   usage from waitid, its start and end times, and the
+   pidfd the event loop watches it through until it 
+   exits (-1 once it has). */
+struct process
+{
+    pid_t pid;
+    int pidfd;
+    int status;
+    int done;
+    int stopped;
+    char *name;
+    int hashed;
+    struct rusage usage;
+    struct timespec start;
+    struct timespec end;
+};
+
+/* Coprocess started by coproc: its name, the shell's 
+   ends of its pipes (fds[0] reads its output, fds[1] 
+   writes its input) and its job, NULL once that has 
+   been freed. Coprocesses are kept in a list, from the
+   newest, until replaced by one of the same name. */
+struct coproc
+{
+    char *name;
+    int fds[2];
+    struct job *job;
+    struct coproc *next;
+};
+
+/* Job: every child forked for one input line. Jobs live
+   in a table of pointers, doubled by job_table_grow
+   when every slot is in use; a job itself never moves,
+   so the event loop can record exit statuses through 
+   it. A coprocess's job points to its coproc entry. */
+struct job
+{
+    int id;
+    int state;
+    int background;
+    pid_t pgid;
+    struct process *procs;
+    int num_procs;
+    int max_procs;
+    int num_live;
+    int num_stopped;
+    int notified;
+    int seq;
+    int timed;
+    int pipe_size;
+    struct termios tmodes;
+    struct timespec start;
+    char *command;
+    struct coproc *coproc;
+};
+
+/* Signal name accepted by kill, without its SIG. */
+struct signal_name
+{
+    char *name;
+    int number;
+};
+
+/* One file action applied in a child before it executes. */
+struct spawn_action
+{
+    int type;
+    int fd;
+    int src_fd;
+    char *path;
+    int flags;
+};
+
+/* Everything needed to launch a command with any of 
+   the spawn backends: its argv, the absolute path 
+   resolved through the command hash (NULL to search 
+   PATH) or the builtin or compound command body to run
+   instead of exec, its environment, and its file 
+   actions. */
+struct spawn_plan
+{
+    char **argv;
+    char **envp;
+    char *path;
+    struct builtin *builtin;
+    struct command_list *body;
+    struct spawn_action actions[MAX_SPAWN_ACTIONS];
+    int num_actions;
+    int pinned;
+    cpu_set_t cpus;
+};
+
+/* Where pipeline stages run, set with set affinity=. 
+   PLACE_SET pins every stage to cpus; PLACE_COMPACT
+   gives stage n the CPU order[n % num_cpus], with the
+   CPUs ordered so that SMT siblings, then cores of one
+   package, are adjacent. */
+struct placement
+{
+    int mode;
+    cpu_set_t cpus;
+    int *order;
+    int num_cpus;
+};
+
+/* A CPU's place in the topology, for ordering. */
+struct cpu_place
+{
+    int cpu;
+    int package;
+    int core;
+};
+
+/* Shell variable, in a hash chain. entry holds 
+   "name=value", so an exported variable's entry goes 
+   into the environment as it is; value points just 
+   past the '='. */
+struct var
+{
+    char *entry;
+    char *value;
+    size_t name_len;
+    int exported;
+    struct var *next;
+};
+
+/* Command hash entry: a program name resolved to 
+   an absolute path by searching PATH once. */
+struct hash_entry
+{
+    char *name;
+    char *path;
+    int hits;
+    struct hash_entry *next;
+};
+
+/* Command history: an append-only file of one entry
+   per line and an index file of each entry's starting
+   offset, both memory-mapped. end is the offset just
+   past the last indexed entry. The search index is
+   built a slice at a time over the first build_count
+   entries: seen is the hash table that marks newest
+   copies while entries from build_next down are still
+   to be checked, then suffixes fills up in sorted
+   segments (segments holds the end of each), covering
+   entries 1 to suffix_entries. */
+struct history
+{
+    int fd;
+    int index_fd;
+    char *text;
+    size_t text_size;
+    uint32_t *index;
+    size_t count;
+    size_t end;
+    uint32_t *suffixes;
+    size_t num_suffixes;
+    size_t suffix_entries;
+    unsigned char *newest;
+    size_t *segments;
+    size_t num_segments;
+    uint32_t *seen;
+    size_t seen_size;
+    size_t build_count;
+    size_t build_next;
+    size_t build_suffixes;
+};
+
+/* Raw-mode line editor state. buf holds the line being
+   edited; view is the first byte of it on screen when
+   the line is wider than the terminal. While searching,
+   match is the history entry shown, found with query. 
+   Each keystroke is rendered into out and written with
+   a single write. */
+struct line_editor
+{
+    int enabled;
+    struct termios cooked;
+    char *buf;
+    size_t len;
+    size_t cap;
+    size_t cursor;
+    size_t view;
+    int cols;
+    char *kill;
+    size_t kill_len;
+    size_t kill_cap;
+    char *saved;
+    size_t saved_len;
+    size_t saved_cap;
+    size_t hist_pos;
+    int searching;
+    int failed;
+    char *query;
+    size_t query_len;
+    size_t query_cap;
+    size_t match;
+    size_t match_pos;
+    int clear;
+    int reprint;
+    int last_key;
+    char *out;
+    size_t out_len;
+    size_t out_cap;
+    char in[EDITOR_READ_SIZE];
+    size_t in_start;
+    size_t in_end;
+};
+
+/* One PATH directory in the executable index: the 
+   sorted names in it when it was last read, and its 
+   mtime then, so it is only re-read after a change. 
+   An empty path is the current directory, which is
+   never indexed. */
+struct command_dir
+{
+    char *path;
+    struct timespec mtime;
+    int scanned;
+    char **names;
+    size_t count;
+    char *blob;
+};
+
+/* A sorted listing of one directory, kept for globs 
+   while the directory keeps its device, inode and 
+   mtime. Each name in blob is preceded by its d_type 
+   byte; used orders the listings for eviction. */
+struct dir_listing
+{
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    int cached;
+    char **names;
+    size_t count;
+    char *blob;
+    unsigned long used;
+};
+
+/* A glob pattern split at slashes into components, 
+   each a GLOB_LITERAL name, a fnmatch GLOB_PATTERN or
+   GLOB_STAR (**), and the path matched so far. Matches
+   are pushed to argv. descended is set while ** walks
+   below the directory it started in. */
+struct glob
+{
+    struct argv_vec *argv;
+    char **comps;
+    int *kinds;
+    int num_comps;
+    int dir_only;
+    int descended;
+    char path[MAX_PATH];
+};
+
+/* A block of arena memory. Blocks are kept after a 
+   reset and reused, so a warmed-up arena never calls
+   malloc again unless a line outgrows it. */
+struct arena_block
+{
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+/* Bump allocator for everything parsed from one input 
+   line. last points at the most recent allocation so 
+   it can be grown in place. */
+struct arena
+{
+    struct arena_block *head;
+    struct arena_block *current;
+    char *last;
+};
+
+/* A point in an arena to release back to, keeping 
+   everything allocated before it. */
+struct arena_mark
+{
+    struct arena_block *block;
+    size_t used;
+    char *last;
+};
+
+/* A parsed line kept for reuse: its text, which the 
+   pipelines point into, and the command list parsed 
+   from it, both in the entry's own arena. used orders 
+   the entries for eviction. active counts the runs of
+   its list under way (a command substitution's runs 
+   inside the line's), and an active entry is never 
+   evicted. */
+struct parse_entry
+{
+    unsigned int hash;
+    char *line;
+    struct command_list *list;
+    struct arena arena;
+    unsigned long used;
+    int active;
+};
+
+/* Growable, NULL-terminated argument vector backed by 
+   the line arena. */
+struct argv_vec
+{
+    char **items;
+    int len;
+    int cap;
+};
+
+/* Lexer token. start and end delimit the token in 
+   the input line; text is the word with quotes 
+   removed (TOK_WORD only). fd is the digit written
+   before a redirection operator, or -1. expand is set 
+   if text holds command substitutions or variables,
+   each written as SUBST_MARK or VAR_MARK (QSUBST_MARK
+   or QVAR_MARK inside double quotes), the command or 
+   name, and SUBST_END, or if it starts with GLOB_MARK
+   to be globbed. */
+struct token
+{
+    int type;
+    char *text;
+    char *start;
+    char *end;
+    int subst;
+    int fd;
+    int expand;
+};
+
+/* One fd operation of a command, in input order: fd
+   opened on file for reading (INPUT), writing (OUTPUT,
+   OUTPUT_APPEND) or both (READ_WRITE), made a copy of
+   src_fd (DUP_FD), or closed (CLOSE_FD). A here-document
+   or here-string has its text in body, and file is only
+   set, to a /dev/fd path, just before the pipeline runs.
+   A file word with command substitutions is kept in 
+   word, and file is set from it in the same way. If 
+   here is set, word is instead the text of a here-string
+   or unquoted here-document with expansions, and body 
+   is set from it each time the command runs. */
+struct redirect
+{
+    int mode;
+    int fd;
+    int src_fd;
+    char *file;
+    char *word;
+    char *body;
+    int here;
+    struct redirect *next;
+};
+
+/* Process substitution <(command) or >(command) 
+   (direction '<' or '>'), standing for argument arg
+   of its command (argv[index] once command 
+   substitutions have been expanded) or, if redirect 
+   is set, for that redirection's file. */
+struct substitution
+{
+    int direction;
+    char *command;
+    int arg;
+    int index;
+    struct redirect *redirect;
+    struct substitution *next;
+};
+
+/* One command of a pipeline. If expand is set, some 
+   of its words hold command substitutions, variables
+   or globs; words and assigns keep them as parsed, 
+   and argv and env are rebuilt from them each time 
+   the command runs. assigns are the name=value words 
+   before the command name. A compound command (if, 
+   while, until, for or { ... }) has its compiled list
+   in body and its keyword as its only word; a function
+   definition also has the function's name. */
+struct command
+{
+    struct argv_vec argv;
+    struct argv_vec words;
+    struct argv_vec assigns;
+    struct argv_vec env;
+    struct redirect *redirects;
+    struct redirect **last_redirect;
+    struct substitution *substitutions;
+    int expand;
+    struct command_list *body;
+    char *function;
+};
+
+/* A shell fd replaced while a builtin runs in the 
+   shell: saved is a close-on-exec copy of the 
+   original, or -1 if fd was not open. */
+struct saved_fd
+{
+    int fd;
+    int saved;
+};
+
+/* Fields being built from words with command 
+   substitutions, in line arena memory that the fields
+   pushed to argv point into. The field being built is
+   buf[field..len); have_field is set once it exists,
+   even if empty. */
+struct expansion
+{
+    struct argv_vec *argv;
+    char *buf;
+    size_t len;
+    size_t cap;
+    size_t field;
+    int have_field;
+};
+
+/* Parsed pipeline: commands joined by pipes. text is
+   the pipeline as typed, without any trailing & (only
+   its first line, if a compound command spans more). 
+   coproc is the name of the coprocess it starts, or 
+   NULL. stages holds a pidfd for each buffer stage 
+   started in front of its output files. */
+struct pipeline
+{
+    struct command *commands;
+    int num_commands;
+    int background;
+    int timed;
+    char *coproc;
+    char *text;
+    size_t text_len;
+    int *fds;
+    int num_fds;
+    int *stages;
+    int num_stages;
+};
+
+/* One instruction of a compiled command list. 
+   OP_PIPELINE runs pipelines[arg]. OP_JUMP goes to 
+   target, OP_JUMP_FAIL only if the last status is not
+   0 and OP_JUMP_OK only if it is, and OP_STATUS sets
+   the status to arg. A loop runs from OP_LOOP, whose 
+   arg is the OP_REPEAT that continue goes to and 
+   target the OP_LOOP_END that break goes to; OP_REPEAT
+   goes back to target for the next iteration. In a for
+   loop, OP_FOR expands the words of pipelines[arg], and
+   OP_NEXT assigns the next of them to the variable 
+   name, or goes to target once none are left. */
+struct op
+{
+    int type;
+    int arg;
+    int target;
+    char *name;
+};
+
+/* Compiled command list: the code that runs its 
+   pipelines, joined by ;, &, && and || or by the 
+   control flow of a compound command. Each compound 
+   command inside it has a list of its own, so a list
+   holds at most one loop. */
+struct command_list
+{
+    struct op *code;
+    int num_code;
+    int max_code;
+    struct pipeline *pipelines;
+    int num_pipelines;
+    int max_pipelines;
+};
+
+/* Compiler state: the tokens of the line being 
+   compiled and the position in them, and how many 
+   compound commands are open, in which case the end
+   of the line continues onto the next. */
+struct compiler
+{
+    struct token *tokens;
+    int pos;
+    int depth;
+};
+
+/* Shell function, in a hash chain. body is a copy of 
+   the list compiled from its definition, in the 
+   function's own arena, so it outlives the line. calls
+   counts the calls running it; a function redefined 
+   while running is dropped, and freed when the last 
+   of them returns. */
+struct function
+{
+    char *name;
+    struct command_list *body;
+    struct arena arena;
+    int calls;
+    int dropped;
+    struct function *next;
+};
+
+/* Buffered line reader over a file descriptor, or 
+   over a fixed string when fd is -1 (mysh -c). */
+struct input_reader
+{
+    int fd;
+    char *buf;
+    size_t start;
+    size_t end;
+    int eof;
+};
+
+/* Cached prompt components and the last rendered 
+   prompt, re-rendered only when marked dirty. */
+struct prompt_state
+{
+    char *user;
+    char *home;
+    char *format;
+    char hostname[MAX_PATH + 1];
+    char cwd[MAX_PATH + 1];
+    int have_cwd;
+    int root;
+    int default_format;
+    char buf[PROMPT_BUF_SIZE];
+    size_t len;
+    int dirty;
+};
+
+/* Builtin command, run without exec. accepts, if set,
+   decides whether an argv is handled by the builtin 
+   or left to the program of the same name. A builtin 
+   flagged BUILTIN_STREAMS_STDIN may read stdin until
+   end of file, so without arguments or an input 
+   redirection it is never run inside the shell. One 
+   flagged BUILTIN_PURE changes no shell state, so a 
+   command substitution may run it in the shell. */
+struct builtin
+{
+    char *name;
+    int (*func)(char *argv[]);
+    int (*accepts)(char *argv[]);
+    int flags;
+};
+
+/* Shell option changed by set name=value. set parses 
+   and applies the value; show prints the current one. */
+struct shell_option
+{
+    char *name;
+    int (*set)(char *value);
+    void (*show)();
+};
+
+extern char **environ;
+
+/* Job table, indexed by job id - 1. Each job is 
+   allocated on its own, so pointers to it stay valid
+   as the table grows. */
+static struct job **job_table;
+static int num_jobs;
+static sigset_t sigchld_mask;
+static int event_fd = -1;
+static int signal_fd = -1;
+static pid_t capture_pid;
+static int capture_status;
+static int captured;
+static int spawn_backend = SPAWN_FORK;
+static struct hash_entry *command_hash[HASH_BUCKETS];
+static struct var *var_table[VAR_BUCKETS];
+static char **env_cache;
+static int num_exported;
+static pid_t shell_pid;
+static struct command_dir *command_dirs;
+static size_t num_command_dirs;
+static struct dir_listing glob_cache[GLOB_CACHE_SIZE];
+static unsigned long glob_clock;
+static struct parse_entry parse_cache[PARSE_CACHE_SIZE];
+static unsigned long parse_clock;
+static unsigned long parse_hits;
+static unsigned long parse_misses;
+static unsigned long continuation_lines;
+static struct coproc *coprocs;
+static struct function *function_table[FUNCTION_BUCKETS];
+static int num_functions;
+static int function_depth;
+static int loop_depth;
+static int unwind_type = UNWIND_NONE;
+static int unwind_count;
+static char *shell_name;
+static char **positional;
+static int num_positional;
+static struct input_reader shell_input;
+static int interactive;
+static int job_control;
+static int job_sequence;
+static int stopped_warned;
+static pid_t shell_pgid;
+static struct termios shell_tmodes;
+static int last_status;
+static struct prompt_state prompt;
+static struct arena line_arena;
+static int stats_fd = -1;
+static int pipe_size_request = PIPESIZE_DEFAULT;
+static int pipe_size_warned;
+static struct placement placement = {PLACE_NONE};
+static int nice_request = NICE_DEFAULT;
+static int outbuf_size = OUTBUF_DEFAULT;
+static int outbuf_direct;
+static int outbuf_tee;
+static int ioprio_request = IOPRIO_NONE;
+static struct history history = {-1, -1, NULL, 0, NULL, 0, 0, NULL, 0, 0, NULL, NULL, 0, NULL, 0, 0, 0, 0};
+static struct line_editor editor;
 
 /* Function Prototypes. */
 
 /* Error Checks (exit on failure) */
 static inline void perror_exit(char *cmd);
-static inline void execvp_and_handle_error(char *program, char *argv[]);
+static inline void execvp_and_handle_error(char *program, char *argv[], char *envp[]);
+static inline void exec_and_handle_error(char *path, char *argv[], char *envp[]);
 static inline void close_pipes(int pipe_fds[]);
+static inline void child_perror_exit(char *cmd);
 
 /* Shell */
 void init_shell();
-void exit_shell();
+void exit_shell(int status);
 void print_prompt();
-void get_input(char *buf);
-int parse_input_and_exec(char *input, char *dlim);
-void save_command(char *dest[], char *command[], int cmd_index);
-int exec_command(int mode, char *command[], int io_file_fd);
+void init_prompt();
+void prompt_update_cwd();
+static void prompt_append(char *str, size_t len);
+void render_prompt();
+char *get_input();
+int init_input(int argc, char *argv[]);
+int read_line(struct input_reader *reader, struct arena *arena, char **line);
+int parse_input_and_exec(char *input);
+
+/* Parsing */
+int parse_cached(char *input, struct command_list **list, struct parse_entry **entry);
+void parse_done(struct parse_entry *entry);
+int tokenize(char *input, struct token **tokens);
+char *copy_parens(char *c, char **words, char *what);
+char *copy_command_subst(char *c, char **words, int mark);
+int is_variable(char *c);
+char *copy_variable(char *c, char **words, int mark);
+int is_assignment(struct token *token);
+int is_keyword(struct token *token, char *word);
+int parse_list(char *input, struct command_list **list);
+struct command_list *list_create();
+int compile_emit(struct command_list *list, int type, int arg);
+struct token *compile_peek(struct compiler *c);
+int compile_list(struct compiler *c, struct command_list *list, char *terminators[]);
+int compile_body(struct compiler *c, struct command_list *list, char *terminators[]);
+int compile_and_or(struct compiler *c, struct command_list *list);
+int parse_pipeline(struct compiler *c, struct pipeline *result);
+void command_init(struct command *command);
+int is_compound(struct token *token);
+int function_name(struct token *tokens, int *pos, char **name);
+int parse_compound(struct compiler *c, struct command *command);
+int compile_if(struct compiler *c, struct command_list *body);
+int compile_while(struct compiler *c, struct command_list *body, int until);
+int compile_for(struct compiler *c, struct command_list *body);
+int parse_redirect(struct command *command, struct token *tokens);
+int is_redirect_token(int type);
+struct redirect *add_redirect(struct command *command, struct token *token, char *file, int quoted);
+void add_substitution(struct command *command, struct token *token, struct redirect *redirect);
+char *heredoc_read(char *delimiter, int strip_tabs);
+int heredoc_mark(struct redirect *redirect);
+char *read_continuation();
+
+/* Executing */
+int validate_pipeline(struct pipeline *pipeline);
+int prepare_pipeline(struct pipeline *pipeline);
+void release_pipeline(struct pipeline *pipeline);
+int body_fd(char *body);
+int substitute(struct pipeline *pipeline, int direction, char *command, pid_t *pid);
+char *fd_path(int fd);
+int expand_pipeline(struct pipeline *pipeline);
+int expand_command(struct pipeline *pipeline, struct command *command);
+int expand_word(struct expansion *exp, struct pipeline *pipeline, char *word, int split);
+int capture(struct expansion *exp, struct pipeline *pipeline, char *command, int split);
+int capture_fd(struct expansion *exp, int fd, int split);
+static void expansion_split(struct expansion *exp, char *start, char *end);
+static void expansion_reserve(struct expansion *exp, size_t extra);
+static void expansion_end_field(struct expansion *exp);
+struct builtin *shell_builtin(struct pipeline *pipeline);
+int streams_regular(struct command *command);
+int execute_list(struct command_list *list);
+int execute_pipeline(struct pipeline *pipeline);
+int run_body(struct command *command);
+void subshell_init();
+
+/* Functions */
+struct function *function_find(char *name);
+int function_define(char *name, struct command_list *body);
+void function_drop(struct function *function);
+int function_call(struct function *function, char *argv[]);
+struct command_list *list_copy(struct arena *arena, struct command_list *list);
+void command_copy(struct arena *arena, struct command *to, struct command *from);
+struct argv_vec argv_copy(struct arena *arena, struct argv_vec *vec);
+
+/* Jobs */
+void init_jobs();
+void init_job_control();
+struct job *job_create(char *command, size_t command_len, int background);
+struct job *job_table_grow();
+void job_add_pid(struct job *job, pid_t pid);
+void job_add_failed(struct job *job, char *name, int status);
+void job_record_status(pid_t pid, int status, struct rusage *usage);
+void job_wait(struct job *job);
+void job_background(struct job *job);
+void job_free(struct job *job);
+void job_notify();
+void job_report(struct job *job, char *state);
+char *job_state(struct job *job);
+int job_own_group(struct job *job);
+void job_continue(struct job *job, int background);
+struct job *job_find(char *spec, char *builtin);
+void job_hangup();
+int exit_status(int status);
+int coproc_start(struct pipeline *pipeline);
+struct coproc *coproc_find(char *name);
+int coproc_var(char *name, char *suffix, int value);
+void coproc_close_all();
+void coproc_end(struct coproc *coproc);
+void coproc_free(struct coproc *coproc);
+
+/* Timing and Stats */
+void init_stats();
+double elapsed_ms(struct timespec *start, struct timespec *end);
+double timeval_ms(struct timeval *tv);
+void report_pipeline(char *command, struct process *procs, int num_procs, struct timespec *start, int timed, int pipe_size);
+void write_stats(char *command, struct process *procs, int num_procs, struct timespec *start, struct timespec *end, int pipe_size);
+void write_cache_stats();
+void json_string(FILE *out, char *str);
 
 /* Redirect I/O */
-void redirect_io(int mode, char *command[], char *io_file, int exec_redirection);
-void exec_redir_bothio(int output_mode, char *command[], char *input_file, char *output_file);
+int redirect_flags(int mode);
+int redirects_fd(struct command *command, int fd);
+int parse_fd(char *str);
+void spawn_add_redirects(struct spawn_plan *plan, struct command *command);
+int redirect_shell(struct command *command, struct saved_fd saved[], int *num_saved);
+void restore_shell(struct saved_fd saved[], int num_saved);
+int buffer_redirects(struct pipeline *pipeline, struct command *command);
+int buffer_start(struct pipeline *pipeline, struct redirect *first, int *write_fd);
+struct redirect *buffer_next(struct redirect *first, struct redirect *redirect);
+int buffer_target(struct redirect *redirect);
+void buffer_run(int input, int files[], int num_files);
+void buffer_write(int files[], int num_files, char *block, size_t len);
+void buffer_wait(struct pipeline *pipeline, int wait);
 
 /* Piping */
-void input_pipe(int *pipe_fds, char *pipe_cmd[]);
-void inter_pipe(int *pipe_fds, char *pipe_cmd[]);
-void output_pipe(int *pipe_fds, char *output_cmd[]);
-void input_pipe_redirect(int *pipe_fds, char *pipe_cmd[], char *input_file);
-void output_pipe_redirect(int *pipe_fds, int output_mode, char *output_cmd[], char *output_file);
+void init_pipes();
+void make_pipe(struct job *job, int pipe_fds[]);
+int pipe_size_get(int fd);
+int parse_size(char *str, int *size);
+void spawn_pipeline(struct job *job, struct pipeline *pipeline, int input_fd, int output_fd);
+
+/* Event Loop */
+void init_events();
+int event_add(int fd, int type);
+int event_watch(pid_t pid);
+int event_wait(int timeout, int fd, int *ready);
+void event_poll();
+void event_wait_fd(int fd);
+void event_child(int pidfd);
+void event_stops();
+int wait_status(siginfo_t *info);
+
+/* Spawning */
+void init_spawn();
+void spawn_plan_init(struct spawn_plan *plan, char *argv[]);
+static struct spawn_action *spawn_add_action(struct spawn_plan *plan, int type, int fd);
+void spawn_add_open(struct spawn_plan *plan, int fd, char *path, int flags);
+void spawn_add_dup2(struct spawn_plan *plan, int src_fd, int fd);
+void spawn_add_close(struct spawn_plan *plan, int fd);
+void spawn_add_close_pipes(struct spawn_plan *plan, int pipe_fds[]);
+pid_t spawn_command(struct job *job, struct spawn_plan *plan);
+void spawn_child(struct job *job, struct spawn_plan *plan);
+pid_t spawn_posix(struct job *job, struct spawn_plan *plan);
+
+/* Scheduling */
+void spawn_place(struct job *job, struct spawn_plan *plan);
+char *spawn_schedule(pid_t pid, struct spawn_plan *plan);
+int parse_cpu_list(char *list, cpu_set_t *cpus);
+int read_cpu_list(char *path, cpu_set_t *cpus);
+int read_topology(int cpu, char *name);
+int cpu_place_order(const void *a, const void *b);
+void print_cpu_list(int *cpus, int count);
+
+/* Variables */
+void init_vars();
+int name_length(char *str);
+struct var *var_find(char *name, size_t name_len);
+char *var_get(char *name);
+int var_set(char *name, size_t name_len, char *value, int export);
+void var_unset(char *name, size_t name_len);
+int var_assign(struct argv_vec *assigns, int export);
+void env_update();
+char **env_with(struct argv_vec *assigns);
+char *var_value(char *name);
+
+/* Globbing */
+int copy_quoted(char ch, char **words);
+char *glob_literal(char *word);
+void glob_word(struct argv_vec *argv, char *pattern);
+void glob_walk(struct glob *glob, int comp, size_t len);
+void glob_match(struct glob *glob, size_t len, char *name, int type);
+int glob_is_dir(char *path, int type);
+struct dir_listing *glob_listing(char *dir);
+
+/* Command Hash */
+unsigned int hash_string(char *str);
+char *hash_lookup(char *name);
+struct hash_entry *hash_find(char *name);
+char *hash_search_path(char *name, char *path_env);
+int command_index_refresh();
+int command_dir_scan(struct command_dir *dir);
+void command_dir_free(struct command_dir *dir);
+int name_order(const void *a, const void *b);
+char *command_index_lookup(char *name);
+void hash_forget(char *name);
+void hash_clear();
+int builtin_hash(char *argv[]);
+
+/* History */
+void init_history();
+int history_sync();
+void *history_remap(void *addr, size_t old_size, int fd, size_t size);
+int history_index_tail();
+char *history_entry(size_t n, size_t *len);
+void history_add(char *line);
+char *history_expand(char *line);
+int history_event(char *event, size_t *n);
+int builtin_history(char *argv[]);
+void history_build_start();
+void history_build_free();
+int history_build_step();
+int history_segment_add();
+int suffix_order(const void *a, const void *b);
+int suffix_compare(uint32_t offset, char *query, size_t len);
+void suffix_range(size_t start, size_t end, char *query, size_t len, size_t *first, size_t *last);
+size_t history_entry_at(uint32_t offset);
+size_t history_search(char *query, size_t len, size_t before, size_t *pos);
+unsigned int hash_bytes(char *str, size_t len);
+
+/* Line Editor */
+void init_editor();
+int editor_read_line(struct arena *arena, char **line);
+int editor_getc();
+int editor_key();
+int editor_edit(int key);
+void editor_search(int key);
+void editor_search_update(size_t before);
+void editor_search_end();
+void editor_insert(char *str, size_t len);
+void editor_delete(size_t from, size_t to, int kill);
+void editor_history(size_t n);
+void editor_render(int final);
+void editor_emit(char *str, size_t len);
+void editor_flush();
+void buffer_reserve(char **buf, size_t *cap, size_t size);
+void editor_complete();
+void complete_commands(struct argv_vec *matches, char *prefix);
+void complete_files(struct argv_vec *matches, char *word);
+void editor_insert_escaped(char *str, size_t len);
+void editor_list(struct argv_vec *matches);
+
+/* Arena and Argument Vectors */
+void *arena_alloc(struct arena *arena, size_t size);
+void *arena_grow(struct arena *arena, void *ptr, size_t old_size, size_t new_size);
+void arena_reset(struct arena *arena);
+void arena_mark(struct arena *arena, struct arena_mark *mark);
+void arena_release(struct arena *arena, struct arena_mark *mark);
+void arena_free(struct arena *arena);
+char *arena_strdup(struct arena *arena, char *str);
+void argv_init(struct argv_vec *vec);
+void argv_push(struct argv_vec *vec, char *arg);
+
+/* Builtins */
+struct builtin *find_builtin(char *argv[]);
+int run_builtin(struct builtin *builtin, struct command *command);
+int run_builtin_timed(struct builtin *builtin, struct pipeline *pipeline);
+int builtin_exit(char *argv[]);
+int builtin_cd(char *argv[]);
+int builtin_pwd(char *argv[]);
+int builtin_echo(char *argv[]);
+int builtin_true(char *argv[]);
+int builtin_false(char *argv[]);
+int builtin_test(char *argv[]);
+int test_expr(char *argv[], int argc);
+int cat_accepts(char *argv[]);
+int builtin_cat(char *argv[]);
+int copy_fd(int in_fd, int out_fd);
+int copy_with(int method, int in_fd, int out_fd);
+int builtin_set(char *argv[]);
+int builtin_export(char *argv[]);
+int builtin_unset(char *argv[]);
+int var_order(const void *a, const void *b);
+int builtin_jobs(char *argv[]);
+int builtin_fg(char *argv[]);
+int builtin_bg(char *argv[]);
+int builtin_kill(char *argv[]);
+int parse_signal(char *name);
+int builtin_break(char *argv[]);
+int builtin_return(char *argv[]);
+int builtin_shift(char *argv[]);
+int builtin_read(char *argv[]);
+int builtin_function(char *argv[]);
+int builtin_parallel(char *argv[]);
+char **parallel_read_args(int *count);
+int parallel_spawn(struct job *job, char *command[], char *arg, int out_fd);
+void parallel_emit(struct job *job, int *outputs, int *next_output);
+int set_pipesize(char *value);
+void show_pipesize();
+int set_affinity(char *value);
+void show_affinity();
+int set_nice(char *value);
+void show_nice();
+int set_ionice(char *value);
+void show_ionice();
+int set_outbuf(char *value);
+void show_outbuf();
+
+/* Builtin dispatch table, consulted before any exec. */
+static struct builtin builtins[] = {
+    {"exit", builtin_exit, NULL, 0},
+    {"cd", builtin_cd, NULL, 0},
+    {"pwd", builtin_pwd, NULL, BUILTIN_PURE},
+    {"echo", builtin_echo, NULL, BUILTIN_PURE},
+    {"true", builtin_true, NULL, BUILTIN_PURE},
+    {":", builtin_true, NULL, BUILTIN_PURE},
+    {"false", builtin_false, NULL, BUILTIN_PURE},
+    {"test", builtin_test, NULL, BUILTIN_PURE},
+    {"[", builtin_test, NULL, BUILTIN_PURE},
+    {"hash", builtin_hash, NULL, 0},
+    {"cat", builtin_cat, cat_accepts, BUILTIN_STREAMS_STDIN | BUILTIN_PURE},
+    {"set", builtin_set, NULL, 0},
+    {"export", builtin_export, NULL, 0},
+    {"unset", builtin_unset, NULL, 0},
+    {"history", builtin_history, NULL, BUILTIN_PURE},
+    {"jobs", builtin_jobs, NULL, 0},
+    {"fg", builtin_fg, NULL, 0},
+    {"bg", builtin_bg, NULL, 0},
+    {"kill", builtin_kill, NULL, 0},
+    {"parallel", builtin_parallel, NULL, 0},
+    {"break", builtin_break, NULL, 0},
+    {"continue", builtin_break, NULL, 0},
+    {"return", builtin_return, NULL, 0},
+    {"shift", builtin_shift, NULL, 0},
+    {"read", builtin_read, NULL, 0},
+    {NULL, NULL, NULL, 0}
+};
+
+/* What find_builtin returns for the name of a shell 
+   function, which runs like any other builtin. */
+static struct builtin function_builtin = {"function", builtin_function, NULL, 0};
+
+/* Reserved words that open a compound command, and 
+   those only valid inside one. */
+static char *compound_words[] = {"if", "while", "until", "for", "{", NULL};
+static char *reserved_words[] = {"then", "else", "elif", "fi", "do", "done", "}", NULL};
+
+/* Signals known to kill by name. */
+static struct signal_name signal_names[] = {
+    {"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT}, {"ABRT", SIGABRT},
+    {"KILL", SIGKILL}, {"USR1", SIGUSR1}, {"SEGV", SIGSEGV}, {"USR2", SIGUSR2},
+    {"PIPE", SIGPIPE}, {"ALRM", SIGALRM}, {"TERM", SIGTERM}, {"CHLD", SIGCHLD},
+    {"CONT", SIGCONT}, {"STOP", SIGSTOP}, {"TSTP", SIGTSTP}, {"TTIN", SIGTTIN},
+    {"TTOU", SIGTTOU}, {"WINCH", SIGWINCH}, {NULL, 0}
+};
+
+/* Options understood by the set builtin. */
+static struct shell_option shell_options[] = {
+    {"pipesize", set_pipesize, show_pipesize},
+    {"affinity", set_affinity, show_affinity},
+    {"nice", set_nice, show_nice},
+    {"ionice", set_ionice, show_ionice},
+    {"outbuf", set_outbuf, show_outbuf},
+    {NULL, NULL, NULL}
+};
 
 /* MAIN */
 
 int main(int argc, char *argv[])
 {
-    char user_input[MAX_INPUT];
+    char *user_input;
+
+    init_vars();
+
+    /* Pick the input source; only a terminal gets the banner and prompt. */
+    if (init_input(argc, argv) < 0)
+    {
+        fprintf(stderr, USAGE);
+        exit(EXIT_FAILURE);
+    }
 
     /* Init shell and loop. */
-    init_shell();
+    if (interactive)
+    {
+        init_shell();
+        init_prompt();
+        init_history();
+        init_editor();
+    }
+    init_jobs();
+    init_spawn();
+    init_stats();
+    init_pipes();
     while (1)
     { 
-        print_prompt();
-        get_input(user_input);
-        if (user_input[0] != '\0')
+        job_notify();
+        if (interactive)
+        {
+            print_prompt();
+        }
+        user_input = get_input();
+        if (interactive && (user_input = history_expand(user_input)) != NULL)
         {
-            parse_input_and_exec(user_input, COMMAND_SEPARATOR);
+            history_add(user_input);
         }
+        if (user_input != NULL && user_input[0] != '\0')
+        {
+            parse_input_and_exec(user_input);
+        }
+        arena_reset(&line_arena);
     }
 }
 
@@ -88,17 +1264,60 @@ static inline void perror_exit(char *cmd)
     exit(EXIT_FAILURE);
 }
 
-/* Execute a program with execvp. On failure, 
-   an error message will be printed to stderr 
-   and the current process will exit. */
+/* Write a perror-style message for a failed call in
+   a child and _exit the child with EXIT_FAILURE. The
+   message goes out in a single write, so stdio buffers
+   inherited from (or, after vfork, shared with) the 
+   shell are never touched or flushed twice. */
+
+static inline void child_perror_exit(char *cmd)
+{
+    char msg[MAX_PATH];
+    int len = snprintf(msg, sizeof(msg), "%s: %s\n", cmd, strerror(errno));
+
+    if (write(STDERR_FILENO, msg, len) < 0)
+    {
+        _exit(EXIT_FAILURE);
+    }
+    _exit(EXIT_FAILURE);
+}
+
+/* Execute a program with execvpe in environment 
+   envp. On failure, an error message will be printed
+   to stderr and the current process will exit. */
+
+static inline void execvp_and_handle_error(char *program, char *argv[], char *envp[])
+{
+    char msg[MAX_PATH];
+    int len;
+
+    if (execvpe(program, argv, envp) < 0)
+    {
+        len = snprintf(msg, sizeof(msg), "%s execvp(): %s\n", program, strerror(errno));
+        if (write(STDERR_FILENO, msg, len) < 0)
+        {
+            _exit(EXEC_NOT_FOUND);
+        }
+        _exit((errno == ENOENT) ? EXEC_NOT_FOUND : EXEC_NOT_EXECUTABLE);
+    }
+}
+
+/* Execute a program already resolved to path by the
+   command hash with execve, skipping the PATH search. 
+   If the file has since disappeared, fall back to 
+   execvp_and_handle_error. */
 
-static inline void execvp_and_handle_error(char *program, char *argv[])
+static inline void exec_and_handle_error(char *path, char *argv[], char *envp[])
 {
-    if (execvp(program, argv) < 0)
+    if (path != NULL)
     {
-        fprintf(stderr, "%s ", program);
-        perror_exit("execvp()");
+        execve(path, argv, envp);
+        if (errno != ENOENT)
+        {
+            execvp_and_handle_error(path, argv, envp);
+        }
     }
+    execvp_and_handle_error(argv[0], argv, envp);
 }
 
 /* Close the pipes in the array pointed to by 
@@ -129,616 +1348,9731 @@ void init_shell()
     printf("  |         CS 315         |  \n\n");
 }
 
-/* Exit the shell. */
+/* Exit the shell with status. A non-interactive 
+   shell exits silently. */
 
-void exit_shell()
+void exit_shell(int status)
 {
+    job_hangup();
+    if (stats_fd >= 0)
+    {
+        write_cache_stats();
+    }
+    if (!interactive)
+    {
+        exit(status);
+    }
     printf("\n");
     printf("...Exiting shell\n");
     printf("Exited shell!\n\n");
-    exit(EXIT_SUCCESS);
+    exit(status);
 }
 
-/* Print the shell prompt. */
+/* Resolve the prompt components that cannot change 
+   while the shell runs (user, hostname and format)
+   once, along with the initial working directory. */
 
-void print_prompt()
+void init_prompt()
 {
-    char *username, *cdirectory;
-    char hostname[MAX_PATH + 1], cdir_path[MAX_PATH + 1];
-    int print_basic_prompt = 0;
-
-    if ((username = getenv("USER")) == NULL)
+    prompt.user = getenv("USER");
+    if (gethostname(prompt.hostname, MAX_PATH + 1) < 0)
     {
-        print_basic_prompt = 1;
+        prompt.hostname[0] = '\0';
     }
-    if (gethostname(hostname, MAX_PATH + 1) < 0)
+    prompt.hostname[MAX_PATH] = '\0';
+    prompt.home = getenv("HOME");
+    prompt.root = (geteuid() == 0);
+    prompt.format = getenv(PROMPT_ENV);
+    prompt.default_format = (prompt.format == NULL);
+    if (prompt.default_format)
     {
-        print_basic_prompt = 1;
+        prompt.format = DEFAULT_PROMPT;
     }
-    if (getcwd(cdir_path, MAX_PATH + 1) == NULL)
+    prompt_update_cwd();
+}
+
+/* Refresh the cached working directory. Must be called
+   whenever the shell itself changes directory. */
+
+void prompt_update_cwd()
+{
+    prompt.have_cwd = (getcwd(prompt.cwd, MAX_PATH + 1) != NULL);
+    prompt.dirty = 1;
+}
+
+/* Append len bytes of str to the rendered prompt, 
+   truncating at the end of the prompt buffer. */
+
+static void prompt_append(char *str, size_t len)
+{
+    if (prompt.len + len > PROMPT_BUF_SIZE)
     {
-        print_basic_prompt = 1;
+        len = PROMPT_BUF_SIZE - prompt.len;
     }
+    memcpy(prompt.buf + prompt.len, str, len);
+    prompt.len += len;
+}
+
+/* Render the prompt format into the prompt buffer. 
+   Supported escapes: \u user, \h hostname up to the
+   first '.', \H hostname, \w working directory with
+   $HOME shown as ~, \W its last component, \$ '#' 
+   for root and '$' otherwise, \n new line and \\. 
+   The default format falls back to a basic prompt if
+   any of its components is unavailable. */
 
-    /* Print simple prompt if any of the above fails. */
-    if (print_basic_prompt)
+void render_prompt()
+{
+    size_t home_len = (prompt.home == NULL) ? 0 : strlen(prompt.home);
+    char *cwd_base;
+
+    prompt.len = 0;
+    prompt.dirty = 0;
+    if (prompt.default_format && (prompt.user == NULL || prompt.hostname[0] == '\0' || !prompt.have_cwd))
     {
-        printf("SHELL$ ");
+        prompt_append(BASIC_PROMPT, strlen(BASIC_PROMPT));
+        return;
     }
-    else        
+    if (!prompt.have_cwd)
     {
-        cdirectory = strrchr(cdir_path, '/') + 1;   
-        printf("[%s@%s %s] JSHELL$ ", username, hostname, cdirectory);
+        prompt.cwd[0] = '\0';
+    }
+    cwd_base = strrchr(prompt.cwd, '/');
+    if (cwd_base == NULL)
+    {
+        cwd_base = prompt.cwd;
+    }
+    else if (cwd_base[1] != '\0' || cwd_base != prompt.cwd)
+    {
+        cwd_base++;
     }
 
-}
-
-/* Get up to MAX_SHELL_INPUT bytes from user 
-   input into the buffer starting at buf. The 
-   trailing new line will be replaced with '\0'.
-   If the user shortcuts Cltr-D or inputs "exit",
-   the program will exit. If fgets fails, an error 
-   diagnostic will be printed, and the program will exit. */
-
-void get_input(char *buf)
-{
-    if (fgets(buf, MAX_INPUT, stdin) == NULL)
+    for (char *c = prompt.format; *c != '\0'; c++)
     {
-        /* Check end-of-line (CLTR-D). */
-        if (feof(stdin))
+        if (*c != '\\' || c[1] == '\0')
         {
-            exit_shell();
+            prompt_append(c, 1);
+            continue;
         }
-        else
+        switch (*++c)
         {
-            perror_exit("get_input()");
+            case 'u':
+                if (prompt.user != NULL)
+                {
+                    prompt_append(prompt.user, strlen(prompt.user));
+                }
+                break;
+            case 'h':
+                prompt_append(prompt.hostname, strcspn(prompt.hostname, "."));
+                break;
+            case 'H':
+                prompt_append(prompt.hostname, strlen(prompt.hostname));
+                break;
+            case 'w':
+                if (home_len > 1 && strncmp(prompt.cwd, prompt.home, home_len) == 0
+                    && (prompt.cwd[home_len] == '/' || prompt.cwd[home_len] == '\0'))
+                {
+                    prompt_append("~", 1);
+                    prompt_append(prompt.cwd + home_len, strlen(prompt.cwd + home_len));
+                }
+                else
+                {
+                    prompt_append(prompt.cwd, strlen(prompt.cwd));
+                }
+                break;
+            case 'W':
+                prompt_append(cwd_base, strlen(cwd_base));
+                break;
+            case '$':
+                prompt_append(prompt.root ? "#" : "$", 1);
+                break;
+            case 'n':
+                prompt_append("\n", 1);
+                break;
+            default:
+                prompt_append(c - 1, 2);
+                break;
         }
     }
+}
 
-    /* User inputs exit. */
-    if (strcmp(buf, "exit\n") == 0)
+/* Print the shell prompt. The prompt is rendered from
+   the cached prompt state only when that state has 
+   changed, and written with a single write. Pending 
+   stdio output is flushed first so it stays in order. */
+
+void print_prompt()
+{
+    if (prompt.dirty)
+    {
+        render_prompt();
+    }
+    fflush(stdout);
+    if (write(STDOUT_FILENO, prompt.buf, prompt.len) < 0)
     {
-        exit_shell();
+        perror("write()");
     }
+}
+
+/* Get the next line of the shell's input, allocated
+   from the line arena and valid until the arena is 
+   reset. The trailing new line is removed. If the 
+   input ends (Cltr-D), the program will exit with 
+   the status of the last command. If reading fails, 
+   an error diagnostic will be printed, and the 
+   program will exit. */
+
+char *get_input()
+{
+    char *buf;
+    int len = editor.enabled ? editor_read_line(&line_arena, &buf) : read_line(&shell_input, &line_arena, &buf);
 
-    /* Replace trailing new line. */
-    size_t last_byte = strlen(buf) - 1;
-    if (buf[last_byte] == '\n')
+    if (len == READ_EOF)
+    {
+        exit_shell(last_status);
+    }
+    else if (len == READ_ERROR)
     {
-        buf[last_byte] = '\0';
+        perror_exit("get_input()");
     }
+    return buf;
 }
 
-/* Parse an input string by delimiter dlim. 
-   If the input represents a regular command,
-   it will execute after fully parsing the string. 
-   If not, the function will fork to perform
-   either I/O redirection and/or piping.  */
+/* Select the shell's input from its arguments: 
+   "-c command" runs a single command string, a
+   file name runs that script, and no arguments 
+   read stdin. The shell is interactive only when 
+   reading stdin from a terminal. Returns -1 on
+   a usage error. */
 
-int parse_input_and_exec(char *input, char *dlim)
+int init_input(int argc, char *argv[])
 {
-    char *command[MAX_ARGS + 1] = {NULL,};
-    char *redirect_cmd[MAX_ARGS + 1] = {NULL,}; 
-    char *input_file = NULL;
-    char *token = strtok(input, dlim);
-    int output_before_pipe = 0;
-    int cmd_index = 0;
-    int redirect_mode = REG_CMD;
-    int pipe_fds[2]; 
+    shell_input.fd = STDIN_FILENO;
+    shell_input.start = 0;
+    shell_input.end = 0;
+    shell_input.eof = 0;
+    shell_name = argv[0];
 
-    for (int i = 0; i < MAX_INPUT; i++)
+    /* Arguments after the script (or after -c command 
+       and $0) are the positional parameters. */
+    if (argc > 1 && strcmp(argv[1], "-c") == 0)
     {
-        /* User has called too many args. */
-        if (cmd_index >= MAX_ARGS + 1)
+        if (argc < 3)
         {
-            printf("Too many args.\n");
-            return EXEC_FAILURE;
+            return -1;
         }
-
-        /* Reached end of input string. */
-        if (token == NULL)
+        shell_input.fd = -1;
+        shell_input.buf = argv[2];
+        shell_input.end = strlen(argv[2]);
+        shell_input.eof = 1;
+        if (argc > 3)
         {
-            command[cmd_index] = NULL;
-            break;
+            shell_name = argv[3];
+            positional = argv + 4;
+            num_positional = argc - 4;
         }
-
-        /* I/O Redirection. */
-        if (strcmp(token, "<") == 0)
+        return 0;
+    }
+    if (argc > 1)
+    {
+        shell_name = argv[1];
+        positional = argv + 2;
+        num_positional = argc - 2;
+        if ((shell_input.fd = open(argv[1], O_RDONLY | O_CLOEXEC)) < 0)
         {
-            if (redirect_mode != REG_CMD)
-            {
-                printf("Cannot perform redirection before input.\n");
-                return EXEC_FAILURE;
-            }
-            else
-            {
-                save_command(redirect_cmd, command, cmd_index);
-                redirect_mode = INPUT;
-                cmd_index = 0;
-            }
+            perror_exit(argv[1]);
         }
-        else if (strcmp(token, ">") == 0 || strcmp(token, ">>") == 0)
+    }
+    if ((shell_input.buf = malloc(READ_BUF_SIZE)) == NULL)
+    {
+        perror_exit("malloc()");
+    }
+    interactive = (argc == 1 && isatty(STDIN_FILENO));
+    return 0;
+}
+
+/* Read the next line from reader into *line, allocated
+   from arena, without its trailing new line. Input is 
+   read in blocks of READ_BUF_SIZE bytes and split in the
+   buffer, so a script costs one read per block rather 
+   than per line, and lines may be of any length. Returns
+   the line length, READ_EOF at end of input, or 
+   READ_ERROR if read fails. */
+
+int read_line(struct input_reader *reader, struct arena *arena, char **line)
+{
+    size_t len = 0;
+    size_t cap = INIT_LINE_SIZE;
+    int got_input = 0;
+
+    *line = arena_alloc(arena, cap);
+    while (1)
+    {
+        char *chunk, *newline;
+        size_t chunk_len;
+
+        /* Refill the buffer once it has been consumed. */
+        if (reader->start == reader->end)
         {
-            int output_mode;
-            (strcmp(token, ">>") == 0) ? (output_mode = OUTPUT_APPEND) : (output_mode = OUTPUT); 
+            ssize_t bytes;
 
-            if (redirect_mode == INPUT)
+            if (reader->eof)
             {
-                if (command[0] == NULL)
-                {
-                    printf("No file for input redirection.");
-                    return EXEC_FAILURE;
-                }
-                input_file = command[0];
+                break;
             }
-            else if (redirect_mode == OUTPUT || redirect_mode == OUTPUT_APPEND)
+            if (interactive)
             {
-                if (command[0] == NULL)
-                {
-                    printf("No file for output redirection.");
-                    return EXEC_FAILURE;
-                }
-                redirect_io(redirect_mode, NULL, command[0], 0);
+                event_wait_fd(reader->fd);
             }
-            else 
+            if ((bytes = read(reader->fd, reader->buf, READ_BUF_SIZE)) < 0)
             {
-                if (redirect_mode == PIPE)
+                if (errno == EINTR)
                 {
-                    output_before_pipe = 1;
+                    continue;
                 }
-                save_command(redirect_cmd, command, cmd_index);
+                return READ_ERROR;
             }
-            redirect_mode = output_mode;
-            cmd_index = 0;
-        }
-        else if (strcmp(token, "|") == 0)
-        {
-            if (redirect_mode == OUTPUT || redirect_mode == OUTPUT_APPEND)
-            {
-                printf("Cannot perform output operation before piping.");
-                return EXEC_FAILURE;
-            }
-            else if (redirect_mode == PIPE)
+            if (bytes == 0)
             {
-                /* Intermediary pipe. */
-                if (command[0] == NULL)
-                {
-                    printf("Missing program to pipe to.\n");
-                    return EXEC_FAILURE;
-                }
-                command[cmd_index] = NULL;
-                inter_pipe(pipe_fds, command);
+                reader->eof = 1;
+                break;
             }
-            else
+            reader->start = 0;
+            reader->end = bytes;
+        }
+
+        /* Copy up to the next new line (or the end of the buffer). */
+        got_input = 1;
+        chunk = reader->buf + reader->start;
+        newline = memchr(chunk, '\n', reader->end - reader->start);
+        chunk_len = (newline == NULL) ? reader->end - reader->start : (size_t) (newline - chunk);
+        if (len + chunk_len + 1 > cap)
+        {
+            size_t new_cap = cap * 2;
+
+            while (len + chunk_len + 1 > new_cap)
             {
-                /* First pipe. */
-                if (redirect_mode == INPUT)
-                {
-                    input_pipe_redirect(pipe_fds, redirect_cmd, command[0]);
-                }
-                else
-                {
-                    command[cmd_index] = NULL;
-                    input_pipe(pipe_fds, command);
-                }
+                new_cap *= 2;
             }
-            cmd_index = 0;
-            redirect_mode = PIPE;
+            *line = arena_grow(arena, *line, cap, new_cap);
+            cap = new_cap;
         }
-        else
+        memcpy(*line + len, chunk, chunk_len);
+        len += chunk_len;
+        reader->start += chunk_len;
+        if (newline != NULL)
         {
-            /* No special characters found; save current arg. */
-            command[cmd_index] = token;
-            cmd_index++;
+            reader->start++;
+            break;
         }
-        token = strtok(NULL, dlim);
     }
 
-    /* Execute final command(s) after fully reading input string. */
-    if (redirect_mode == REG_CMD)
+    if (!got_input)
     {
-        exec_command(REG_CMD, command, 0);
+        return READ_EOF;
     }
-    else if (command[0] == NULL)
+    (*line)[len] = '\0';
+    return len;
+}
+
+/* Parse an input line and execute it. The line is
+   first split into tokens in a single pass, then 
+   parsed into a list of pipelines, each validated 
+   as a whole before execute_pipeline forks anything. 
+   A syntax error anywhere runs nothing. */
+
+int parse_input_and_exec(char *input)
+{
+    struct command_list *list;
+    struct parse_entry *entry;
+    int result;
+
+    if (parse_cached(input, &list, &entry) < 0)
     {
-        printf("No file for I/O redirection.\n");
+        parse_done(entry);
+        last_status = SYNTAX_ERROR;
         return EXEC_FAILURE;
     }
-    else if (redirect_mode == INPUT)
-    {
-        redirect_io(INPUT, redirect_cmd, command[0], 1);
-    }
-    else if (redirect_mode == OUTPUT || redirect_mode == OUTPUT_APPEND)
+    result = (list == NULL) ? EXEC_SUCCESS : execute_list(list);
+    parse_done(entry);
+    unwind_type = UNWIND_NONE;
+    return result;
+}
+
+/* Parse input through the parse cache, so a line run
+   again, as in a loop body or a script repeating 
+   itself, skips the tokenizer and parser. A line seen
+   before, matched by hash and then text, reuses its 
+   command list; everything that depends on the shell's
+   state (substitutions, variables, globs, here-string
+   and process substitution fds) is still expanded each
+   time it runs. A new line is parsed into the arena of
+   the least recently used entry. A line that went on 
+   to read more lines of input, for a here-document or
+   a compound command left open, is never cached, since
+   those lines are not part of its text. The entry 
+   holding the list is stored in entry and stays 
+   active until parse_done; if every entry is active,
+   the line is parsed into the line arena instead and
+   entry is NULL. Returns as parse_list. */
+
+int parse_cached(char *input, struct command_list **list, struct parse_entry **entry)
+{
+    unsigned int hash = hash_string(input);
+    unsigned long lines = continuation_lines;
+    struct parse_entry *victim = NULL;
+    struct arena saved;
+    size_t len;
+    int result;
+
+    *entry = NULL;
+    for (int i = 0; i < PARSE_CACHE_SIZE; i++)
     {
-        if (input_file != NULL)
-        {
-            exec_redir_bothio(redirect_mode, redirect_cmd, input_file, command[0]);
-        }
-        else if (output_before_pipe)
+        struct parse_entry *slot = &parse_cache[i];
+
+        if (slot->line != NULL && slot->hash == hash && strcmp(slot->line, input) == 0)
         {
-            output_pipe_redirect(pipe_fds, redirect_mode, redirect_cmd, command[0]);
+            slot->used = ++parse_clock;
+            slot->active++;
+            parse_hits++;
+            *list = slot->list;
+            *entry = slot;
+            return 0;
         }
-        else
+        if (slot->active == 0 && (victim == NULL || slot->used < victim->used))
         {
-            redirect_io(redirect_mode, redirect_cmd, command[0], 1);
+            victim = slot;
         }
     }
-    else if (redirect_mode == PIPE)
+    parse_misses++;
+    if (victim == NULL)
     {
-        output_pipe(pipe_fds, command);
+        return parse_list(input, list);
     }
 
-    return EXEC_SUCCESS;
+    /* Parse a copy of the line with the entry's arena
+       standing in for the line arena. */
+    *entry = victim;
+    victim->active++;
+    arena_reset(&victim->arena);
+    victim->line = NULL;
+    saved = line_arena;
+    line_arena = victim->arena;
+    len = strlen(input) + 1;
+    input = memcpy(arena_alloc(&line_arena, len), input, len);
+    result = parse_list(input, list);
+    victim->arena = line_arena;
+    line_arena = saved;
+    if (result == 0 && *list != NULL && continuation_lines == lines)
+    {
+        victim->hash = hash;
+        victim->line = input;
+        victim->list = *list;
+        victim->used = ++parse_clock;
+    }
+    return result;
 }
 
-/* Save the current command by copying cmd_index strings 
-   from the array pointed to by command into the dest array. 
-   The new destination will be NULL-terminated, and the
-   first index of the original array will be set to NULL.  */
+/* End a run of a list from parse_cached, leaving its
+   entry free for eviction once no run is under way. */
 
-void save_command(char *dest[], char *command[], int cmd_index)
+void parse_done(struct parse_entry *entry)
 {
-    command[cmd_index] = NULL;
-    for (int i = 0; i <= cmd_index; i ++)
+    if (entry != NULL)
     {
-        dest[i] = command[i];
+        entry->active--;
     }
-    command[0] = NULL;
 }
 
-/* Execute a command. The array representing the 
-   command and its arguments must be a NULL-terminated 
-   array of strings. I/O redirection is supported, and
-   mode must be set to one of the 4 following
-   values: REG, INPUT, OUTPUT, OUTPUT_APPEND.
-   If mode is REG, the command is a regular command, 
-   and io_file may be replaced with NULL.
-   If mode is INPUT, OUTPUT or OUTPUT_APPEND, io_file_fd
-   must be an open file descriptor. Piping is not supported. */
+/* Split input into tokens in one pass over its bytes. 
+   Blanks (spaces and tabs) separate words, and the 
+   operators | || & && ; < > >> need no blanks around
+   them, nor do << <<- <<< and the process 
+   substitutions <(...) and >(...), which become a
+   word holding the command inside the parentheses.
+   Single quotes keep everything literally, double 
+   quotes keep everything but \\, \", \$ and \`, and 
+   a backslash outside quotes escapes the next byte.
+   Command substitutions $(...) and `...` and the 
+   variables $name, ${name} and the special parameters
+   ($?, $$, $#, $@, $*, $0 ... $9), quoted or not,
+   are kept in their word between marks, and quoted
+   glob characters after GLOB_ESCAPE. A # starting a
+   word comments out the rest of the line. Word text 
+   is written, with quotes removed, into one arena 
+   buffer three times the size of the input, since $x
+   takes three bytes once marked and a word one more 
+   for GLOB_MARK. The token array ends with a TOK_END 
+   token. Returns the number of tokens before TOK_END,
+   or -1 after printing a diagnostic. */
 
-int exec_command(int mode, char *command[], int io_file_fd)
+int tokenize(char *input, struct token **tokens)
 {
-    pid_t child_pid;
-    int redirect_fd;
+    size_t input_len = strlen(input);
+    char *words = arena_alloc(&line_arena, 3 * input_len + 2);
+    int max_tokens = INIT_TOKENS;
+    int num_tokens = 0;
+    int glob, escaped;
+    char *c = input;
 
-    if ((child_pid = fork()) == -1)
-    {
-        perror("fork()");
-    }
-    else if (child_pid == 0)
+    *tokens = arena_alloc(&line_arena, max_tokens * sizeof(struct token));
+    while (1)
     {
-        /* I/O Redirection (Single). */
-        if (mode != REG_CMD)
+        struct token *token;
+
+        while (*c == ' ' || *c == '\t')
         {
-            if (mode == INPUT)
-            {
-                redirect_fd = STDIN_FILENO;
-            }
-            else if (mode == OUTPUT || mode == OUTPUT_APPEND)
-            {
-                redirect_fd = STDOUT_FILENO;
-            }
-            else
-            {
-                printf("Unsupported mode.\n");
-                exit(EXIT_FAILURE);
-            }
-            if (dup2(io_file_fd, redirect_fd) < 0)
-            {
-                perror_exit("dup2()");
-            }
-            if (close(io_file_fd) < 0)
-            {
-                perror_exit("close()");
-            }
+            c++;
+        }
+        if (*c == '#')
+        {
+            c += strlen(c);
         }
 
-        /* Child process executes the program. */
-        execvp_and_handle_error(command[0], command);
-    }
-    else
-    {
-        wait(NULL);
-    }
+        if (num_tokens == max_tokens)
+        {
+            *tokens = arena_grow(&line_arena, *tokens, max_tokens * sizeof(struct token), max_tokens * 2 * sizeof(struct token));
+            max_tokens *= 2;
+        }
+        token = &(*tokens)[num_tokens];
+        token->start = c;
+        token->text = NULL;
+        token->subst = 0;
+        token->fd = -1;
+        token->expand = 0;
 
-    return EXEC_SUCCESS;
+        if (*c == '\0')
+        {
+            token->type = TOK_END;
+            token->end = c;
+            return num_tokens;
+        }
+        num_tokens++;
+
+        /* Operators. */
+        if (*c == '|')
+        {
+            token->type = (c[1] == '|') ? TOK_OR : TOK_PIPE;
+            c += (c[1] == '|') ? 2 : 1;
+            token->end = c;
+            continue;
+        }
+        if (*c == '&' && c[1] == '>')
+        {
+            token->type = (c[2] == '>') ? TOK_APPEND_ALL : TOK_OUTPUT_ALL;
+            c += (c[2] == '>') ? 3 : 2;
+            token->end = c;
+            continue;
+        }
+        if (*c == '&')
+        {
+            token->type = (c[1] == '&') ? TOK_AND : TOK_BACKGROUND;
+            c += (c[1] == '&') ? 2 : 1;
+            token->end = c;
+            continue;
+        }
+        if (*c == ';')
+        {
+            token->type = TOK_SEMI;
+            token->end = ++c;
+            continue;
+        }
+        if ((*c == '<' || *c == '>') && c[1] == '(')
+        {
+            /* Process substitution: up to the matching parenthesis. */
+            token->type = TOK_WORD;
+            token->subst = *c;
+            token->text = words;
+            if ((c = copy_parens(c + 1, &words, "process")) == NULL)
+            {
+                return -1;
+            }
+            *words++ = '\0';
+            token->end = ++c;
+            continue;
+        }
+        /* A single digit right before < or > names the fd 
+           to redirect, as in 2>file; 10, 11, ... are shell
+           fds (see SAVED_FD_BASE), so 12>file is a word. */
+        if (isdigit((unsigned char) *c) && (c[1] == '<' || c[1] == '>') && c[2] != '(')
+        {
+            token->fd = *c++ - '0';
+        }
+        if (*c == '<')
+        {
+            if (c[1] == '<')
+            {
+                token->type = (c[2] == '<') ? TOK_HERESTRING : (c[2] == '-') ? TOK_HEREDOC_STRIP : TOK_HEREDOC;
+                c += (c[2] == '<' || c[2] == '-') ? 3 : 2;
+                token->end = c;
+                continue;
+            }
+            token->type = (c[1] == '&') ? TOK_DUP_INPUT : (c[1] == '>') ? TOK_READ_WRITE : TOK_INPUT;
+            c += (c[1] == '&' || c[1] == '>') ? 2 : 1;
+            token->end = c;
+            continue;
+        }
+        if (*c == '>')
+        {
+            token->type = (c[1] == '&') ? TOK_DUP_OUTPUT : (c[1] == '>') ? TOK_OUTPUT_APPEND : TOK_OUTPUT;
+            c += (c[1] == '&' || c[1] == '>') ? 2 : 1;
+            token->end = c;
+            continue;
+        }
+
+        /* Word: copy bytes up to the next unquoted blank or
+           operator, after a byte kept for GLOB_MARK. */
+        token->type = TOK_WORD;
+        token->text = words++;
+        glob = escaped = 0;
+        while (*c != '\0' && strchr(WORD_BREAKS, *c) == NULL)
+        {
+            if (*c == '\'')
+            {
+                char *close_quote = strchr(c + 1, '\'');
+
+                if (close_quote == NULL)
+                {
+                    printf("Unterminated quote.\n");
+                    return -1;
+                }
+                for (c++; c < close_quote; c++)
+                {
+                    escaped |= copy_quoted(*c, &words);
+                }
+                c++;
+            }
+            else if (*c == '"')
+            {
+                for (c++; *c != '"'; c++)
+                {
+                    if (*c == '\0')
+                    {
+                        printf("Unterminated quote.\n");
+                        return -1;
+                    }
+                    if ((*c == '$' && c[1] == '(') || *c == '`')
+                    {
+                        if ((c = copy_command_subst(c, &words, QSUBST_MARK)) == NULL)
+                        {
+                            return -1;
+                        }
+                        token->expand = 1;
+                        continue;
+                    }
+                    if (*c == '$' && is_variable(c))
+                    {
+                        if ((c = copy_variable(c, &words, QVAR_MARK)) == NULL)
+                        {
+                            return -1;
+                        }
+                        token->expand = 1;
+                        continue;
+                    }
+                    if (*c == '\\' && c[1] != '\0' && strchr(DQUOTE_ESCAPES, c[1]) != NULL)
+                    {
+                        c++;
+                    }
+                    escaped |= copy_quoted(*c, &words);
+                }
+                c++;
+            }
+            else if ((*c == '$' && c[1] == '(') || *c == '`')
+            {
+                if ((c = copy_command_subst(c, &words, SUBST_MARK)) == NULL)
+                {
+                    return -1;
+                }
+                token->expand = 1;
+                c++;
+            }
+            else if (*c == '$' && is_variable(c))
+            {
+                if ((c = copy_variable(c, &words, VAR_MARK)) == NULL)
+                {
+                    return -1;
+                }
+                token->expand = 1;
+                c++;
+            }
+            else if (*c == '\\' && c[1] != '\0')
+            {
+                escaped |= copy_quoted(c[1], &words);
+                c += 2;
+            }
+            else
+            {
+                glob |= (*c == '*' || *c == '?' || (*c == '[' && c[strcspn(c, GLOB_BRACKET_BREAKS)] == ']'));
+                *words++ = *c++;
+            }
+        }
+        *words++ = '\0';
+        token->end = c;
+
+        /* A word with unquoted glob characters starts with
+           GLOB_MARK and is globbed when its command runs. */
+        if (glob)
+        {
+            *token->text = GLOB_MARK;
+            token->expand = 1;
+        }
+        else if (escaped)
+        {
+            glob_literal(++token->text);
+        }
+        else
+        {
+            token->text++;
+        }
+    }
+}
+
+/* Copy the text of a parenthesized substitution, from
+   c (its opening parenthesis) up to the matching closing
+   one, into *words unchanged: quoted and escaped 
+   parentheses do not count, and nested ones must match.
+   Returns the closing parenthesis, or NULL after 
+   printing a diagnostic naming the kind of substitution
+   (what) if there is none. */
+
+char *copy_parens(char *c, char **words, char *what)
+{
+    char *out = *words;
+    int depth = 1;
+
+    for (c++; depth > 0; c++)
+    {
+        if (*c == '\0')
+        {
+            printf("Unterminated %s substitution.\n", what);
+            return NULL;
+        }
+        if (*c == '\'' || *c == '"')
+        {
+            char *close_quote = c;
+
+            while (*++close_quote != *c && *close_quote != '\0')
+            {
+                close_quote += (*c == '"' && *close_quote == '\\' && close_quote[1] != '\0');
+            }
+            if (*close_quote == '\0')
+            {
+                printf("Unterminated quote.\n");
+                return NULL;
+            }
+            memcpy(out, c, close_quote + 1 - c);
+            out += close_quote + 1 - c;
+            c = close_quote;
+            continue;
+        }
+        if (*c == '\\' && c[1] != '\0')
+        {
+            *out++ = *c++;
+            *out++ = *c;
+            continue;
+        }
+        depth += (*c == '(') - (*c == ')');
+        if (depth > 0)
+        {
+            *out++ = *c;
+        }
+    }
+    *words = out;
+    return c - 1;
+}
+
+/* Copy the command substitution $(...) or `...` at c
+   into *words as mark, the command text and SUBST_END,
+   for expand_command to run once the pipeline is about
+   to execute. Inside backquotes, \ before $, ` or \ 
+   is removed. Returns the substitution's last byte, or
+   NULL after printing a diagnostic. */
+
+char *copy_command_subst(char *c, char **words, int mark)
+{
+    *(*words)++ = mark;
+    if (*c == '$')
+    {
+        if ((c = copy_parens(c + 1, words, "command")) == NULL)
+        {
+            return NULL;
+        }
+    }
+    else
+    {
+        for (c++; *c != '`'; c++)
+        {
+            if (*c == '\0')
+            {
+                printf("Unterminated command substitution.\n");
+                return NULL;
+            }
+            if (*c == '\\' && (c[1] == '$' || c[1] == '`' || c[1] == '\\'))
+            {
+                c++;
+            }
+            *(*words)++ = *c;
+        }
+    }
+    *(*words)++ = SUBST_END;
+    return c;
+}
+
+/* Whether the $ at c starts a variable: ${, a name or
+   a special parameter. */
+
+int is_variable(char *c)
+{
+    return c[1] == '{' || (c[1] != '\0' && strchr(SPECIAL_PARAMS, c[1]) != NULL) || name_length(c + 1) > 0;
+}
+
+/* Copy the variable $name or ${name}, or the special 
+   parameter such as $? or ${10}, at c into *words as 
+   mark, the name and SUBST_END. Unbraced, a parameter
+   is one character, so $10 is $1 then 0. Returns the
+   variable's last byte, or NULL after printing a 
+   diagnostic for a bad ${...}. */
+
+char *copy_variable(char *c, char **words, int mark)
+{
+    int braces = (c[1] == '{');
+    char *name = c + 1 + braces;
+    int len = name_length(name);
+
+    if (len == 0 && *name != '\0' && strchr(SPECIAL_PARAMS, *name) != NULL)
+    {
+        for (len = 1; braces && isdigit((unsigned char) name[0]) && isdigit((unsigned char) name[len]); len++)
+        {
+            ;
+        }
+    }
+
+    if (len == 0 || (braces && c[2 + len] != '}'))
+    {
+        printf("Bad substitution.\n");
+        return NULL;
+    }
+    *(*words)++ = mark;
+    memcpy(*words, c + 1 + braces, len);
+    *words += len;
+    *(*words)++ = SUBST_END;
+    return c + len + 2 * braces;
+}
+
+/* Whether a word token is an assignment: a name, as 
+   written (so not quoted), followed by =. */
+
+int is_assignment(struct token *token)
+{
+    int len;
+
+    return token->type == TOK_WORD && !token->subst && (len = name_length(token->start)) > 0 && token->start[len] == '=';
+}
+
+/* Whether a word token is the reserved word word, as
+   written (so not quoted or expanded). */
+
+int is_keyword(struct token *token, char *word)
+{
+    size_t len = strlen(word);
+
+    return token->type == TOK_WORD && !token->expand && !token->subst && (size_t) (token->end - token->start) == len
+           && strncmp(token->start, word, len) == 0;
+}
+
+/* Parse an input line, and the lines after it that a
+   compound command left open on it continues onto,
+   into a compiled command list. *list is set to NULL
+   for a line with no commands. Returns -1 after
+   printing a diagnostic on a syntax error. */
+
+int parse_list(char *input, struct command_list **list)
+{
+    struct compiler compiler;
+    int num_tokens;
+
+    *list = NULL;
+    if ((num_tokens = tokenize(input, &compiler.tokens)) <= 0)
+    {
+        return num_tokens;
+    }
+    compiler.pos = 0;
+    compiler.depth = 0;
+    *list = list_create();
+    if (compile_list(&compiler, *list, NULL) < 0)
+    {
+        *list = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/* Allocate an empty command list in the line arena. */
+
+struct command_list *list_create()
+{
+    struct command_list *list = arena_alloc(&line_arena, sizeof(struct command_list));
+
+    list->max_code = INIT_CODE;
+    list->code = arena_alloc(&line_arena, list->max_code * sizeof(struct op));
+    list->num_code = 0;
+    list->max_pipelines = INIT_COMMANDS;
+    list->pipelines = arena_alloc(&line_arena, list->max_pipelines * sizeof(struct pipeline));
+    list->num_pipelines = 0;
+    return list;
+}
+
+/* Append an op of the given type and arg to list,
+   with no target yet, and return its index. */
+
+int compile_emit(struct command_list *list, int type, int arg)
+{
+    struct op *op;
+
+    if (list->num_code == list->max_code)
+    {
+        list->code = arena_grow(&line_arena, list->code, list->max_code * sizeof(struct op), list->max_code * 2 * sizeof(struct op));
+        list->max_code *= 2;
+    }
+    op = &list->code[list->num_code];
+    op->type = type;
+    op->arg = arg;
+    op->target = -1;
+    op->name = NULL;
+    return list->num_code++;
+}
+
+/* The token at the compiler's position. Inside a
+   compound command the end of a line only separates
+   commands, so once the line's tokens are used up the
+   next line of input is read and tokenized. Returns
+   NULL after printing a diagnostic if the input ends
+   first or the line does not tokenize. */
+
+struct token *compile_peek(struct compiler *c)
+{
+    while (c->depth > 0 && c->tokens[c->pos].type == TOK_END)
+    {
+        char *line = read_continuation();
+
+        if (line == NULL)
+        {
+            printf("Syntax error: unexpected end of input.\n");
+            return NULL;
+        }
+        if (tokenize(line, &c->tokens) < 0)
+        {
+            return NULL;
+        }
+        c->pos = 0;
+    }
+    return &c->tokens[c->pos];
+}
+
+/* Compile commands into list up to one of the NULL
+   terminated reserved words terminators, which is
+   consumed, or without terminators up to the end of
+   the line. Commands are and-or lists separated by ;,
+   & or new lines. Returns the index of the terminator
+   found (0 without terminators), or -1 after printing
+   a diagnostic on a syntax error. */
+
+int compile_list(struct compiler *c, struct command_list *list, char *terminators[])
+{
+    while (1)
+    {
+        struct token *token;
+
+        if ((token = compile_peek(c)) == NULL)
+        {
+            return -1;
+        }
+        if (token->type == TOK_END)
+        {
+            return 0;
+        }
+        for (int i = 0; terminators != NULL && terminators[i] != NULL; i++)
+        {
+            if (is_keyword(token, terminators[i]))
+            {
+                c->pos++;
+                return i;
+            }
+        }
+        if (compile_and_or(c, list) < 0)
+        {
+            return -1;
+        }
+
+        token = &c->tokens[c->pos];
+        if (token->type == TOK_SEMI || token->type == TOK_BACKGROUND)
+        {
+            c->pos++;
+        }
+        else if (token->type != TOK_END)
+        {
+            printf("Syntax error near unexpected token '%.*s'.\n", (int) (token->end - token->start), token->start);
+            return -1;
+        }
+    }
+}
+
+/* Compile a list that must hold at least one command,
+   as the parts of compound commands must. Returns as
+   compile_list. */
+
+int compile_body(struct compiler *c, struct command_list *list, char *terminators[])
+{
+    int num_pipelines = list->num_pipelines;
+    int found = compile_list(c, list, terminators);
+
+    if (found >= 0 && list->num_pipelines == num_pipelines)
+    {
+        struct token *token = &c->tokens[c->pos - 1];
+
+        printf("Syntax error near unexpected token '%.*s'.\n", (int) (token->end - token->start), token->start);
+        return -1;
+    }
+    return found;
+}
+
+/* Compile an and-or list: pipelines joined by && and
+   ||. A pipeline after && is jumped over unless the
+   last status is 0, and one after || unless it is not,
+   so a skipped pipeline leaves the status alone and
+   a && b || c runs c when either a or b fails. A
+   trailing & puts the last pipeline in the background.
+   Returns -1 after printing a diagnostic. */
+
+int compile_and_or(struct compiler *c, struct command_list *list)
+{
+    int skip = -1;
+
+    while (1)
+    {
+        struct pipeline *pipeline;
+        struct token *token;
+        int type;
+
+        if (list->num_pipelines == list->max_pipelines)
+        {
+            list->pipelines = arena_grow(&line_arena, list->pipelines, list->max_pipelines * sizeof(struct pipeline), list->max_pipelines * 2 * sizeof(struct pipeline));
+            list->max_pipelines *= 2;
+        }
+        pipeline = &list->pipelines[list->num_pipelines];
+        if (parse_pipeline(c, pipeline) < 0)
+        {
+            return -1;
+        }
+        compile_emit(list, OP_PIPELINE, list->num_pipelines++);
+        if (skip >= 0)
+        {
+            list->code[skip].target = list->num_code;
+        }
+
+        /* The operator after the pipeline joins it to the next. */
+        token = &c->tokens[c->pos];
+        type = token->type;
+        if (type == TOK_BACKGROUND)
+        {
+            pipeline->background = 1;
+        }
+        if (type != TOK_AND && type != TOK_OR)
+        {
+            return 0;
+        }
+        c->pos++;
+        if (compile_peek(c) == NULL)
+        {
+            return -1;
+        }
+        if (c->tokens[c->pos].type == TOK_END)
+        {
+            printf("Syntax error: missing command after '%.*s'.\n", (int) (token->end - token->start), token->start);
+            return -1;
+        }
+        skip = compile_emit(list, (type == TOK_AND) ? OP_JUMP_FAIL : OP_JUMP_OK, 0);
+    }
+}
+
+/* Parse the pipeline at the compiler's position into
+   result: commands separated by |, each made of words
+   and < > >> << <<- <<< redirections in any order, or
+   a compound command followed by redirections, and
+   the whole optionally prefixed by the time keyword.
+   The body of each here-document is read from the
+   shell's input as soon as its operator is parsed.
+   The position is left on the token that ends the
+   pipeline. Returns -1 after printing a diagnostic on
+   a syntax error. */
+
+int parse_pipeline(struct compiler *c, struct pipeline *result)
+{
+    struct token *tokens = c->tokens;
+    struct token *first = tokens;
+    struct command *command;
+    int max_commands = INIT_COMMANDS;
+    int i = c->pos;
+
+    result->commands = arena_alloc(&line_arena, max_commands * sizeof(struct command));
+    result->num_commands = 0;
+    result->background = 0;
+    result->timed = 0;
+    result->coproc = NULL;
+    result->fds = NULL;
+    result->num_fds = 0;
+    result->stages = NULL;
+    result->num_stages = 0;
+
+    /* A leading time keyword reports the pipeline's times. */
+    if (tokens[i].type == TOK_WORD && tokens[i].end - tokens[i].start == strlen(TIME_KEYWORD)
+        && strncmp(tokens[i].start, TIME_KEYWORD, strlen(TIME_KEYWORD)) == 0 && tokens[i + 1].type == TOK_WORD)
+    {
+        result->timed = 1;
+        i++;
+    }
+    result->text = tokens[i].start;
+    result->text_len = 0;
+
+    /* A leading coproc keyword runs the pipeline as a 
+       coprocess, named by the word after it if that is
+       followed by a compound command. */
+    if (is_keyword(&tokens[i], COPROC_KEYWORD) && tokens[i + 1].type == TOK_WORD)
+    {
+        result->coproc = COPROC_NAME;
+        i++;
+        if (!is_compound(&tokens[i]) && is_compound(&tokens[i + 1]) && !tokens[i].expand && !tokens[i].subst
+            && name_length(tokens[i].start) == tokens[i].end - tokens[i].start)
+        {
+            result->coproc = tokens[i++].text;
+        }
+    }
+
+    while (1)
+    {
+        /* Start a new command. */
+        if (result->num_commands == max_commands)
+        {
+            result->commands = arena_grow(&line_arena, result->commands, max_commands * sizeof(struct command), max_commands * 2 * sizeof(struct command));
+            max_commands *= 2;
+        }
+        command = &result->commands[result->num_commands++];
+        command_init(command);
+
+        for (int j = 0; reserved_words[j] != NULL; j++)
+        {
+            if (is_keyword(&tokens[i], reserved_words[j]))
+            {
+                printf("Syntax error near unexpected token '%s'.\n", reserved_words[j]);
+                return -1;
+            }
+        }
+
+        /* A compound command or function definition is 
+           compiled whole. A compound command may only be
+           followed by redirections, and a definition by
+           nothing. */
+        if (function_name(tokens, &i, &command->function) || is_compound(&tokens[i]))
+        {
+            c->pos = i;
+            if (parse_compound(c, command) < 0)
+            {
+                return -1;
+            }
+            tokens = c->tokens;
+            i = c->pos;
+        }
+
+        /* Words and redirections, up to the next operator. */
+        while (tokens[i].type == TOK_WORD || is_redirect_token(tokens[i].type))
+        {
+            if (command->argv.len == 0 && is_assignment(&tokens[i]))
+            {
+                command->expand |= tokens[i].expand;
+                argv_push(&command->assigns, glob_literal(tokens[i++].text));
+                continue;
+            }
+            if (command->body != NULL && (tokens[i].type == TOK_WORD || command->function != NULL))
+            {
+                printf("Syntax error near unexpected token '%.*s'.\n", (int) (tokens[i].end - tokens[i].start), tokens[i].start);
+                return -1;
+            }
+            if (tokens[i].type == TOK_WORD)
+            {
+                if (tokens[i].subst)
+                {
+                    add_substitution(command, &tokens[i], NULL);
+                }
+                command->expand |= tokens[i].expand;
+                argv_push(&command->argv, tokens[i++].text);
+                continue;
+            }
+            if (parse_redirect(command, &tokens[i]) < 0)
+            {
+                return -1;
+            }
+            i += 2;
+        }
+
+        /* Assignments alone set shell variables. */
+        if (command->argv.len == 0 && (command->assigns.len == 0 || result->num_commands > 1 || tokens[i].type == TOK_PIPE))
+        {
+            if (result->num_commands > 1)
+            {
+                printf("Missing program to pipe to.\n");
+            }
+            else
+            {
+                printf("Syntax error near unexpected token '%.*s'.\n", (int) (tokens[i].end - tokens[i].start), tokens[i].start);
+            }
+            return -1;
+        }
+        if (command->function != NULL && (result->num_commands > 1 || tokens[i].type == TOK_PIPE))
+        {
+            printf("Function definition in a pipeline.\n");
+            return -1;
+        }
+        command->words = command->argv;
+        command->env = command->assigns;
+        result->text_len = (tokens == first) ? (size_t) (tokens[i - 1].end - result->text) : strlen(result->text);
+        if (tokens[i].type == TOK_PIPE)
+        {
+            i++;
+            continue;
+        }
+        if (tokens[i].type != TOK_END && tokens[i].type != TOK_BACKGROUND && tokens[i].type != TOK_SEMI
+            && tokens[i].type != TOK_AND && tokens[i].type != TOK_OR)
+        {
+            printf("Syntax error near unexpected token '%.*s'.\n", (int) (tokens[i].end - tokens[i].start), tokens[i].start);
+            return -1;
+        }
+        break;
+    }
+
+    c->pos = i;
+    return 0;
+}
+
+/* Initialize a command with no words or redirections. */
+
+void command_init(struct command *command)
+{
+    argv_init(&command->argv);
+    argv_init(&command->assigns);
+    command->redirects = NULL;
+    command->last_redirect = &command->redirects;
+    command->substitutions = NULL;
+    command->expand = 0;
+    command->body = NULL;
+    command->function = NULL;
+}
+
+/* Whether a token is a reserved word that opens a
+   compound command. */
+
+int is_compound(struct token *token)
+{
+    for (int i = 0; compound_words[i] != NULL; i++)
+    {
+        if (is_keyword(token, compound_words[i]))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Whether the tokens at *pos start a function 
+   definition, name() or name () or function name, in
+   which case *name is set to the name and *pos is left
+   on what follows it. */
+
+int function_name(struct token *tokens, int *pos, char **name)
+{
+    struct token *token = &tokens[*pos];
+    int keyword = is_keyword(token, "function");
+    int len;
+
+    token += keyword;
+    if (token->type != TOK_WORD || token->expand || token->subst || (len = name_length(token->start)) == 0)
+    {
+        return 0;
+    }
+    if (token->end - token->start == len + 2 && strncmp(token->start + len, "()", 2) == 0)
+    {
+        token->text[len] = '\0';
+        *pos = token + 1 - tokens;
+    }
+    else if (token->end - token->start == len && is_keyword(token + 1, "()"))
+    {
+        *pos = token + 2 - tokens;
+    }
+    else if (keyword && token->end - token->start == len)
+    {
+        *pos = token + 1 - tokens;
+    }
+    else
+    {
+        return 0;
+    }
+    *name = token->text;
+    return 1;
+}
+
+/* Compile the compound command at the compiler's 
+   position, through its closing reserved word, into a
+   list of its own in command->body; for a function 
+   definition, whose name is already set, the { ... } 
+   group that follows. The command's only word is its
+   keyword (or the function's name), for job listings.
+   Returns -1 after printing a diagnostic. */
+
+int parse_compound(struct compiler *c, struct command *command)
+{
+    static char *brace_words[] = {"}", NULL};
+    struct token *token;
+    int result;
+
+    c->depth++;
+    if ((token = compile_peek(c)) == NULL)
+    {
+        return -1;
+    }
+    if (command->function != NULL && !is_keyword(token, "{"))
+    {
+        printf("Syntax error: function body must be a { ... } group.\n");
+        return -1;
+    }
+    command->body = list_create();
+    argv_push(&command->argv, (command->function != NULL) ? command->function : token->text);
+    c->pos++;
+    if (is_keyword(token, "if"))
+    {
+        result = compile_if(c, command->body);
+    }
+    else if (is_keyword(token, "while") || is_keyword(token, "until"))
+    {
+        result = compile_while(c, command->body, is_keyword(token, "until"));
+    }
+    else if (is_keyword(token, "for"))
+    {
+        result = compile_for(c, command->body);
+    }
+    else
+    {
+        result = compile_body(c, command->body, brace_words);
+    }
+    c->depth--;
+    return (result < 0) ? -1 : 0;
+}
+
+/* Compile the rest of if cond; then body; [elif cond;
+   then body; ...] [else body;] fi into body: each 
+   condition jumps over its part when it fails, and 
+   each part ends with a jump past the others, chained
+   through their targets until the end is known. With 
+   no else, a failed last condition sets the status to
+   0. */
+
+int compile_if(struct compiler *c, struct command_list *body)
+{
+    static char *then_words[] = {"then", NULL};
+    static char *part_words[] = {"fi", "elif", "else", NULL};
+    static char *fi_words[] = {"fi", NULL};
+    int end_chain = -1;
+    int found;
+
+    do
+    {
+        int fail, end;
+
+        if (compile_body(c, body, then_words) < 0)
+        {
+            return -1;
+        }
+        fail = compile_emit(body, OP_JUMP_FAIL, 0);
+        if ((found = compile_body(c, body, part_words)) < 0)
+        {
+            return -1;
+        }
+        end = compile_emit(body, OP_JUMP, 0);
+        body->code[end].target = end_chain;
+        end_chain = end;
+        body->code[fail].target = body->num_code;
+    } while (found == 1);
+
+    if (found == 2 && compile_body(c, body, fi_words) < 0)
+    {
+        return -1;
+    }
+    if (found == 0)
+    {
+        compile_emit(body, OP_STATUS, 0);
+    }
+    while (end_chain >= 0)
+    {
+        int next = body->code[end_chain].target;
+
+        body->code[end_chain].target = body->num_code;
+        end_chain = next;
+    }
+    return 0;
+}
+
+/* Compile the rest of while cond; do body; done (or 
+   until, which loops while cond fails) into body: 
+   OP_LOOP, the condition and a jump out when it ends 
+   the loop, the body, and OP_REPEAT back to the 
+   condition. */
+
+int compile_while(struct compiler *c, struct command_list *body, int until)
+{
+    static char *do_words[] = {"do", NULL};
+    static char *done_words[] = {"done", NULL};
+    int loop = compile_emit(body, OP_LOOP, 0);
+    int cond = body->num_code;
+    int exit, repeat, end;
+
+    if (compile_body(c, body, do_words) < 0)
+    {
+        return -1;
+    }
+    exit = compile_emit(body, until ? OP_JUMP_OK : OP_JUMP_FAIL, 0);
+    if (compile_body(c, body, done_words) < 0)
+    {
+        return -1;
+    }
+    repeat = compile_emit(body, OP_REPEAT, 0);
+    body->code[repeat].target = cond;
+    end = compile_emit(body, OP_LOOP_END, 0);
+    body->code[loop].arg = repeat;
+    body->code[loop].target = end;
+    body->code[exit].target = end;
+    return 0;
+}
+
+/* Compile the rest of for name [in word...]; do body;
+   done into body. The words, "$@" without in, are kept
+   as a pseudo-pipeline of one command, expanded by 
+   OP_FOR when the loop starts; OP_NEXT then assigns 
+   each in turn before the body runs. */
+
+int compile_for(struct compiler *c, struct command_list *body)
+{
+    static char *done_words[] = {"done", NULL};
+    struct token *token = &c->tokens[c->pos];
+    struct pipeline *words = &body->pipelines[body->num_pipelines];
+    struct command *command;
+    int loop, next, repeat, end;
+    char *name = token->text;
+
+    if (token->type != TOK_WORD || token->expand || token->subst || name_length(token->start) != token->end - token->start)
+    {
+        printf("Bad for loop variable '%.*s'.\n", (int) (token->end - token->start), token->start);
+        return -1;
+    }
+    words->commands = command = arena_alloc(&line_arena, sizeof(struct command));
+    words->num_commands = 1;
+    words->background = words->timed = 0;
+    words->coproc = NULL;
+    words->text = token->start;
+    words->text_len = token->end - token->start;
+    words->fds = NULL;
+    words->num_fds = 0;
+    words->stages = NULL;
+    words->num_stages = 0;
+    command_init(command);
+
+    token = &c->tokens[++c->pos];
+    if (is_keyword(token, "in"))
+    {
+        for (token++; token->type == TOK_WORD && !token->subst; token++)
+        {
+            command->expand |= token->expand;
+            argv_push(&command->argv, token->text);
+        }
+    }
+    else
+    {
+        argv_push(&command->argv, POSITIONAL_ALL);
+        command->expand = 1;
+    }
+    if (token->type != TOK_SEMI && token->type != TOK_END && !is_keyword(token, "do"))
+    {
+        printf("Syntax error near unexpected token '%.*s'.\n", (int) (token->end - token->start), token->start);
+        return -1;
+    }
+    c->pos = token - c->tokens + (token->type == TOK_SEMI);
+    command->words = command->argv;
+    command->env = command->assigns;
+    if ((token = compile_peek(c)) == NULL)
+    {
+        return -1;
+    }
+    if (!is_keyword(token, "do"))
+    {
+        printf("Syntax error near unexpected token '%.*s'.\n", (int) (token->end - token->start), token->start);
+        return -1;
+    }
+    c->pos++;
+
+    loop = compile_emit(body, OP_LOOP, 0);
+    compile_emit(body, OP_FOR, body->num_pipelines++);
+    next = compile_emit(body, OP_NEXT, 0);
+    body->code[next].name = name;
+    if (compile_body(c, body, done_words) < 0)
+    {
+        return -1;
+    }
+    repeat = compile_emit(body, OP_REPEAT, 0);
+    body->code[repeat].target = next;
+    end = compile_emit(body, OP_LOOP_END, 0);
+    body->code[loop].arg = repeat;
+    body->code[loop].target = end;
+    body->code[next].target = end;
+    return 0;
+}
+
+/* Add the redirection written as the operator token
+   at tokens[0] and the word after it to command. 
+   Returns -1 after printing a diagnostic. */
+
+int parse_redirect(struct command *command, struct token *tokens)
+{
+    struct redirect *redirect;
+    int quoted;
+
+    if (tokens[1].type != TOK_WORD)
+    {
+        printf("No file for I/O redirection.\n");
+        return -1;
+    }
+    quoted = strcspn(tokens[1].start, "'\"\\") < (size_t) (tokens[1].end - tokens[1].start);
+    if ((redirect = add_redirect(command, &tokens[0], glob_literal(tokens[1].text), quoted)) == NULL)
+    {
+        return -1;
+    }
+    if (tokens[1].subst)
+    {
+        add_substitution(command, &tokens[1], redirect);
+    }
+    if (tokens[1].expand && redirect->file != NULL)
+    {
+        redirect->word = redirect->file;
+        command->expand = 1;
+    }
+    return 0;
+}
+
+/* Whether a token of the given type is a redirection
+   operator, to be followed by its file word. */
+
+int is_redirect_token(int type)
+{
+    return type == TOK_INPUT || type == TOK_OUTPUT || type == TOK_OUTPUT_APPEND || type == TOK_HEREDOC
+           || type == TOK_HEREDOC_STRIP || type == TOK_HERESTRING || type == TOK_READ_WRITE
+           || type == TOK_DUP_INPUT || type == TOK_DUP_OUTPUT || type == TOK_OUTPUT_ALL
+           || type == TOK_APPEND_ALL;
+}
+
+/* Append the redirection written as operator token 
+   and word file to the command's redirection list and
+   return it. For a here-string, file is the string; 
+   for a here-document, the delimiter of the body that
+   is read next; for <& and >&, an fd number, - (close)
+   or a word with variables or substitutions that must
+   expand to an fd number, such as $COPROC_WRITE. 
+   A here-string or here-document whose delimiter was 
+   not quoted (quoted unset) keeps its expansions for 
+   expand_command. &>file and &>>file become >file (or
+   >>file) and 2>&1, as does >&file for any other file.
+   Returns NULL after printing a diagnostic for a bad 
+   duplication target or here-document expansion. */
+
+struct redirect *add_redirect(struct command *command, struct token *token, char *file, int quoted)
+{
+    struct redirect *redirect = arena_alloc(&line_arena, sizeof(struct redirect));
+    int type = token->type;
+
+    if (type == TOK_DUP_OUTPUT && token->fd < 0 && strcmp(file, "-") != 0 && parse_fd(file) < 0
+        && strpbrk(file, EXPAND_MARKS) == NULL)
+    {
+        type = TOK_OUTPUT_ALL;
+    }
+    switch (type)
+    {
+        case TOK_OUTPUT: case TOK_OUTPUT_ALL: redirect->mode = OUTPUT; break;
+        case TOK_OUTPUT_APPEND: case TOK_APPEND_ALL: redirect->mode = OUTPUT_APPEND; break;
+        case TOK_READ_WRITE: redirect->mode = READ_WRITE; break;
+        case TOK_DUP_INPUT: case TOK_DUP_OUTPUT: redirect->mode = DUP_FD; break;
+        default: redirect->mode = INPUT; break;
+    }
+    redirect->fd = token->fd;
+    if (redirect->fd < 0)
+    {
+        redirect->fd = (redirect->mode == INPUT || redirect->mode == READ_WRITE || type == TOK_DUP_INPUT) ? STDIN_FILENO : STDOUT_FILENO;
+    }
+    redirect->src_fd = -1;
+    redirect->file = file;
+    redirect->word = NULL;
+    redirect->body = NULL;
+    redirect->here = 0;
+    redirect->next = NULL;
+    if (redirect->mode == DUP_FD)
+    {
+        if (strcmp(file, "-") == 0)
+        {
+            redirect->mode = CLOSE_FD;
+        }
+        else if ((redirect->src_fd = parse_fd(file)) < 0 && strpbrk(file, EXPAND_MARKS) == NULL)
+        {
+            printf("Bad file descriptor '%s'.\n", file);
+            return NULL;
+        }
+        /* A target still to be expanded is kept as the file word. */
+        if (redirect->src_fd >= 0 || redirect->mode == CLOSE_FD)
+        {
+            redirect->file = NULL;
+        }
+    }
+    if (type == TOK_HERESTRING)
+    {
+        size_t len = strlen(file);
+        char *text = arena_alloc(&line_arena, len + 2);
+
+        memcpy(text, file, len);
+        strcpy(text + len, "\n");
+        if (strpbrk(file, EXPAND_MARKS) != NULL)
+        {
+            redirect->word = text;
+            redirect->here = 1;
+        }
+        else
+        {
+            redirect->body = text;
+        }
+    }
+    else if (type == TOK_HEREDOC || type == TOK_HEREDOC_STRIP)
+    {
+        redirect->body = heredoc_read(file, type == TOK_HEREDOC_STRIP);
+        if (!quoted && heredoc_mark(redirect) < 0)
+        {
+            return NULL;
+        }
+    }
+    if (redirect->body != NULL || redirect->here)
+    {
+        redirect->file = NULL;
+    }
+    if (redirect->here)
+    {
+        command->expand = 1;
+    }
+    *command->last_redirect = redirect;
+    command->last_redirect = &redirect->next;
+    if (type == TOK_OUTPUT_ALL || type == TOK_APPEND_ALL)
+    {
+        struct redirect *dup = arena_alloc(&line_arena, sizeof(struct redirect));
+
+        dup->mode = DUP_FD;
+        dup->fd = STDERR_FILENO;
+        dup->src_fd = STDOUT_FILENO;
+        dup->file = dup->word = dup->body = NULL;
+        dup->here = 0;
+        dup->next = NULL;
+        *command->last_redirect = dup;
+        command->last_redirect = &dup->next;
+    }
+    return redirect;
+}
+
+/* Record that a process substitution token stands 
+   for the command's next argument or, if redirect is
+   set, for that redirection's file. */
+
+void add_substitution(struct command *command, struct token *token, struct redirect *redirect)
+{
+    struct substitution *subst = arena_alloc(&line_arena, sizeof(struct substitution));
+
+    subst->direction = token->subst;
+    subst->command = token->text;
+    subst->arg = subst->index = command->argv.len;
+    subst->redirect = redirect;
+    subst->next = command->substitutions;
+    command->substitutions = subst;
+}
+
+/* Read a here-document body from the shell's input: 
+   every line up to one that is exactly delimiter, with
+   leading tabs removed first if strip_tabs is set. The
+   body is allocated from the line arena and keeps each
+   line's new line. End of input also ends the body. */
+
+char *heredoc_read(char *delimiter, int strip_tabs)
+{
+    size_t len = 0, cap = INIT_HEREDOC_SIZE;
+    char *body = arena_alloc(&line_arena, cap);
+    char *line;
+
+    while ((line = read_continuation()) != NULL)
+    {
+        size_t line_len;
+
+        while (strip_tabs && *line == '\t')
+        {
+            line++;
+        }
+        if (strcmp(line, delimiter) == 0)
+        {
+            break;
+        }
+        line_len = strlen(line);
+        if (len + line_len + 2 > cap)
+        {
+            size_t new_cap = cap;
+
+            while (len + line_len + 2 > new_cap)
+            {
+                new_cap *= 2;
+            }
+            body = arena_grow(&line_arena, body, cap, new_cap);
+            cap = new_cap;
+        }
+        memcpy(body + len, line, line_len);
+        len += line_len;
+        body[len++] = '\n';
+    }
+    if (line == NULL)
+    {
+        fprintf(stderr, "Here-document ended by end of input (wanted '%s').\n", delimiter);
+    }
+    body[len] = '\0';
+    return body;
+}
+
+/* Mark the expansions in the body of a here-document 
+   whose delimiter was not quoted, as the tokenizer does
+   inside double quotes: $name, ${name}, $(...) and 
+   `...` become QVAR_MARK or QSUBST_MARK sequences, \ 
+   before $, ` or \ is removed, and so are \ and the
+   new line after it. The result becomes the redirect's
+   here word, unless the body has nothing to expand. 
+   Returns -1 after printing a diagnostic. */
+
+int heredoc_mark(struct redirect *redirect)
+{
+    char *body = redirect->body;
+    char *words, *c;
+
+    if (strpbrk(body, "$`\\") == NULL)
+    {
+        return 0;
+    }
+    redirect->word = words = arena_alloc(&line_arena, 2 * strlen(body) + 1);
+    for (c = body; *c != '\0'; c++)
+    {
+        if ((*c == '$' && c[1] == '(') || *c == '`')
+        {
+            if ((c = copy_command_subst(c, &words, QSUBST_MARK)) == NULL)
+            {
+                return -1;
+            }
+        }
+        else if (*c == '$' && is_variable(c))
+        {
+            if ((c = copy_variable(c, &words, QVAR_MARK)) == NULL)
+            {
+                return -1;
+            }
+        }
+        else if (*c == '\\' && c[1] == '\n')
+        {
+            c++;
+        }
+        else
+        {
+            if (*c == '\\' && c[1] != '\0' && strchr("\\$`", c[1]) != NULL)
+            {
+                c++;
+            }
+            *words++ = *c;
+        }
+    }
+    *words = '\0';
+    redirect->body = NULL;
+    redirect->here = 1;
+    return 0;
+}
+
+/* Read one more line of the shell's input for the 
+   command being parsed, after a "> " prompt at a 
+   terminal. Returns NULL at end of input. */
+
+char *read_continuation()
+{
+    char *line;
+    int len;
+
+    if (interactive)
+    {
+        prompt.len = 0;
+        prompt_append(CONTINUATION_PROMPT, strlen(CONTINUATION_PROMPT));
+        prompt.dirty = 1;
+        fflush(stdout);
+        if (write(STDOUT_FILENO, prompt.buf, prompt.len) < 0)
+        {
+            perror("write()");
+        }
+    }
+    len = editor.enabled ? editor_read_line(&line_arena, &line) : read_line(&shell_input, &line_arena, &line);
+    if (len == READ_ERROR)
+    {
+        perror_exit("read_continuation()");
+    }
+    continuation_lines++;
+    return (len == READ_EOF) ? NULL : line;
+}
+
+/* Check that no command of the pipeline has more 
+   than MAX_REDIRECTS redirections, so its fd 
+   operations fit in a spawn plan. Returns -1 after
+   printing a diagnostic if one does. */
+
+int validate_pipeline(struct pipeline *pipeline)
+{
+    for (int i = 0; i < pipeline->num_commands; i++)
+    {
+        int count = 0;
+
+        for (struct redirect *redirect = pipeline->commands[i].redirects; redirect != NULL; redirect = redirect->next)
+        {
+            count++;
+        }
+        if (count > MAX_REDIRECTS)
+        {
+            printf("Too many redirections.\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Give every here-document, here-string and process 
+   substitution of the pipeline a file descriptor in 
+   the shell, and point its redirection or argument at
+   that descriptor's /dev/fd path, which each child 
+   inherits. Nothing touches the disk: bodies go through
+   a pipe or a memfd, and substituted commands through a
+   pipe. With the outbuf option set, output files then
+   get buffer stages (see buffer_redirects). Returns -1
+   after printing an error. */
+
+int prepare_pipeline(struct pipeline *pipeline)
+{
+    int count = 0;
+
+    pipeline->num_stages = 0;
+    for (int i = 0; i < pipeline->num_commands; i++)
+    {
+        struct command *command = &pipeline->commands[i];
+
+        for (struct redirect *redirect = command->redirects; redirect != NULL; redirect = redirect->next)
+        {
+            count += (redirect->body != NULL)
+                     || (outbuf_size != OUTBUF_DEFAULT && (redirect->mode == OUTPUT || redirect->mode == OUTPUT_APPEND));
+        }
+        for (struct substitution *subst = command->substitutions; subst != NULL; subst = subst->next)
+        {
+            count++;
+        }
+    }
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    pipeline->fds = arena_alloc(&line_arena, count * sizeof(int));
+    pipeline->num_fds = 0;
+    pipeline->stages = arena_alloc(&line_arena, count * sizeof(int));
+    for (int i = 0; i < pipeline->num_commands; i++)
+    {
+        struct command *command = &pipeline->commands[i];
+
+        for (struct redirect *redirect = command->redirects; redirect != NULL; redirect = redirect->next)
+        {
+            if (redirect->body == NULL)
+            {
+                continue;
+            }
+            if ((pipeline->fds[pipeline->num_fds] = body_fd(redirect->body)) < 0)
+            {
+                release_pipeline(pipeline);
+                return -1;
+            }
+            redirect->file = fd_path(pipeline->fds[pipeline->num_fds++]);
+        }
+        for (struct substitution *subst = command->substitutions; subst != NULL; subst = subst->next)
+        {
+            int fd = substitute(pipeline, subst->direction, subst->command, NULL);
+
+            if (fd < 0)
+            {
+                release_pipeline(pipeline);
+                return -1;
+            }
+            pipeline->fds[pipeline->num_fds++] = fd;
+            if (subst->redirect != NULL)
+            {
+                subst->redirect->file = fd_path(fd);
+            }
+            else
+            {
+                command->argv.items[subst->index] = fd_path(fd);
+            }
+        }
+        if (outbuf_size != OUTBUF_DEFAULT && buffer_redirects(pipeline, command) < 0)
+        {
+            release_pipeline(pipeline);
+            buffer_wait(pipeline, 0);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Close the descriptors prepare_pipeline opened, once
+   every child that needs them has been started. */
+
+void release_pipeline(struct pipeline *pipeline)
+{
+    for (int i = 0; i < pipeline->num_fds; i++)
+    {
+        close(pipeline->fds[i]);
+    }
+    pipeline->num_fds = 0;
+}
+
+/* Return a readable descriptor holding body: the read 
+   end of a pipe when body fits in the pipe's buffer,
+   so writing it cannot block, or else a memfd. Returns
+   -1 after printing an error. */
+
+int body_fd(char *body)
+{
+    size_t len = strlen(body);
+    int pipe_fds[2];
+    int fd;
+
+    if (pipe(pipe_fds) == 0)
+    {
+        int capacity = pipe_size_get(pipe_fds[1]);
+
+        if (capacity > 0 && len <= (size_t) capacity && write(pipe_fds[1], body, len) == (ssize_t) len)
+        {
+            close(pipe_fds[1]);
+            return pipe_fds[0];
+        }
+        close_pipes(pipe_fds);
+    }
+
+    if ((fd = memfd_create("heredoc", 0)) < 0)
+    {
+        perror("memfd_create()");
+        return -1;
+    }
+    while (len > 0)
+    {
+        ssize_t written = write(fd, body, len);
+
+        if (written < 0)
+        {
+            perror("write()");
+            close(fd);
+            return -1;
+        }
+        body += written;
+        len -= written;
+    }
+    return fd;
+}
+
+/* Start command in a forked copy of the shell with its
+   stdout (for <(...)) or stdin (for >(...)) on a new
+   pipe, and return the shell's end of the pipe, or -1
+   after printing an error. The copy runs as a batch 
+   shell (see subshell_init), and is watched by the 
+   event loop, which reaps it without a report; its 
+   pid is stored in *pid, unless pid is NULL, if it 
+   could be watched, and 0 otherwise. */
+
+int substitute(struct pipeline *pipeline, int direction, char *command, pid_t *pid)
+{
+    int reading = (direction == '<');
+    int pipe_fds[2];
+    pid_t child;
+
+    if (pipe(pipe_fds) < 0)
+    {
+        perror("pipe()");
+        return -1;
+    }
+    fflush(stdout);
+    if ((child = fork()) < 0)
+    {
+        perror("fork()");
+        close_pipes(pipe_fds);
+        return -1;
+    }
+    if (child == 0)
+    {
+        for (int i = 0; i < pipeline->num_fds; i++)
+        {
+            close(pipeline->fds[i]);
+        }
+        if (dup2(pipe_fds[reading ? 1 : 0], reading ? STDOUT_FILENO : STDIN_FILENO) < 0)
+        {
+            child_perror_exit("dup2()");
+        }
+        close_pipes(pipe_fds);
+        subshell_init();
+        parse_input_and_exec(command);
+        fflush(stdout);
+        _exit(last_status);
+    }
+    if (event_watch(child) < 0)
+    {
+        child = 0;
+    }
+    if (pid != NULL)
+    {
+        *pid = child;
+    }
+    close(pipe_fds[reading ? 1 : 0]);
+    return pipe_fds[reading ? 0 : 1];
+}
+
+/* The /dev/fd path of fd, allocated from the line arena. */
+
+char *fd_path(int fd)
+{
+    char *path = arena_alloc(&line_arena, sizeof(FD_PATH) + 8);
+
+    snprintf(path, sizeof(FD_PATH) + 8, FD_PATH, fd);
+    return path;
+}
+
+/* Expand the command substitutions and variables of
+   every command of the pipeline. A command with none 
+   gets a fresh copy of its words as argv, since 
+   running it may rewrite argv in place (process 
+   substitution paths, parallel's :::) and its words
+   are kept for the next time it runs. Returns -1 if a
+   substitution could not run. */
+
+int expand_pipeline(struct pipeline *pipeline)
+{
+    for (int i = 0; i < pipeline->num_commands; i++)
+    {
+        struct command *command = &pipeline->commands[i];
+
+        if (command->expand)
+        {
+            if (expand_command(pipeline, command) < 0)
+            {
+                return -1;
+            }
+            continue;
+        }
+        command->argv.len = command->words.len;
+        command->argv.cap = command->words.len + 1;
+        command->argv.items = arena_alloc(&line_arena, command->argv.cap * sizeof(char *));
+        memcpy(command->argv.items, command->words.items, command->argv.cap * sizeof(char *));
+    }
+    return 0;
+}
+
+/* Rebuild the command's argv from its words, running
+   each command substitution and replacing each 
+   variable, and splitting the result on blanks and 
+   new lines unless it was in double quotes, then 
+   globbing each field of a word marked for it; then
+   rebuild env from its assignments and set each 
+   redirection file held in a word, both unsplit and
+   unglobbed. Process substitutions are moved to their
+   argument's new position. Returns -1 after printing
+   an error. */
+
+int expand_command(struct pipeline *pipeline, struct command *command)
+{
+    int *index = arena_alloc(&line_arena, (command->words.len + 1) * sizeof(int));
+    struct argv_vec fields;
+    struct expansion exp;
+
+    argv_init(&fields);
+    exp.argv = &fields;
+    exp.buf = arena_alloc(&line_arena, INIT_EXPAND_SIZE);
+    exp.cap = INIT_EXPAND_SIZE;
+    exp.len = exp.field = 0;
+    exp.have_field = 0;
+
+    for (int i = 0; i < command->words.len; i++)
+    {
+        char *word = command->words.items[i];
+
+        index[i] = fields.len;
+        if (*word == GLOB_MARK)
+        {
+            struct argv_vec patterns;
+
+            argv_init(&patterns);
+            exp.argv = &patterns;
+            if (expand_word(&exp, pipeline, word + 1, 1) < 0)
+            {
+                return -1;
+            }
+            exp.argv = &fields;
+            for (int j = 0; j < patterns.len; j++)
+            {
+                glob_word(&fields, patterns.items[j]);
+            }
+        }
+        else if (strpbrk(word, EXPAND_MARKS) == NULL)
+        {
+            argv_push(&fields, word);
+        }
+        else if (expand_word(&exp, pipeline, word, 1) < 0)
+        {
+            return -1;
+        }
+    }
+    command->argv = fields;
+    for (struct substitution *subst = command->substitutions; subst != NULL; subst = subst->next)
+    {
+        subst->index = index[subst->arg];
+    }
+
+    argv_init(&fields);
+    for (int i = 0; i < command->assigns.len; i++)
+    {
+        if (expand_word(&exp, pipeline, command->assigns.items[i], 0) < 0)
+        {
+            return -1;
+        }
+    }
+    command->env = fields;
+
+    for (struct redirect *redirect = command->redirects; redirect != NULL; redirect = redirect->next)
+    {
+        if (redirect->word == NULL)
+        {
+            continue;
+        }
+        argv_init(&fields);
+        if (expand_word(&exp, pipeline, redirect->word, 0) < 0)
+        {
+            return -1;
+        }
+        if (redirect->here)
+        {
+            redirect->body = (fields.len > 0) ? fields.items[0] : "";
+            continue;
+        }
+        redirect->file = fields.items[0];
+        if (redirect->mode == DUP_FD && (redirect->src_fd = parse_fd(redirect->file)) < 0)
+        {
+            printf("Bad file descriptor '%s'.\n", redirect->file);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Expand one word into fields appended to exp->argv:
+   its literal text joins the current field, as do the
+   value of each variable and the output of each 
+   substitution, with trailing new lines removed, 
+   except that unquoted ones are split when split is 
+   set. Returns -1 after 
+   printing an error. */
+
+int expand_word(struct expansion *exp, struct pipeline *pipeline, char *word, int split)
+{
+    for (char *c = word; *c != '\0'; )
+    {
+        size_t len = strcspn(c, EXPAND_MARKS);
+        char *command;
+
+        if (len > 0)
+        {
+            expansion_reserve(exp, len);
+            memcpy(exp->buf + exp->len, c, len);
+            exp->len += len;
+            exp->have_field = 1;
+            c += len;
+            continue;
+        }
+
+        /* The name or command is copied out, since a word
+           can be expanded again each time its command runs. */
+        len = strchr(c, SUBST_END) - c - 1;
+        command = arena_alloc(&line_arena, len + 1);
+
+        memcpy(command, c + 1, len);
+        command[len] = '\0';
+        if (*c == QVAR_MARK && split && strcmp(command, "@") == 0)
+        {
+            /* "$@" is a field per positional parameter, 
+               and no field at all without any. */
+            for (int i = 0; i < num_positional; i++)
+            {
+                size_t value_len = strlen(positional[i]);
+
+                if (i > 0)
+                {
+                    expansion_end_field(exp);
+                }
+                expansion_reserve(exp, value_len);
+                memcpy(exp->buf + exp->len, positional[i], value_len);
+                exp->len += value_len;
+                exp->have_field = 1;
+            }
+            c += len + 2;
+            continue;
+        }
+        if (*c == VAR_MARK || *c == QVAR_MARK)
+        {
+            char *value = var_value(command);
+            size_t value_len = strlen(value);
+
+            expansion_reserve(exp, value_len);
+            memcpy(exp->buf + exp->len, value, value_len);
+            exp->len += value_len;
+            if (split && *c == VAR_MARK)
+            {
+                expansion_split(exp, exp->buf + exp->len - value_len, exp->buf + exp->len);
+            }
+        }
+        else if (capture(exp, pipeline, command, split && *c == SUBST_MARK) < 0)
+        {
+            return -1;
+        }
+        exp->have_field |= (*c == QSUBST_MARK || *c == QVAR_MARK || !split);
+        c += len + 2;
+    }
+    if (exp->have_field || !split)
+    {
+        expansion_end_field(exp);
+    }
+    return 0;
+}
+
+/* Run the command of a substitution and add its output
+   to exp. A lone builtin that changes no shell state 
+   (flagged BUILTIN_PURE) runs in the shell with stdout 
+   on a memfd; anything else runs in a forked copy of 
+   the shell, as for <(...), and is read through the 
+   pipe straight into the field being built, the pipe
+   made non-blocking so the event loop runs while it 
+   is empty. Either way the command's status becomes 
+   the last status. The command is parsed through the
+   parse cache, so a substitution in a loop body is 
+   parsed once. Returns -1 after printing an error. */
+
+int capture(struct expansion *exp, struct pipeline *pipeline, char *command, int split)
+{
+    struct command_list *list;
+    struct parse_entry *entry;
+    struct builtin *builtin;
+    pid_t pid = 0;
+    int fd, result;
+
+    if (parse_cached(command, &list, &entry) < 0)
+    {
+        parse_done(entry);
+        last_status = SYNTAX_ERROR;
+        return -1;
+    }
+    if (list == NULL)
+    {
+        parse_done(entry);
+        return 0;
+    }
+    if (list->num_pipelines == 1 && (builtin = shell_builtin(&list->pipelines[0])) != NULL
+        && (builtin->flags & BUILTIN_PURE))
+    {
+        int saved_fd;
+
+        if ((fd = memfd_create("mysh-subst", MFD_CLOEXEC)) < 0)
+        {
+            perror("memfd_create()");
+            parse_done(entry);
+            return -1;
+        }
+        fflush(stdout);
+        if ((saved_fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, SAVED_FD_BASE)) < 0 || dup2(fd, STDOUT_FILENO) < 0)
+        {
+            perror("dup2()");
+            close(fd);
+            parse_done(entry);
+            return -1;
+        }
+        execute_list(list);
+        parse_done(entry);
+        fflush(stdout);
+        if (dup2(saved_fd, STDOUT_FILENO) < 0)
+        {
+            perror_exit("dup2()");
+        }
+        close(saved_fd);
+        lseek(fd, 0, SEEK_SET);
+    }
+    else
+    {
+        parse_done(entry);
+        if ((fd = substitute(pipeline, '<', command, &pid)) < 0)
+        {
+            return -1;
+        }
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        capture_pid = pid;
+    }
+    result = capture_fd(exp, fd, split);
+    close(fd);
+    captured = 1;
+    while (capture_pid != 0)
+    {
+        event_wait(-1, -1, NULL);
+    }
+    if (pid != 0)
+    {
+        last_status = exit_status(capture_status);
+    }
+    return result;
+}
+
+/* Read fd to end of file into the field being built,
+   dropping trailing new lines. When split is set, each
+   chunk is split in place by expansion_split as it 
+   arrives; new lines at the end of a chunk are held 
+   back until more output shows they are not trailing.
+   Returns -1 after printing an error. */
+
+int capture_fd(struct expansion *exp, int fd, int split)
+{
+    size_t pending = 0;
+
+    while (1)
+    {
+        char *start, *end;
+        ssize_t n;
+
+        expansion_reserve(exp, INIT_EXPAND_SIZE);
+        if ((n = read(fd, exp->buf + exp->len, exp->cap - exp->len - 1)) < 0)
+        {
+            if (errno == EAGAIN)
+            {
+                event_wait_fd(fd);
+                continue;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("read()");
+            return -1;
+        }
+        if (n == 0)
+        {
+            break;
+        }
+        start = exp->buf + exp->len - pending;
+        exp->len += n;
+        for (end = exp->buf + exp->len; end > start && end[-1] == '\n'; end--)
+        {
+            ;
+        }
+        pending = exp->buf + exp->len - end;
+        if (split)
+        {
+            expansion_split(exp, start, end);
+        }
+    }
+    exp->len -= pending;
+    return 0;
+}
+
+/* Split the bytes from start to end, the tail of the
+   field being built, in place: a blank or new line 
+   ends the field, which is pushed to exp->argv where 
+   it lies, and runs of them start no field. */
+
+static void expansion_split(struct expansion *exp, char *start, char *end)
+{
+    for (char *c = start; c < end; c++)
+    {
+        if (strchr(FIELD_SEPARATORS, *c) == NULL)
+        {
+            exp->have_field = 1;
+        }
+        else if (exp->have_field)
+        {
+            *c = '\0';
+            argv_push(exp->argv, exp->buf + exp->field);
+            exp->have_field = 0;
+            exp->field = c + 1 - exp->buf;
+        }
+        else
+        {
+            exp->field = c + 1 - exp->buf;
+        }
+    }
+}
+
+/* Make room for extra more bytes and a terminator 
+   after the field being built. Fields already pushed 
+   stay where they are; only the one being built moves
+   to a larger buffer. */
+
+static void expansion_reserve(struct expansion *exp, size_t extra)
+{
+    size_t active = exp->len - exp->field;
+    size_t cap = exp->cap;
+    char *buf;
+
+    if (exp->len + extra + 1 <= exp->cap)
+    {
+        return;
+    }
+    while (active + extra + 1 > cap)
+    {
+        cap *= 2;
+    }
+    buf = arena_alloc(&line_arena, cap);
+    memcpy(buf, exp->buf + exp->field, active);
+    exp->buf = buf;
+    exp->cap = cap;
+    exp->field = 0;
+    exp->len = active;
+}
+
+/* Terminate the field being built and push it. */
+
+static void expansion_end_field(struct expansion *exp)
+{
+    expansion_reserve(exp, 0);
+    exp->buf[exp->len++] = '\0';
+    argv_push(exp->argv, exp->buf + exp->field);
+    exp->field = exp->len;
+    exp->have_field = 0;
+}
+
+/* The builtin a pipeline runs in the shell process, or
+   NULL if it is not a lone builtin in the foreground, 
+   or is one that streams input that might block. */
+
+struct builtin *shell_builtin(struct pipeline *pipeline)
+{
+    struct command *command = &pipeline->commands[0];
+    struct builtin *builtin;
+
+    if (pipeline->num_commands > 1 || pipeline->background || (builtin = find_builtin(command->argv.items)) == NULL)
+    {
+        return NULL;
+    }
+    if ((builtin->flags & BUILTIN_STREAMS_STDIN) && !streams_regular(command))
+    {
+        return NULL;
+    }
+    return builtin;
+}
+
+/* Whether every input of a command run by a builtin 
+   flagged BUILTIN_STREAMS_STDIN is a regular file: 
+   each argument, and stdin when there are none or one
+   is -. Stdin must then be redirected from a regular 
+   file or here-document. A word still to be expanded 
+   passes, as it is checked again once it has been. A 
+   terminal, fifo or pipe could block the shell, where
+   Ctrl-C does not reach it, so those run in a child. */
+
+int streams_regular(struct command *command)
+{
+    struct redirect *input = NULL;
+    int reads_stdin = (command->argv.len == 1);
+    struct stat st;
+
+    for (int i = 1; i < command->argv.len; i++)
+    {
+        char *arg = command->argv.items[i];
+
+        if (strcmp(arg, "-") == 0)
+        {
+            reads_stdin = 1;
+        }
+        else if (strpbrk(arg, EXPAND_MARKS) == NULL && (stat(arg, &st) < 0 || !S_ISREG(st.st_mode)))
+        {
+            return 0;
+        }
+    }
+    if (!reads_stdin)
+    {
+        return 1;
+    }
+    for (struct redirect *redirect = command->redirects; redirect != NULL; redirect = redirect->next)
+    {
+        if (redirect->fd == STDIN_FILENO)
+        {
+            input = redirect;
+        }
+    }
+    if (input == NULL || (input->mode != INPUT && input->mode != READ_WRITE))
+    {
+        return 0;
+    }
+    if (input->body != NULL || input->here || input->file == NULL)
+    {
+        return 1;
+    }
+    return (stat(input->file, &st) == 0 && S_ISREG(st.st_mode));
+}
+
+/* Run the compiled code of list in a dispatch loop. 
+   Everything a pipeline allocates from the line arena
+   is released once it has run, and everything a loop 
+   allocates (its for words) once it ends, so a long 
+   loop runs in constant memory. break, continue and 
+   return only set unwind_type: a loop whose list sees
+   it and has loops to unwind left goes on to the next
+   iteration or out of the loop, and any other list 
+   returns, which unwinds the enclosing lists up to 
+   the loop or function call. The status of a loop is
+   that of the last body command run, or 0. */
+
+int execute_list(struct command_list *list)
+{
+    struct arena_mark mark, loop_mark = {NULL, 0, NULL};
+    struct op *loop = NULL;
+    struct argv_vec items = {NULL, 0, 0};
+    int next_item = 0, loop_status = 0;
+    int result = EXEC_SUCCESS;
+    int pc = 0;
+
+    while (pc < list->num_code)
+    {
+        struct op *op = &list->code[pc++];
+
+        switch (op->type)
+        {
+            case OP_PIPELINE:
+                arena_mark(&line_arena, &mark);
+                if ((result = execute_pipeline(&list->pipelines[op->arg])) == EXEC_FAILURE)
+                {
+                    last_status = EXIT_FAILURE;
+                }
+                arena_release(&line_arena, &mark);
+                break;
+            case OP_JUMP:
+                pc = op->target;
+                break;
+            case OP_JUMP_FAIL:
+                pc = (last_status != 0) ? op->target : pc;
+                break;
+            case OP_JUMP_OK:
+                pc = (last_status == 0) ? op->target : pc;
+                break;
+            case OP_STATUS:
+                last_status = op->arg;
+                break;
+            case OP_LOOP:
+                arena_mark(&line_arena, &loop_mark);
+                loop = op;
+                loop_status = 0;
+                loop_depth++;
+                break;
+            case OP_FOR:
+                items.len = next_item = 0;
+                if (expand_command(&list->pipelines[op->arg], &list->pipelines[op->arg].commands[0]) < 0)
+                {
+                    loop_status = EXIT_FAILURE;
+                    pc = loop->target;
+                    break;
+                }
+                items = list->pipelines[op->arg].commands[0].argv;
+                break;
+            case OP_NEXT:
+                if (next_item == items.len)
+                {
+                    pc = op->target;
+                }
+                else if (var_set(op->name, strlen(op->name), items.items[next_item++], 0) < 0)
+                {
+                    loop_status = EXIT_FAILURE;
+                    pc = op->target;
+                }
+                break;
+            case OP_REPEAT:
+                loop_status = last_status;
+                pc = op->target;
+                break;
+            case OP_LOOP_END:
+                last_status = loop_status;
+                arena_release(&line_arena, &loop_mark);
+                loop_depth--;
+                loop = NULL;
+                break;
+        }
+
+        if (unwind_type == UNWIND_NONE)
+        {
+            continue;
+        }
+        if (loop == NULL || unwind_type == UNWIND_RETURN || --unwind_count > 0)
+        {
+            break;
+        }
+        if (unwind_type == UNWIND_BREAK)
+        {
+            loop_status = last_status;
+            pc = loop->target;
+        }
+        else
+        {
+            pc = loop->arg;
+        }
+        unwind_type = UNWIND_NONE;
+    }
+
+    if (loop != NULL)
+    {
+        arena_release(&line_arena, &loop_mark);
+        loop_depth--;
+    }
+    return result;
+}
+
+/* Execute a validated pipeline. A function definition
+   defines the function, and a single builtin or 
+   compound command is run in the shell process; 
+   anything else is spawned
+   by spawn_pipeline, every stage before any is waited
+   on so the stages run concurrently. A background 
+   pipeline is left running, its children reaped by the
+   event loop as their pidfds become readable. It runs 
+   from a copy of the parsed pipeline,
+   since a function called in it may run the same 
+   pipeline again before it is done. */
+
+int execute_pipeline(struct pipeline *parsed)
+{
+    struct pipeline *pipeline = arena_alloc(&line_arena, sizeof(struct pipeline));
+    struct command *commands = arena_alloc(&line_arena, parsed->num_commands * sizeof(struct command));
+    struct builtin *builtin;
+    struct job *job;
+
+    *pipeline = *parsed;
+    pipeline->commands = memcpy(commands, parsed->commands, parsed->num_commands * sizeof(struct command));
+
+    captured = 0;
+    if (expand_pipeline(pipeline) < 0)
+    {
+        return EXEC_FAILURE;
+    }
+    if (commands[0].function != NULL)
+    {
+        last_status = (function_define(commands[0].function, commands[0].body) < 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+        return EXEC_SUCCESS;
+    }
+    /* Assignments alone, or words that expanded to nothing,
+       take the status of the last substitution, if any. */
+    if (commands[0].argv.len == 0)
+    {
+        int status = var_assign(&commands[0].env, 0);
+
+        last_status = (status == EXIT_SUCCESS && captured) ? last_status : status;
+        return EXEC_SUCCESS;
+    }
+    if (validate_pipeline(pipeline) < 0 || prepare_pipeline(pipeline) < 0)
+    {
+        return EXEC_FAILURE;
+    }
+    if (pipeline->coproc != NULL)
+    {
+        last_status = coproc_start(pipeline);
+        release_pipeline(pipeline);
+        buffer_wait(pipeline, 0);
+        return EXEC_SUCCESS;
+    }
+    /* A lone compound command or builtin runs in the shell itself. */
+    if (pipeline->num_commands == 1 && !pipeline->background && commands[0].body != NULL)
+    {
+        last_status = pipeline->timed ? run_builtin_timed(NULL, pipeline) : run_body(&commands[0]);
+        release_pipeline(pipeline);
+        buffer_wait(pipeline, 1);
+        return EXEC_SUCCESS;
+    }
+    if ((builtin = shell_builtin(pipeline)) != NULL)
+    {
+        if (pipeline->timed || stats_fd >= 0)
+        {
+            last_status = run_builtin_timed(builtin, pipeline);
+        }
+        else
+        {
+            last_status = run_builtin(builtin, &commands[0]);
+        }
+        release_pipeline(pipeline);
+        buffer_wait(pipeline, 1);
+        return EXEC_SUCCESS;
+    }
+    if ((job = job_create(pipeline->text, pipeline->text_len, pipeline->background)) == NULL)
+    {
+        release_pipeline(pipeline);
+        buffer_wait(pipeline, 0);
+        return EXEC_FAILURE;
+    }
+    job->timed = pipeline->timed;
+    spawn_pipeline(job, pipeline, -1, -1);
+
+    /* Reap every stage together, unless in the background. The
+       children hold their own copies of any /dev/fd files. */
+    release_pipeline(pipeline);
+    if (pipeline->background)
+    {
+        job_background(job);
+        buffer_wait(pipeline, 0);
+    }
+    else
+    {
+        job_wait(job);
+        /* A stopped job may still write; its buffers drain later. */
+        buffer_wait(pipeline, job->state != JOB_STOPPED);
+    }
+    return EXEC_SUCCESS;
+}
+
+/* Run a compound command's body in the shell process,
+   with its redirections applied to the shell's fds 
+   around it as for a builtin. Returns the status. */
+
+int run_body(struct command *command)
+{
+    struct saved_fd saved[MAX_REDIRECTS];
+    int num_saved;
+
+    fflush(stdout);
+    if (redirect_shell(command, saved, &num_saved) < 0)
+    {
+        return EXIT_FAILURE;
+    }
+    execute_list(command->body);
+    fflush(stdout);
+    restore_shell(saved, num_saved);
+    return last_status;
+}
+
+/* Make a forked copy of the shell, about to run shell 
+   code, a batch shell of its own: the job control 
+   signals the shell ignores are reset, and the job 
+   table is emptied, so its jobs are only its own. */
+
+void subshell_init()
+{
+    if (job_control)
+    {
+        signal(SIGINT, SIG_DFL);
+        signal(SIGQUIT, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGTTIN, SIG_DFL);
+        signal(SIGTTOU, SIG_DFL);
+    }
+    for (int i = 0; i < num_jobs; i++)
+    {
+        for (int j = 0; j < job_table[i]->num_procs; j++)
+        {
+            if (job_table[i]->procs[j].pidfd >= 0)
+            {
+                close(job_table[i]->procs[j].pidfd);
+            }
+        }
+        job_table[i]->state = JOB_FREE;
+    }
+    interactive = job_control = editor.enabled = 0;
+    init_events();
+}
+
+/* Find the function called name, or NULL. */
+
+struct function *function_find(char *name)
+{
+    for (struct function *function = function_table[hash_string(name) % FUNCTION_BUCKETS]; function != NULL; function = function->next)
+    {
+        if (strcmp(function->name, name) == 0)
+        {
+            return function;
+        }
+    }
+    return NULL;
+}
+
+/* Define the function name with a copy of body, 
+   replacing any function of that name. Returns 0, or
+   -1 after printing an error. */
+
+int function_define(char *name, struct command_list *body)
+{
+    unsigned int bucket = hash_string(name) % FUNCTION_BUCKETS;
+    struct function *function;
+
+    for (struct function **link = &function_table[bucket]; *link != NULL; link = &(*link)->next)
+    {
+        if (strcmp((*link)->name, name) == 0)
+        {
+            function = *link;
+            *link = function->next;
+            function_drop(function);
+            num_functions--;
+            break;
+        }
+    }
+    if ((function = calloc(1, sizeof(struct function))) == NULL)
+    {
+        perror("calloc()");
+        return -1;
+    }
+    function->name = arena_strdup(&function->arena, name);
+    function->body = list_copy(&function->arena, body);
+    function->next = function_table[bucket];
+    function_table[bucket] = function;
+    num_functions++;
+    return 0;
+}
+
+/* Free a function taken out of the table, or, while
+   calls to it are still running, mark it to be freed
+   when the last one returns. */
+
+void function_drop(struct function *function)
+{
+    if (function->calls > 0)
+    {
+        function->dropped = 1;
+        return;
+    }
+    arena_free(&function->arena);
+    free(function);
+}
+
+/* Call function with argv[1]... as the positional 
+   parameters, which are restored when it returns, as
+   is the loop depth, so that break and continue only 
+   see its own loops. Returns its status. */
+
+int function_call(struct function *function, char *argv[])
+{
+    char **saved_positional = positional;
+    int saved_num_positional = num_positional;
+    int saved_loop_depth = loop_depth;
+
+    if (function_depth >= FUNCTION_MAX_DEPTH)
+    {
+        fprintf(stderr, "%s: maximum function nesting depth exceeded.\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    positional = argv + 1;
+    for (num_positional = 0; positional[num_positional] != NULL; num_positional++)
+    {
+        ;
+    }
+    loop_depth = 0;
+    function_depth++;
+    function->calls++;
+
+    execute_list(function->body);
+
+    function->calls--;
+    function_depth--;
+    if (unwind_type == UNWIND_RETURN)
+    {
+        unwind_type = UNWIND_NONE;
+    }
+    loop_depth = saved_loop_depth;
+    positional = saved_positional;
+    num_positional = saved_num_positional;
+    if (function->dropped && function->calls == 0)
+    {
+        function_drop(function);
+    }
+    return last_status;
+}
+
+/* Copy a compiled list, and everything it points to,
+   into arena. Only what parsing set is copied; what 
+   running a pipeline sets (argv, env, fds and the 
+   files of here-documents and substitutions) is set 
+   again every time it runs. */
+
+struct command_list *list_copy(struct arena *arena, struct command_list *list)
+{
+    struct command_list *copy = arena_alloc(arena, sizeof(struct command_list));
+
+    *copy = *list;
+    copy->max_code = list->num_code;
+    copy->code = arena_alloc(arena, list->num_code * sizeof(struct op));
+    for (int i = 0; i < list->num_code; i++)
+    {
+        copy->code[i] = list->code[i];
+        copy->code[i].name = arena_strdup(arena, list->code[i].name);
+    }
+    copy->max_pipelines = list->num_pipelines;
+    copy->pipelines = arena_alloc(arena, list->num_pipelines * sizeof(struct pipeline));
+    for (int i = 0; i < list->num_pipelines; i++)
+    {
+        struct pipeline *from = &list->pipelines[i], *to = &copy->pipelines[i];
+
+        *to = *from;
+        to->text = memcpy(arena_alloc(arena, from->text_len + 1), from->text, from->text_len);
+        to->text[from->text_len] = '\0';
+        to->coproc = arena_strdup(arena, from->coproc);
+        to->fds = NULL;
+        to->num_fds = 0;
+        to->stages = NULL;
+        to->num_stages = 0;
+        to->commands = arena_alloc(arena, from->num_commands * sizeof(struct command));
+        for (int j = 0; j < from->num_commands; j++)
+        {
+            command_copy(arena, &to->commands[j], &from->commands[j]);
+        }
+    }
+    return copy;
+}
+
+/* Copy a parsed command into arena for list_copy. A 
+   substitution's redirection is found by its position
+   in the list of redirections. */
+
+void command_copy(struct arena *arena, struct command *to, struct command *from)
+{
+    struct substitution **last_subst = &to->substitutions;
+
+    *to = *from;
+    to->words = to->argv = argv_copy(arena, &from->words);
+    to->assigns = to->env = argv_copy(arena, &from->assigns);
+    to->body = (from->body != NULL) ? list_copy(arena, from->body) : NULL;
+    to->function = arena_strdup(arena, from->function);
+
+    to->redirects = NULL;
+    to->last_redirect = &to->redirects;
+    for (struct redirect *redirect = from->redirects; redirect != NULL; redirect = redirect->next)
+    {
+        struct redirect *copy = arena_alloc(arena, sizeof(struct redirect));
+
+        *copy = *redirect;
+        copy->word = arena_strdup(arena, redirect->word);
+        copy->body = redirect->here ? NULL : arena_strdup(arena, redirect->body);
+        copy->file = (redirect->body == NULL && redirect->word == NULL) ? arena_strdup(arena, redirect->file) : NULL;
+        copy->next = NULL;
+        *to->last_redirect = copy;
+        to->last_redirect = &copy->next;
+    }
+
+    for (struct substitution *subst = from->substitutions; subst != NULL; subst = subst->next)
+    {
+        struct substitution *copy = arena_alloc(arena, sizeof(struct substitution));
+
+        *copy = *subst;
+        copy->command = arena_strdup(arena, subst->command);
+        copy->redirect = NULL;
+        if (subst->redirect != NULL)
+        {
+            struct redirect *redirect = from->redirects, *match = to->redirects;
+
+            for (; redirect != subst->redirect; redirect = redirect->next)
+            {
+                match = match->next;
+            }
+            copy->redirect = match;
+            match->file = NULL;
+        }
+        copy->next = NULL;
+        *last_subst = copy;
+        last_subst = &copy->next;
+    }
+}
+
+/* Copy an argument vector and its strings into arena. */
+
+struct argv_vec argv_copy(struct arena *arena, struct argv_vec *vec)
+{
+    struct argv_vec copy;
+
+    copy.len = vec->len;
+    copy.cap = vec->len + 1;
+    copy.items = arena_alloc(arena, copy.cap * sizeof(char *));
+    for (int i = 0; i < vec->len; i++)
+    {
+        copy.items[i] = arena_strdup(arena, vec->items[i]);
+    }
+    copy.items[vec->len] = NULL;
+    return copy;
+}
+
+/* Initialize the job table, job control if the shell
+   is interactive, and the event loop that reaps 
+   children as they exit. */
+
+void init_jobs()
+{
+    sigemptyset(&sigchld_mask);
+    sigaddset(&sigchld_mask, SIGCHLD);
+    if (interactive)
+    {
+        init_job_control();
+    }
+    init_events();
+}
+
+/* Take control of the terminal for an interactive 
+   shell: wait until it is in the foreground, put it
+   in its own process group and ignore the job control
+   signals, so Ctrl-C and Ctrl-Z reach only the 
+   foreground job. Children restore the defaults. */
+
+void init_job_control()
+{
+    while (tcgetpgrp(STDIN_FILENO) != (shell_pgid = getpgrp()))
+    {
+        if (tcgetpgrp(STDIN_FILENO) < 0)
+        {
+            return;
+        }
+        kill(-shell_pgid, SIGTTIN);
+    }
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+
+    shell_pgid = getpid();
+    if (getpgrp() != shell_pgid && setpgid(0, shell_pgid) < 0)
+    {
+        perror("setpgid()");
+        return;
+    }
+    if (tcsetpgrp(STDIN_FILENO, shell_pgid) < 0 || tcgetattr(STDIN_FILENO, &shell_tmodes) < 0)
+    {
+        perror("tcsetpgrp()");
+        return;
+    }
+    job_control = 1;
+}
+
+/* Claim a free slot in the job table for the first
+   command_len bytes of the command string. Children 
+   are only reaped from the event loop, through the 
+   pidfd job_add_pid opens, so none can be reaped 
+   before its pid is recorded. A shell that is not 
+   interactive reports nothing, so when the table is 
+   full it frees the background jobs that have finished
+   at once instead of at the next line, which a loop 
+   may never reach; otherwise the table doubles. 
+   Returns NULL after printing an error if it cannot. */
+
+struct job *job_create(char *command, size_t command_len, int background)
+{
+    struct job *job = NULL;
+
+    for (int pass = 0; job == NULL && pass < 2; pass++)
+    {
+        if (pass > 0)
+        {
+            if (interactive)
+            {
+                break;
+            }
+            job_notify();
+        }
+        for (int i = 0; i < num_jobs; i++)
+        {
+            if (job_table[i]->state == JOB_FREE)
+            {
+                job = job_table[i];
+                job->id = i + 1;
+                break;
+            }
+        }
+    }
+    if (job == NULL && (job = job_table_grow()) == NULL)
+    {
+        return NULL;
+    }
+    if ((job->command = strndup(command, command_len)) == NULL)
+    {
+        perror("strndup()");
+        return NULL;
+    }
+    job->state = JOB_RUNNING;
+    job->background = background;
+    job->pgid = job_own_group(job) ? 0 : getpgrp();
+    job->procs = NULL;
+    job->num_procs = 0;
+    job->max_procs = 0;
+    job->num_live = 0;
+    job->num_stopped = 0;
+    job->notified = 0;
+    job->seq = ++job_sequence;
+    job->timed = 0;
+    job->pipe_size = 0;
+    job->coproc = NULL;
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+    return job;
+}
+
+/* Record a forked child in the job, growing the
+   process array as needed, and watch it for its exit.
+   With job control, every job's process group is led
+   by its first child, and a foreground job is given 
+   the terminal; otherwise only background jobs get 
+   their own group. */
+
+void job_add_pid(struct job *job, pid_t pid)
+{
+    if (job->num_procs == job->max_procs)
+    {
+        int max_procs = (job->max_procs == 0) ? INIT_JOB_PROCS : job->max_procs * 2;
+        struct process *procs = realloc(job->procs, max_procs * sizeof(struct process));
+
+        if (procs == NULL)
+        {
+            perror("realloc()");
+            return;
+        }
+        job->procs = procs;
+        job->max_procs = max_procs;
+    }
+    if (job_own_group(job))
+    {
+        if (job->pgid == 0)
+        {
+            job->pgid = pid;
+        }
+        /* Also done by the child; whichever runs first wins. */
+        setpgid(pid, job->pgid);
+        if (job_control && !job->background && job->pgid == pid)
+        {
+            tcsetpgrp(STDIN_FILENO, job->pgid);
+        }
+    }
+    job->procs[job->num_procs].pid = pid;
+    job->procs[job->num_procs].pidfd = event_watch(pid);
+    job->procs[job->num_procs].status = 0;
+    job->procs[job->num_procs].done = 0;
+    job->procs[job->num_procs].stopped = 0;
+    job->procs[job->num_procs].name = NULL;
+    job->procs[job->num_procs].hashed = 0;
+    clock_gettime(CLOCK_MONOTONIC, &job->procs[job->num_procs].start);
+    job->num_procs++;
+    job->num_live++;
+}
+
+/* Record a stage of job that could not be started 
+   as a process that has already exited with status, 
+   just as a child that fails to exec would, so every 
+   spawn backend gives the job the same status. */
+
+void job_add_failed(struct job *job, char *name, int status)
+{
+    struct process *proc;
+
+    if (job->num_procs == job->max_procs)
+    {
+        int max_procs = (job->max_procs == 0) ? INIT_JOB_PROCS : job->max_procs * 2;
+        struct process *procs = realloc(job->procs, max_procs * sizeof(struct process));
+
+        if (procs == NULL)
+        {
+            perror("realloc()");
+            return;
+        }
+        job->procs = procs;
+        job->max_procs = max_procs;
+    }
+    proc = &job->procs[job->num_procs++];
+    memset(proc, 0, sizeof(*proc));
+    proc->pidfd = -1;
+    proc->status = status;
+    proc->done = 1;
+    proc->name = strdup(name);
+    clock_gettime(CLOCK_MONOTONIC, &proc->start);
+    proc->end = proc->start;
+}
+
+/* Store the status and resource usage of a reaped 
+   child in the job that owns it, and stamp its end 
+   time. A job whose live children have all stopped 
+   becomes JOB_STOPPED until one is continued. Called
+   from the event loop; usage is only read for an exit. */
+
+void job_record_status(pid_t pid, int status, struct rusage *usage)
+{
+    for (int i = 0; i < num_jobs; i++)
+    {
+        struct job *job = job_table[i];
+
+        if (job->state != JOB_RUNNING && job->state != JOB_STOPPED)
+        {
+            continue;
+        }
+        for (int j = 0; j < job->num_procs; j++)
+        {
+            struct process *proc = &job->procs[j];
+
+            if (proc->pid != pid || proc->done)
+            {
+                continue;
+            }
+            if (WIFSTOPPED(status) || WIFCONTINUED(status))
+            {
+                if (WIFSTOPPED(status) != proc->stopped)
+                {
+                    proc->stopped = !proc->stopped;
+                    job->num_stopped += proc->stopped ? 1 : -1;
+                }
+            }
+            else
+            {
+                proc->status = status;
+                proc->usage = *usage;
+                clock_gettime(CLOCK_MONOTONIC, &proc->end);
+                proc->done = 1;
+                proc->pidfd = -1;
+                job->num_stopped -= proc->stopped;
+                proc->stopped = 0;
+                job->num_live--;
+            }
+            if (job->num_live == 0)
+            {
+                job->state = JOB_DONE;
+            }
+            else if (job->num_stopped == job->num_live)
+            {
+                job->state = JOB_STOPPED;
+                job->notified = 0;
+            }
+            else
+            {
+                job->state = JOB_RUNNING;
+            }
+            return;
+        }
+    }
+}
+
+/* Double the job table (or make its first INIT_JOBS
+   slots) and return the first new slot, with its id 
+   set. Returns NULL after printing an error. */
+
+struct job *job_table_grow()
+{
+    int max_jobs = (num_jobs == 0) ? INIT_JOBS : num_jobs * 2;
+    struct job **table = realloc(job_table, max_jobs * sizeof(struct job *));
+    struct job *job;
+
+    if (table == NULL)
+    {
+        perror("realloc()");
+        return NULL;
+    }
+    job_table = table;
+    for (int i = num_jobs; i < max_jobs; i++)
+    {
+        if ((job_table[i] = calloc(1, sizeof(struct job))) == NULL)
+        {
+            perror("calloc()");
+            max_jobs = i;
+            break;
+        }
+    }
+    if (max_jobs == num_jobs)
+    {
+        return NULL;
+    }
+    job = job_table[num_jobs];
+    job->id = num_jobs + 1;
+    num_jobs = max_jobs;
+    return job;
+}
+
+/* Wait for every child in a foreground job, running 
+   the event loop until the last one has been reaped 
+   or the job has stopped. The job is then freed,
+   unless it was stopped, in which case it is kept as
+   a background job for fg or bg. Either way the shell
+   takes the terminal back. */
+
+void job_wait(struct job *job)
+{
+    while (job->num_live > 0 && job->state != JOB_STOPPED)
+    {
+        event_wait(-1, -1, NULL);
+    }
+    if (job_control)
+    {
+        if (job->state == JOB_STOPPED)
+        {
+            tcgetattr(STDIN_FILENO, &job->tmodes);
+        }
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
+    }
+    if (job->state == JOB_STOPPED)
+    {
+        job->background = 1;
+        job->notified = 1;
+        job->seq = ++job_sequence;
+        last_status = 128 + SIGTSTP;
+        printf("\n");
+        job_report(job, "Stopped");
+    }
+    else
+    {
+        if (job->num_procs > 0)
+        {
+            last_status = exit_status(job->procs[job->num_procs - 1].status);
+            if (WIFSIGNALED(job->procs[job->num_procs - 1].status) && WTERMSIG(job->procs[job->num_procs - 1].status) == SIGINT)
+            {
+                printf("\n");
+            }
+        }
+        report_pipeline(job->command, job->procs, job->num_procs, &job->start, job->timed, job->pipe_size);
+        job_free(job);
+    }
+}
+
+/* Leave a job running in the background, for the 
+   event loop to reap later: its id and process group 
+   are printed. */
+
+void job_background(struct job *job)
+{
+    if (job->num_procs == 0)
+    {
+        job_free(job);
+        return;
+    }
+    if (job->num_live == 0)
+    {
+        job->state = JOB_DONE;
+    }
+    if (interactive)
+    {
+        printf("[%d] %d\n", job->id, (int) job->pgid);
+    }
+}
+
+/* Release a job's slot in the job table. */
+
+void job_free(struct job *job)
+{
+    /* A hashed program that could not be found by its 
+       child is dropped from the command hash. */
+    for (int i = 0; i < job->num_procs; i++)
+    {
+        struct process *proc = &job->procs[i];
+
+        if (proc->hashed && WIFEXITED(proc->status) && WEXITSTATUS(proc->status) == EXEC_NOT_FOUND)
+        {
+            hash_forget(proc->name);
+        }
+        free(proc->name);
+    }
+    if (job->coproc != NULL)
+    {
+        coproc_end(job->coproc);
+        job->coproc = NULL;
+    }
+    free(job->procs);
+    free(job->command);
+    job->procs = NULL;
+    job->command = NULL;
+    job->num_procs = 0;
+    job->max_procs = 0;
+    job->state = JOB_FREE;
+}
+
+/* Report and free every background job that has 
+   finished since the last prompt, and report any 
+   that has stopped, once pending events are handled. */
+
+void job_notify()
+{
+    event_poll();
+    for (int i = 0; i < num_jobs; i++)
+    {
+        struct job *job = job_table[i];
+
+        if (job->state == JOB_DONE && job->background)
+        {
+            if (interactive)
+            {
+                job_report(job, job_state(job));
+            }
+            report_pipeline(job->command, job->procs, job->num_procs, &job->start, job->timed, job->pipe_size);
+            job_free(job);
+        }
+        else if (job->state == JOB_STOPPED && !job->notified)
+        {
+            job_report(job, "Stopped");
+            job->notified = 1;
+        }
+    }
+}
+
+/* Print a job's line as jobs does: its id, + for the
+   current job or - for the previous one, its state
+   and its command. */
+
+void job_report(struct job *job, char *state)
+{
+    int newer = 0;
+
+    for (int i = 0; i < num_jobs; i++)
+    {
+        newer += (job_table[i]->state != JOB_FREE && job_table[i]->seq > job->seq);
+    }
+    printf("[%d]%c  %-24s%s\n", job->id, (newer == 0) ? '+' : (newer == 1) ? '-' : ' ', state, job->command);
+}
+
+/* The state jobs prints for a job: Running, Stopped,
+   Done, or the signal that killed its last stage. */
+
+char *job_state(struct job *job)
+{
+    int status = (job->num_procs > 0) ? job->procs[job->num_procs - 1].status : 0;
+
+    if (job->state == JOB_RUNNING)
+    {
+        return "Running";
+    }
+    if (job->state == JOB_STOPPED)
+    {
+        return "Stopped";
+    }
+    return WIFSIGNALED(status) ? strsignal(WTERMSIG(status)) : "Done";
+}
+
+/* Whether the job's children are put in a process 
+   group of their own. */
+
+int job_own_group(struct job *job)
+{
+    return job_control || job->background;
+}
+
+/* Continue a stopped or background job with SIGCONT, 
+   in the background or, giving it the terminal and 
+   its saved terminal modes, in the foreground, where
+   it is waited for. */
+
+void job_continue(struct job *job, int background)
+{
+    if (!background && job_control)
+    {
+        tcsetpgrp(STDIN_FILENO, job->pgid);
+        if (job->state == JOB_STOPPED)
+        {
+            tcsetattr(STDIN_FILENO, TCSADRAIN, &job->tmodes);
+        }
+    }
+    job->background = background;
+    job->notified = 0;
+    job->seq = ++job_sequence;
+    if (kill(-job->pgid, SIGCONT) < 0)
+    {
+        perror("kill()");
+    }
+    for (int i = 0; i < job->num_procs; i++)
+    {
+        job->procs[i].stopped = 0;
+    }
+    job->num_stopped = 0;
+    if (job->state == JOB_STOPPED)
+    {
+        job->state = JOB_RUNNING;
+    }
+    if (!background)
+    {
+        job_wait(job);
+    }
+}
+
+/* Find the job named by spec: %n or n for job n, %+,
+   %% or no spec for the current job, %- for the 
+   previous one and %prefix for the job whose command
+   starts with prefix. Prints an error naming builtin
+   and returns NULL if there is no such job. */
+
+struct job *job_find(char *spec, char *builtin)
+{
+    struct job *current = NULL, *previous = NULL;
+    char *name, *end;
+    int numeric;
+    long id;
+
+    for (int i = 0; i < num_jobs; i++)
+    {
+        struct job *job = job_table[i];
+
+        if (job->state == JOB_FREE || job->state == JOB_DONE || !job->background)
+        {
+            continue;
+        }
+        if (current == NULL || job->seq > current->seq)
+        {
+            previous = current;
+            current = job;
+        }
+        else if (previous == NULL || job->seq > previous->seq)
+        {
+            previous = job;
+        }
+    }
+    if (spec == NULL || strcmp(spec, "%+") == 0 || strcmp(spec, "%%") == 0 || strcmp(spec, "%-") == 0)
+    {
+        struct job *job = (spec != NULL && strcmp(spec, "%-") == 0) ? previous : current;
+
+        if (job == NULL)
+        {
+            fprintf(stderr, "%s: %s: no such job\n", builtin, (spec == NULL) ? "current" : spec);
+        }
+        return job;
+    }
+
+    name = spec + (spec[0] == '%');
+    id = strtol(name, &end, 10);
+    numeric = (*end == '\0' && end != name);
+    for (int i = 0; i < num_jobs; i++)
+    {
+        struct job *job = job_table[i];
+
+        if (job->state == JOB_FREE || job->state == JOB_DONE || !job->background)
+        {
+            continue;
+        }
+        if (numeric ? job->id == id : (name != spec && strncmp(job->command, name, strlen(name)) == 0))
+        {
+            return job;
+        }
+    }
+    fprintf(stderr, "%s: %s: no such job\n", builtin, spec);
+    return NULL;
+}
+
+/* Send SIGHUP, then SIGCONT, to every job that is 
+   still running or stopped, as the shell exits. Only
+   a shell with job control does this; a batch shell 
+   leaves its background jobs running, as sh does. */
+
+void job_hangup()
+{
+    if (!job_control)
+    {
+        return;
+    }
+    for (int i = 0; i < num_jobs; i++)
+    {
+        struct job *job = job_table[i];
+
+        if ((job->state == JOB_RUNNING || job->state == JOB_STOPPED) && job->pgid > 0 && job->pgid != shell_pgid)
+        {
+            kill(-job->pgid, SIGHUP);
+            kill(-job->pgid, SIGCONT);
+        }
+    }
+}
+
+/* Convert a wait status into a shell exit status:
+   the exit code, or 128 plus the terminating signal. */
+
+int exit_status(int status)
+{
+    if (WIFSIGNALED(status))
+    {
+        return 128 + WTERMSIG(status);
+    }
+    return WEXITSTATUS(status);
+}
+
+/* Start pipeline as the coprocess it names: a 
+   background job whose first stage reads one pipe and
+   whose last stage writes another. The shell keeps the
+   other ends, moved to close-on-exec fds from 
+   COPROC_FD_BASE up so that programs it runs never 
+   inherit them, and sets NAME_WRITE and NAME_READ to 
+   them and NAME_PID to the first stage's pid. A 
+   finished coprocess of the same name is replaced; 
+   finished jobs are reported first to find out. 
+   Returns the status. */
+
+int coproc_start(struct pipeline *pipeline)
+{
+    struct coproc *coproc;
+    int input[2], output[2];
+    struct job *job;
+
+    job_notify();
+    if ((coproc = coproc_find(pipeline->coproc)) != NULL && coproc->job != NULL)
+    {
+        fprintf(stderr, "coproc %s: already running.\n", coproc->name);
+        return EXIT_FAILURE;
+    }
+    if (coproc != NULL)
+    {
+        coproc_free(coproc);
+    }
+    if ((coproc = malloc(sizeof(struct coproc))) == NULL || (coproc->name = strdup(pipeline->coproc)) == NULL)
+    {
+        perror("malloc()");
+        free(coproc);
+        return EXIT_FAILURE;
+    }
+    if ((job = job_create(pipeline->text, pipeline->text_len, 1)) == NULL)
+    {
+        free(coproc->name);
+        free(coproc);
+        return EXIT_FAILURE;
+    }
+    make_pipe(job, input);
+    make_pipe(job, output);
+    coproc->fds[0] = fcntl(output[0], F_DUPFD_CLOEXEC, COPROC_FD_BASE);
+    coproc->fds[1] = fcntl(input[1], F_DUPFD_CLOEXEC, COPROC_FD_BASE);
+    close(output[0]);
+    close(input[1]);
+    coproc->job = job;
+    coproc->next = coprocs;
+    coprocs = job->coproc = coproc;
+    if (coproc->fds[0] < 0 || coproc->fds[1] < 0)
+    {
+        perror("fcntl()");
+        close(input[0]);
+        close(output[1]);
+        job_background(job);
+        coproc_free(coproc);
+        return EXIT_FAILURE;
+    }
+    job->timed = pipeline->timed;
+    spawn_pipeline(job, pipeline, input[0], output[1]);
+    if (job->num_procs > 0)
+    {
+        coproc_var(coproc->name, "_READ", coproc->fds[0]);
+        coproc_var(coproc->name, "_WRITE", coproc->fds[1]);
+        coproc_var(coproc->name, "_PID", (int) job->procs[0].pid);
+    }
+    job_background(job);
+    return (coproc->job == NULL) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* Find the coprocess called name, or NULL. */
+
+struct coproc *coproc_find(char *name)
+{
+    for (struct coproc *coproc = coprocs; coproc != NULL; coproc = coproc->next)
+    {
+        if (strcmp(coproc->name, name) == 0)
+        {
+            return coproc;
+        }
+    }
+    return NULL;
+}
+
+/* Set the variable named by name and suffix to value,
+   or unset it if value is -1. Returns 0, or -1 after 
+   printing an error. */
+
+int coproc_var(char *name, char *suffix, int value)
+{
+    size_t len = strlen(name) + strlen(suffix);
+    char *var = malloc(len + 1);
+    char number[16];
+    int result = 0;
+
+    if (var == NULL)
+    {
+        perror("malloc()");
+        return -1;
+    }
+    strcpy(var, name);
+    strcat(var, suffix);
+    if (value < 0)
+    {
+        var_unset(var, len);
+    }
+    else
+    {
+        snprintf(number, sizeof(number), "%d", value);
+        result = var_set(var, len, number, 0);
+    }
+    free(var);
+    return result;
+}
+
+/* Close the shell's ends of every coprocess's pipes,
+   in a child that is to be a coprocess itself, so that
+   no coprocess holds its own or another's input open. 
+   Programs lose them on exec anyway; this is for the 
+   builtins and compound commands that do not exec. */
+
+void coproc_close_all()
+{
+    for (struct coproc *coproc = coprocs; coproc != NULL; coproc = coproc->next)
+    {
+        close(coproc->fds[0]);
+        close(coproc->fds[1]);
+    }
+}
+
+/* Mark a coprocess finished, as its job is freed: its
+   input is closed and NAME_WRITE and NAME_PID unset, 
+   but its output stays open, so replies it wrote 
+   before exiting can still be read from NAME_READ. */
+
+void coproc_end(struct coproc *coproc)
+{
+    close(coproc->fds[1]);
+    coproc->fds[1] = -1;
+    coproc->job = NULL;
+    coproc_var(coproc->name, "_WRITE", -1);
+    coproc_var(coproc->name, "_PID", -1);
+}
+
+/* Close what is left of a coprocess, unset NAME_READ
+   and remove it from the list. */
+
+void coproc_free(struct coproc *coproc)
+{
+    struct coproc **link = &coprocs;
+
+    while (*link != coproc)
+    {
+        link = &(*link)->next;
+    }
+    *link = coproc->next;
+    if (coproc->job != NULL)
+    {
+        coproc->job->coproc = NULL;
+    }
+    close(coproc->fds[0]);
+    close(coproc->fds[1]);
+    coproc_var(coproc->name, "_READ", -1);
+    free(coproc->name);
+    free(coproc);
+}
+
+/* Open the MYSH_STATS file, if set, for appending one
+   JSON line per finished pipeline. */
+
+void init_stats()
+{
+    char *path = getenv(STATS_ENV);
+
+    if (path != NULL && (stats_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666)) < 0)
+    {
+        perror(path);
+    }
+}
+
+/* Milliseconds elapsed from start to end. */
+
+double elapsed_ms(struct timespec *start, struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1000.0 + (end->tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+/* Milliseconds of CPU time in a timeval. */
+
+double timeval_ms(struct timeval *tv)
+{
+    return tv->tv_sec * 1000.0 + tv->tv_usec / 1000.0;
+}
+
+/* Report a finished pipeline of num_procs stages that
+   started at start: print its times to stderr if it 
+   was prefixed by time, and append a JSON line to the
+   MYSH_STATS file if one is open. pipe_size is the 
+   capacity its pipes were given, or 0 if it had none. */
+
+void report_pipeline(char *command, struct process *procs, int num_procs, struct timespec *start, int timed, int pipe_size)
+{
+    struct timespec end = *start;
+    struct timeval user = {0, 0}, sys = {0, 0};
+
+    for (int i = 0; i < num_procs; i++)
+    {
+        if (elapsed_ms(&end, &procs[i].end) > 0)
+        {
+            end = procs[i].end;
+        }
+        timeradd(&user, &procs[i].usage.ru_utime, &user);
+        timeradd(&sys, &procs[i].usage.ru_stime, &sys);
+    }
+
+    if (timed)
+    {
+        double real_ms = elapsed_ms(start, &end);
+
+        fflush(stdout);
+        fprintf(stderr, "\nreal\t%dm%.3fs\n", (int) (real_ms / 60000), (real_ms - (int) (real_ms / 60000) * 60000) / 1000);
+        fprintf(stderr, "user\t%dm%.3fs\n", (int) (user.tv_sec / 60), (user.tv_sec % 60) + user.tv_usec / 1000000.0);
+        fprintf(stderr, "sys\t%dm%.3fs\n", (int) (sys.tv_sec / 60), (sys.tv_sec % 60) + sys.tv_usec / 1000000.0);
+
+        /* Per-stage breakdown, to find the slow stage. */
+        if (num_procs > 1 && pipe_size > 0)
+        {
+            fprintf(stderr, "pipe\t%d bytes\n", pipe_size);
+        }
+        for (int i = 0; num_procs > 1 && i < num_procs; i++)
+        {
+            struct process *proc = &procs[i];
+
+            fprintf(stderr, "%d %-12s real %.3fs user %.3fs sys %.3fs maxrss %ldKB csw %ld/%ld\n",
+                    i + 1, proc->name, elapsed_ms(&proc->start, &proc->end) / 1000,
+                    timeval_ms(&proc->usage.ru_utime) / 1000, timeval_ms(&proc->usage.ru_stime) / 1000,
+                    proc->usage.ru_maxrss, proc->usage.ru_nvcsw, proc->usage.ru_nivcsw);
+        }
+    }
+
+    if (stats_fd >= 0)
+    {
+        write_stats(command, procs, num_procs, start, &end, pipe_size);
+    }
+}
+
+/* Append one JSON line describing a finished pipeline
+   to the stats file. The line is built in memory and
+   written with a single write, so concurrent shells 
+   appending to one file never interleave lines. */
+
+void write_stats(char *command, struct process *procs, int num_procs, struct timespec *start, struct timespec *end, int pipe_size)
+{
+    FILE *line;
+    char *buf = NULL;
+    size_t len = 0;
+
+    if ((line = open_memstream(&buf, &len)) == NULL)
+    {
+        return;
+    }
+    fprintf(line, "{\"command\":");
+    json_string(line, command);
+    fprintf(line, ",\"status\":%d,\"wall_ms\":%.3f,\"pipe_size\":%d,\"stages\":[",
+            (num_procs > 0) ? exit_status(procs[num_procs - 1].status) : 0, elapsed_ms(start, end), pipe_size);
+    for (int i = 0; i < num_procs; i++)
+    {
+        struct process *proc = &procs[i];
+
+        fprintf(line, "%s{\"pid\":%d,\"argv0\":", (i > 0) ? "," : "", (int) proc->pid);
+        json_string(line, proc->name);
+        fprintf(line, ",\"status\":%d,\"wall_ms\":%.3f,\"user_ms\":%.3f,\"sys_ms\":%.3f,"
+                "\"maxrss_kb\":%ld,\"nvcsw\":%ld,\"nivcsw\":%ld}",
+                exit_status(proc->status), elapsed_ms(&proc->start, &proc->end),
+                timeval_ms(&proc->usage.ru_utime), timeval_ms(&proc->usage.ru_stime),
+                proc->usage.ru_maxrss, proc->usage.ru_nvcsw, proc->usage.ru_nivcsw);
+    }
+    fprintf(line, "]}\n");
+    fclose(line);
+
+    if (buf != NULL && write(stats_fd, buf, len) < 0)
+    {
+        perror("write()");
+    }
+    free(buf);
+}
+
+/* Append the parse cache counters to the stats file,
+   as one JSON line, when the shell exits. */
+
+void write_cache_stats()
+{
+    char buf[128];
+    int len = snprintf(buf, sizeof(buf), "{\"parse_cache\":{\"hits\":%lu,\"misses\":%lu}}\n", parse_hits, parse_misses);
+
+    if (write(stats_fd, buf, len) < 0)
+    {
+        perror("write()");
+    }
+}
+
+/* Write str to out as a JSON string literal. */
+
+void json_string(FILE *out, char *str)
+{
+    fputc('"', out);
+    for (unsigned char *c = (unsigned char *) ((str == NULL) ? "" : str); *c != '\0'; c++)
+    {
+        if (*c == '"' || *c == '\\')
+        {
+            fprintf(out, "\\%c", *c);
+        }
+        else if (*c < 0x20)
+        {
+            fprintf(out, "\\u%04x", *c);
+        }
+        else
+        {
+            fputc(*c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+/* open() flags for a redirection of the given mode. */
+
+int redirect_flags(int mode)
+{
+    switch (mode)
+    {
+        case OUTPUT: return O_WRONLY | O_CREAT | O_TRUNC;
+        case OUTPUT_APPEND: return O_WRONLY | O_CREAT | O_APPEND;
+        case READ_WRITE: return O_RDWR | O_CREAT;
+        default: return O_RDONLY;
+    }
+}
+
+/* Whether any of the command's redirections 
+   replaces fd. */
+
+int redirects_fd(struct command *command, int fd)
+{
+    for (struct redirect *redirect = command->redirects; redirect != NULL; redirect = redirect->next)
+    {
+        if (redirect->fd == fd)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Parse a file descriptor number written in decimal.
+   Returns it, or -1 if str is not one. */
+
+int parse_fd(char *str)
+{
+    long fd;
+    char *end;
+
+    if (!isdigit((unsigned char) *str))
+    {
+        return -1;
+    }
+    errno = 0;
+    fd = strtol(str, &end, 10);
+    return (*end != '\0' || errno != 0 || fd > INT_MAX) ? -1 : (int) fd;
+}
+
+/* The redirect engine: append the command's fd 
+   operations to plan as file actions, in the order 
+   they were written, so 2>&1 >file and >file 2>&1 
+   differ as in sh. Callers add any pipe first, so a 
+   redirection of stdin or stdout wins over the pipe.
+   Every file is opened once, by the child; the shell
+   itself opens nothing. */
+
+void spawn_add_redirects(struct spawn_plan *plan, struct command *command)
+{
+    for (struct redirect *redirect = command->redirects; redirect != NULL; redirect = redirect->next)
+    {
+        if (redirect->mode == DUP_FD)
+        {
+            spawn_add_dup2(plan, redirect->src_fd, redirect->fd);
+        }
+        else if (redirect->mode == CLOSE_FD)
+        {
+            spawn_add_close(plan, redirect->fd);
+        }
+        else
+        {
+            spawn_add_open(plan, redirect->fd, redirect->file, redirect_flags(redirect->mode));
+        }
+    }
+}
+
+/* Apply the command's fd operations to the shell's 
+   own fds, for a builtin run in the shell, saving 
+   each replaced fd once in saved. Returns 0, or -1 
+   after printing an error and undoing them. */
+
+int redirect_shell(struct command *command, struct saved_fd saved[], int *num_saved)
+{
+    *num_saved = 0;
+    for (struct redirect *redirect = command->redirects; redirect != NULL; redirect = redirect->next)
+    {
+        int i, file_fd;
+
+        for (i = 0; i < *num_saved && saved[i].fd != redirect->fd; i++)
+        {
+            ;
+        }
+        if (i == *num_saved)
+        {
+            saved[i].fd = redirect->fd;
+            if ((saved[i].saved = fcntl(redirect->fd, F_DUPFD_CLOEXEC, SAVED_FD_BASE)) < 0 && errno != EBADF)
+            {
+                perror("fcntl()");
+                restore_shell(saved, *num_saved);
+                return -1;
+            }
+            (*num_saved)++;
+        }
+
+        if (redirect->mode == CLOSE_FD)
+        {
+            close(redirect->fd);
+            continue;
+        }
+        if (redirect->mode == DUP_FD)
+        {
+            file_fd = redirect->src_fd;
+        }
+        else if ((file_fd = open(redirect->file, redirect_flags(redirect->mode), 0666)) < 0)
+        {
+            perror("open()");
+            restore_shell(saved, *num_saved);
+            return -1;
+        }
+        if (file_fd != redirect->fd && dup2(file_fd, redirect->fd) < 0)
+        {
+            perror("dup2()");
+            if (redirect->mode != DUP_FD)
+            {
+                close(file_fd);
+            }
+            restore_shell(saved, *num_saved);
+            return -1;
+        }
+        if (redirect->mode != DUP_FD && file_fd != redirect->fd)
+        {
+            close(file_fd);
+        }
+    }
+    return 0;
+}
+
+/* Put back the shell fds saved by redirect_shell, 
+   latest first, closing those that were not open. */
+
+void restore_shell(struct saved_fd saved[], int num_saved)
+{
+    for (int i = num_saved - 1; i >= 0; i--)
+    {
+        if (saved[i].saved < 0)
+        {
+            close(saved[i].fd);
+            continue;
+        }
+        if (dup2(saved[i].saved, saved[i].fd) < 0)
+        {
+            perror_exit("dup2()");
+        }
+        close(saved[i].saved);
+    }
+}
+
+/* With the outbuf option set, put a buffer stage in 
+   front of the command's output files: each > or >> 
+   whose file is a regular file (or does not exist yet)
+   is opened by the shell and handed to a forked copy 
+   of the shell, which coalesces what the command 
+   writes into large aligned blocks. The redirection 
+   is replaced, in a copy of the list, by one to the 
+   stage's pipe, so the fds end up where they would 
+   without the stage. With the tee flag, later > or >> 
+   of the same fd join the first one's stage (see 
+   buffer_next), which writes each block to all of the 
+   files, so >a >b fills both instead of only b. Any 
+   other target (a terminal, a pipe, /dev/null) is left
+   to the redirect engine. Returns -1 after printing an
+   error. */
+
+int buffer_redirects(struct pipeline *pipeline, struct command *command)
+{
+    struct redirect *list = NULL, **last = &list;
+    struct redirect *buffered[MAX_REDIRECTS];
+    int num_buffered = 0;
+
+    for (struct redirect *redirect = command->redirects; redirect != NULL; redirect = redirect->next)
+    {
+        struct redirect *copy;
+        int write_fd = -1;
+        int merged = 0, result = 0;
+
+        if (redirect->mode == OUTPUT || redirect->mode == OUTPUT_APPEND)
+        {
+            for (int i = 0; i < num_buffered && !merged; i++)
+            {
+                for (struct redirect *member = buffered[i]; member != NULL && !merged; member = buffer_next(buffered[i], member))
+                {
+                    merged = (member == redirect);
+                }
+            }
+            /* Joined the stage an earlier one started. */
+            if (merged)
+            {
+                continue;
+            }
+            if ((result = buffer_start(pipeline, redirect, &write_fd)) < 0)
+            {
+                return -1;
+            }
+        }
+        copy = arena_alloc(&line_arena, sizeof(struct redirect));
+        *copy = *redirect;
+        copy->next = NULL;
+        if (result > 0)
+        {
+            copy->mode = OUTPUT;
+            copy->file = fd_path(write_fd);
+            buffered[num_buffered++] = redirect;
+        }
+        *last = copy;
+        last = &copy->next;
+    }
+    if (num_buffered > 0)
+    {
+        command->redirects = list;
+        command->last_redirect = last;
+    }
+    return 0;
+}
+
+/* The next redirection after redirect that joins the 
+   buffer stage of first, or NULL. Only with the tee 
+   flag does any: a later > or >> of the same fd, as 
+   long as nothing in between replaces that fd or 
+   duplicates it (as 2>&1 does for fd 1), so >a 2>&1 >b
+   still sends stderr to a alone. */
+
+struct redirect *buffer_next(struct redirect *first, struct redirect *redirect)
+{
+    if (!outbuf_tee)
+    {
+        return NULL;
+    }
+    for (redirect = redirect->next; redirect != NULL; redirect = redirect->next)
+    {
+        if (redirect->fd == first->fd && (redirect->mode == OUTPUT || redirect->mode == OUTPUT_APPEND))
+        {
+            return redirect;
+        }
+        if (redirect->fd == first->fd || (redirect->mode == DUP_FD && redirect->src_fd == first->fd))
+        {
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+/* Start a buffer stage for first and the redirections
+   that join it, if all of their files qualify. The 
+   shell opens each file, so a bad path fails the 
+   command as it would without the stage; with the 
+   direct flag a truncated file is opened with O_DIRECT
+   where the filesystem allows it. Returns 1 with 
+   *write_fd set to the write end of the stage's pipe 
+   (kept in pipeline->fds), 0 if the files do not 
+   qualify, or -1 after printing an error. */
+
+int buffer_start(struct pipeline *pipeline, struct redirect *first, int *write_fd)
+{
+    int files[MAX_REDIRECTS];
+    int num_files = 0, failed = 0;
+    int pipe_fds[2];
+    pid_t pid;
+
+    for (struct redirect *redirect = first; redirect != NULL; redirect = buffer_next(first, redirect))
+    {
+        if (!buffer_target(redirect))
+        {
+            return 0;
+        }
+    }
+    for (struct redirect *redirect = first; redirect != NULL; redirect = buffer_next(first, redirect))
+    {
+        int flags = redirect_flags(redirect->mode) | O_CLOEXEC;
+        int fd = -1;
+
+        /* O_DIRECT needs aligned offsets, so never for >>. */
+        if (outbuf_direct && redirect->mode == OUTPUT)
+        {
+            fd = open(redirect->file, flags | O_DIRECT, 0666);
+        }
+        if (fd < 0 && (fd = open(redirect->file, flags, 0666)) < 0)
+        {
+            perror("open()");
+            failed = 1;
+            break;
+        }
+        files[num_files++] = fd;
+    }
+    if (failed || pipe2(pipe_fds, O_CLOEXEC) < 0)
+    {
+        if (!failed)
+        {
+            perror("pipe2()");
+        }
+        for (int i = 0; i < num_files; i++)
+        {
+            close(files[i]);
+        }
+        return -1;
+    }
+    fflush(stdout);
+    if ((pid = fork()) < 0)
+    {
+        perror("fork()");
+        close_pipes(pipe_fds);
+        for (int i = 0; i < num_files; i++)
+        {
+            close(files[i]);
+        }
+        return -1;
+    }
+    if (pid == 0)
+    {
+        for (int i = 0; i < pipeline->num_fds; i++)
+        {
+            close(pipeline->fds[i]);
+        }
+        close(pipe_fds[1]);
+        coproc_close_all();
+        signal(SIGINT, SIG_IGN);
+        signal(SIGQUIT, SIG_IGN);
+        buffer_run(pipe_fds[0], files, num_files);
+    }
+    close(pipe_fds[0]);
+    for (int i = 0; i < num_files; i++)
+    {
+        close(files[i]);
+    }
+    if ((pipeline->stages[pipeline->num_stages] = (int) syscall(SYS_pidfd_open, pid, 0)) < 0)
+    {
+        perror("pidfd_open()");
+    }
+    else
+    {
+        pipeline->num_stages++;
+    }
+    *write_fd = pipeline->fds[pipeline->num_fds++] = pipe_fds[1];
+    return 1;
+}
+
+/* Whether the redirection's file may be buffered: a 
+   regular file, or a path that does not exist yet. */
+
+int buffer_target(struct redirect *redirect)
+{
+    struct stat st;
+
+    if (stat(redirect->file, &st) < 0)
+    {
+        return errno == ENOENT;
+    }
+    return S_ISREG(st.st_mode);
+}
+
+/* Body of a buffer stage: fill an aligned block of 
+   outbuf_size bytes from input and write each full 
+   block to every file, then whatever is left at end 
+   of input, with O_DIRECT cleared for that last, 
+   unaligned write. Exits with EXIT_FAILURE if any 
+   write failed. */
+
+void buffer_run(int input, int files[], int num_files)
+{
+    size_t size = ((size_t) outbuf_size + OUTBUF_ALIGN - 1) / OUTBUF_ALIGN * OUTBUF_ALIGN;
+    size_t len = 0;
+    char *block;
+    ssize_t n;
+
+    if ((errno = posix_memalign((void **) &block, OUTBUF_ALIGN, size)) != 0)
+    {
+        child_perror_exit("posix_memalign()");
+    }
+    while ((n = read(input, block + len, size - len)) != 0)
+    {
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            child_perror_exit("read()");
+        }
+        if ((len += n) == size)
+        {
+            buffer_write(files, num_files, block, len);
+            len = 0;
+        }
+    }
+    for (int i = 0; i < num_files; i++)
+    {
+        int flags;
+
+        if (files[i] >= 0 && (flags = fcntl(files[i], F_GETFL)) >= 0 && (flags & O_DIRECT))
+        {
+            fcntl(files[i], F_SETFL, flags & ~O_DIRECT);
+        }
+    }
+    if (len > 0)
+    {
+        buffer_write(files, num_files, block, len);
+    }
+    for (int i = 0; i < num_files; i++)
+    {
+        if (files[i] < 0)
+        {
+            _exit(EXIT_FAILURE);
+        }
+    }
+    _exit(EXIT_SUCCESS);
+}
+
+/* Write block to each file still open, retrying short
+   writes; a file that fails is reported and dropped 
+   (its entry set to -1). */
+
+void buffer_write(int files[], int num_files, char *block, size_t len)
+{
+    for (int i = 0; i < num_files; i++)
+    {
+        size_t done = 0;
+
+        while (files[i] >= 0 && done < len)
+        {
+            ssize_t written = write(files[i], block + done, len - done);
+
+            if (written < 0 && errno != EINTR)
+            {
+                char msg[MAX_PATH];
+                int msg_len = snprintf(msg, sizeof(msg), "outbuf: write(): %s\n", strerror(errno));
+
+                if (write(STDERR_FILENO, msg, msg_len) < 0)
+                {
+                    ;
+                }
+                close(files[i]);
+                files[i] = -1;
+            }
+            else if (written > 0)
+            {
+                done += written;
+            }
+        }
+    }
+}
+
+/* Finish with the pipeline's buffer stages once the 
+   shell has closed its ends of their pipes: if wait is
+   set, block until each has flushed and exited, so the 
+   files are complete when the next command runs, and 
+   give a command that succeeded the status of a stage
+   that failed to write; otherwise leave them for the 
+   event loop to reap, or, if it cannot take one, wait
+   for that one here so it is not left a zombie. */
+
+void buffer_wait(struct pipeline *pipeline, int wait)
+{
+    for (int i = 0; i < pipeline->num_stages; i++)
+    {
+        siginfo_t info;
+
+        if (!wait && event_add(pipeline->stages[i], EVENT_CHILD) == 0)
+        {
+            continue;
+        }
+        info.si_pid = 0;
+        while (syscall(SYS_waitid, P_PIDFD, pipeline->stages[i], &info, WEXITED, NULL) < 0 && errno == EINTR)
+        {
+            ;
+        }
+        if (wait && info.si_pid != 0 && last_status == EXIT_SUCCESS)
+        {
+            last_status = exit_status(wait_status(&info));
+        }
+        close(pipeline->stages[i]);
+    }
+    pipeline->num_stages = 0;
+}
+
+/* Read the initial pipe capacity from the MYSH_PIPESIZE 
+   environment variable, as set pipesize= would. */
+
+void init_pipes()
+{
+    char *value = getenv(PIPESIZE_ENV);
+
+    if (value != NULL && set_pipesize(value) < 0)
+    {
+        fprintf(stderr, "Ignoring %s='%s'.\n", PIPESIZE_ENV, value);
+    }
+}
+
+/* Create a pipe for job and, if a pipe size is set, 
+   resize it with F_SETPIPE_SZ. The capacity the 
+   kernel actually gave is recorded in the job; if the 
+   resize is refused, one warning is printed until the
+   option is changed and the default is kept. */
+
+void make_pipe(struct job *job, int pipe_fds[])
+{
+    int size;
+
+    if (pipe(pipe_fds) < 0)
+    {
+        perror_exit("pipe()");
+    }
+    if (pipe_size_request == PIPESIZE_DEFAULT)
+    {
+        return;
+    }
+    if ((size = fcntl(pipe_fds[1], F_SETPIPE_SZ, pipe_size_request)) < 0)
+    {
+        if (!pipe_size_warned)
+        {
+            fprintf(stderr, "pipesize %d: %s\n", pipe_size_request, strerror(errno));
+            pipe_size_warned = 1;
+        }
+        size = pipe_size_get(pipe_fds[1]);
+    }
+    /* Stages may get different sizes; report the smallest. */
+    if (job->pipe_size == 0 || size < job->pipe_size)
+    {
+        job->pipe_size = size;
+    }
+}
+
+/* Capacity of the pipe open on fd, or 0 if unknown. */
+
+int pipe_size_get(int fd)
+{
+    int size = fcntl(fd, F_GETPIPE_SZ);
+
+    return (size < 0) ? 0 : size;
+}
+
+/* Parse a byte count with an optional K, M or G suffix 
+   into size. Returns 0, or -1 if str is not a positive 
+   size that fits in an int. */
+
+int parse_size(char *str, int *size)
+{
+    long long value;
+    char *end;
+
+    errno = 0;
+    value = strtoll(str, &end, 10);
+    if (end == str || errno != 0 || value <= 0 || value > INT_MAX)
+    {
+        return -1;
+    }
+    switch (*end)
+    {
+        case 'k': case 'K': value <<= 10; end++; break;
+        case 'm': case 'M': value <<= 20; end++; break;
+        case 'g': case 'G': value <<= 30; end++; break;
+    }
+    if (*end != '\0' || value > INT_MAX)
+    {
+        return -1;
+    }
+    *size = (int) value;
+    return 0;
+}
+
+/* Spawn every stage of pipeline into job. A stage 
+   reads the previous stage's pipe and writes a new one
+   (both made here, the write end resized by make_pipe),
+   and then its own redirections apply on top, so any 
+   stage may redirect any fd. The shell closes each pipe
+   end once the stages using it have started. input_fd
+   and output_fd, unless -1, are given to the first 
+   stage as stdin and the last as stdout, and closed in
+   the same way. */
+
+void spawn_pipeline(struct job *job, struct pipeline *pipeline, int input_fd, int output_fd)
+{
+    int last = pipeline->num_commands - 1;
+
+    for (int i = 0; i <= last; i++)
+    {
+        struct spawn_plan plan;
+        int pipe_fds[2];
+
+        spawn_plan_init(&plan, pipeline->commands[i].argv.items);
+        if (pipeline->commands[i].body != NULL)
+        {
+            plan.builtin = NULL;
+            plan.body = pipeline->commands[i].body;
+        }
+        if (pipeline->commands[i].env.len > 0)
+        {
+            plan.envp = env_with(&pipeline->commands[i].env);
+        }
+        if (i < last)
+        {
+            make_pipe(job, pipe_fds);
+        }
+        if (input_fd >= 0)
+        {
+            spawn_add_dup2(&plan, input_fd, STDIN_FILENO);
+            spawn_add_close(&plan, input_fd);
+        }
+        if (i < last)
+        {
+            spawn_add_dup2(&plan, pipe_fds[1], STDOUT_FILENO);
+            spawn_add_close_pipes(&plan, pipe_fds);
+        }
+        else if (output_fd >= 0)
+        {
+            spawn_add_dup2(&plan, output_fd, STDOUT_FILENO);
+            spawn_add_close(&plan, output_fd);
+        }
+        spawn_add_redirects(&plan, &pipeline->commands[i]);
+        spawn_command(job, &plan);
+
+        if (input_fd >= 0)
+        {
+            close(input_fd);
+        }
+        if (i < last)
+        {
+            close(pipe_fds[1]);
+            input_fd = pipe_fds[0];
+        }
+    }
+    if (output_fd >= 0)
+    {
+        close(output_fd);
+    }
+}
+
+/* Initialize an empty spawn plan that will 
+   execute the NULL-terminated argv in the shell's
+   environment. */
+
+void spawn_plan_init(struct spawn_plan *plan, char *argv[])
+{
+    plan->argv = argv;
+    plan->envp = environ;
+    plan->path = NULL;
+    plan->builtin = (argv[0] == NULL) ? NULL : find_builtin(argv);
+    plan->body = NULL;
+    plan->num_actions = 0;
+    plan->pinned = 0;
+}
+
+/* Append a file action to the plan. The plan holds at
+   most MAX_SPAWN_ACTIONS actions, which every caller in
+   this file stays within; overflowing it is a bug. */
+
+static struct spawn_action *spawn_add_action(struct spawn_plan *plan, int type, int fd)
+{
+    struct spawn_action *action;
+
+    if (plan->num_actions >= MAX_SPAWN_ACTIONS)
+    {
+        fprintf(stderr, "Too many spawn actions.\n");
+        exit(EXIT_FAILURE);
+    }
+    action = &plan->actions[plan->num_actions++];
+    action->type = type;
+    action->fd = fd;
+    action->src_fd = -1;
+    action->path = NULL;
+    action->flags = 0;
+    return action;
+}
+
+/* Open path with flags (mode 0666) as fd in the child. */
+
+void spawn_add_open(struct spawn_plan *plan, int fd, char *path, int flags)
+{
+    struct spawn_action *action = spawn_add_action(plan, SPAWN_OPEN, fd);
+
+    action->path = path;
+    action->flags = flags;
+}
+
+/* Duplicate src_fd onto fd in the child. */
+
+void spawn_add_dup2(struct spawn_plan *plan, int src_fd, int fd)
+{
+    spawn_add_action(plan, SPAWN_DUP2, fd)->src_fd = src_fd;
+}
+
+/* Close fd in the child. */
+
+void spawn_add_close(struct spawn_plan *plan, int fd)
+{
+    spawn_add_action(plan, SPAWN_CLOSE, fd);
+}
+
+/* Close both ends of a pipe in the child. */
+
+void spawn_add_close_pipes(struct spawn_plan *plan, int pipe_fds[])
+{
+    spawn_add_close(plan, pipe_fds[0]);
+    spawn_add_close(plan, pipe_fds[1]);
+}
+
+/* Create the shell's epoll set, in which every child 
+   is watched through a pidfd and input fds are waited
+   for, and, with job control, a signalfd for SIGCHLD,
+   which only reports stops and continues. SIGCHLD 
+   stays blocked in the shell; children unblock it. A 
+   forked copy of the shell calls this again to get a 
+   set of its own, since it shares the parent's set 
+   until then. */
+
+void init_events()
+{
+    if (event_fd >= 0)
+    {
+        close(event_fd);
+    }
+    if (signal_fd >= 0)
+    {
+        close(signal_fd);
+        signal_fd = -1;
+    }
+    if ((event_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    {
+        perror_exit("epoll_create1()");
+    }
+    if (sigprocmask(SIG_BLOCK, &sigchld_mask, NULL) < 0)
+    {
+        perror_exit("sigprocmask()");
+    }
+    if (job_control)
+    {
+        if ((signal_fd = signalfd(-1, &sigchld_mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+        {
+            perror_exit("signalfd()");
+        }
+        event_add(signal_fd, EVENT_SIGNAL);
+    }
+}
+
+/* Add fd to the epoll set as an event of the given 
+   type. Returns 0, or -1 if fd cannot be watched (a 
+   regular file, which is always ready) or on error. */
+
+int event_add(int fd, int type)
+{
+    struct epoll_event event;
+
+    event.events = EPOLLIN;
+    event.data.u64 = ((uint64_t) type << 32) | (uint32_t) fd;
+    if (epoll_ctl(event_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+    {
+        if (errno != EPERM)
+        {
+            perror("epoll_ctl()");
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/* Watch the child pid through a pidfd until it exits.
+   Returns the pidfd, or -1 after printing an error. */
+
+int event_watch(pid_t pid)
+{
+    int fd = (int) syscall(SYS_pidfd_open, pid, 0);
+
+    if (fd < 0)
+    {
+        perror("pidfd_open()");
+        return -1;
+    }
+    if (event_add(fd, EVENT_CHILD) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Wait up to timeout ms (-1 for no limit) for events 
+   and handle them: a child whose pidfd is readable is
+   reaped, and a SIGCHLD read from the signalfd means 
+   some children stopped or continued. Returns the 
+   number of events, 0 if the time ran out, with 
+   *ready set if fd (unless -1) is readable. */
+
+int event_wait(int timeout, int fd, int *ready)
+{
+    struct epoll_event events[EVENT_BATCH];
+    int n;
+
+    if ((n = epoll_wait(event_fd, events, EVENT_BATCH, timeout)) < 0)
+    {
+        if (errno != EINTR)
+        {
+            perror_exit("epoll_wait()");
+        }
+        return 0;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        int type = (int) (events[i].data.u64 >> 32);
+        int event = (int) (uint32_t) events[i].data.u64;
+
+        if (type == EVENT_CHILD)
+        {
+            event_child(event);
+        }
+        else if (type == EVENT_SIGNAL)
+        {
+            event_stops();
+        }
+        else if (event == fd && ready != NULL)
+        {
+            *ready = 1;
+        }
+    }
+    return n;
+}
+
+/* Handle every event already pending, without 
+   blocking, so job states are up to date. */
+
+void event_poll()
+{
+    while (event_wait(0, -1, NULL) > 0)
+    {
+        ;
+    }
+}
+
+/* Block until fd is readable, handling child events 
+   in the meantime. A fd epoll cannot watch, such as a
+   regular file, is taken as ready at once. */
+
+void event_wait_fd(int fd)
+{
+    int ready = 0;
+
+    if (event_add(fd, EVENT_INPUT) < 0)
+    {
+        return;
+    }
+    while (!ready)
+    {
+        event_wait(-1, fd, &ready);
+    }
+    epoll_ctl(event_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+/* Reap the child that the readable pidfd stands for,
+   with its resource usage, and close the pidfd. Its 
+   status goes to its job, or to capture_status if it 
+   ran a command substitution; any other child, for 
+   <(...) or >(...), is just reaped. */
+
+void event_child(int pidfd)
+{
+    struct rusage usage;
+    siginfo_t info;
+    long result;
+    int status;
+
+    info.si_pid = 0;
+    result = syscall(SYS_waitid, P_PIDFD, pidfd, &info, WEXITED | WNOHANG, &usage);
+    if (result < 0 && errno != ECHILD)
+    {
+        perror("waitid()");
+        return;
+    }
+    if (result == 0 && info.si_pid == 0)
+    {
+        return;
+    }
+    epoll_ctl(event_fd, EPOLL_CTL_DEL, pidfd, NULL);
+    close(pidfd);
+    if (result < 0)
+    {
+        return;
+    }
+    status = wait_status(&info);
+    if (info.si_pid == capture_pid)
+    {
+        capture_status = status;
+        capture_pid = 0;
+    }
+    job_record_status(info.si_pid, status, &usage);
+}
+
+/* Drain the SIGCHLD signalfd and record every child 
+   that has stopped or continued since. Exits are left
+   to the pidfds. */
+
+void event_stops()
+{
+    struct signalfd_siginfo signal_info;
+    siginfo_t info;
+
+    while (read(signal_fd, &signal_info, sizeof(signal_info)) == sizeof(signal_info))
+    {
+        ;
+    }
+    while (1)
+    {
+        info.si_pid = 0;
+        if (waitid(P_ALL, 0, &info, WSTOPPED | WCONTINUED | WNOHANG) < 0 || info.si_pid == 0)
+        {
+            break;
+        }
+        job_record_status(info.si_pid, wait_status(&info), NULL);
+    }
+}
+
+/* The wait status, as wait4 would give it, for what 
+   waitid reported in info. */
+
+int wait_status(siginfo_t *info)
+{
+    switch (info->si_code)
+    {
+        case CLD_EXITED: return (info->si_status & 0xff) << 8;
+        case CLD_KILLED: return info->si_status & 0x7f;
+        case CLD_DUMPED: return (info->si_status & 0x7f) | 0x80;
+        case CLD_STOPPED: case CLD_TRAPPED: return ((info->si_status & 0xff) << 8) | 0x7f;
+        default: return 0xffff;
+    }
+}
+
+/* Select the spawn backend from the MYSH_SPAWN 
+   environment variable: "fork" (default), "vfork"
+   or "posix_spawn". */
+
+void init_spawn()
+{
+    char *backend = getenv(SPAWN_ENV);
+
+    if (backend == NULL || strcmp(backend, "fork") == 0)
+    {
+        spawn_backend = SPAWN_FORK;
+    }
+    else if (strcmp(backend, "vfork") == 0)
+    {
+        spawn_backend = SPAWN_VFORK;
+    }
+    else if (strcmp(backend, "posix_spawn") == 0)
+    {
+        spawn_backend = SPAWN_POSIX;
+    }
+    else
+    {
+        fprintf(stderr, "Unknown %s backend '%s', using fork.\n", SPAWN_ENV, backend);
+        spawn_backend = SPAWN_FORK;
+    }
+}
+
+/* Launch plan as a new child of job with the selected 
+   backend and record it in the job. Returns the pid
+   of the child, or -1 if it could not be started. */
+
+pid_t spawn_command(struct job *job, struct spawn_plan *plan)
+{
+    struct timespec start;
+    pid_t child_pid;
+
+    if (plan->argv[0] == NULL)
+    {
+        printf("Missing program.\n");
+        return -1;
+    }
+
+    /* Resolve the program in the parent, so neither a 
+       vfork child nor the C library searches PATH. */
+    if (plan->builtin == NULL && plan->body == NULL)
+    {
+        plan->path = hash_lookup(plan->argv[0]);
+    }
+
+    spawn_place(job, plan);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    /* A builtin or compound command child runs shell 
+       code, so it always gets its own copy of the shell 
+       from a plain fork. */
+    if (spawn_backend == SPAWN_POSIX && plan->builtin == NULL && plan->body == NULL)
+    {
+        child_pid = spawn_posix(job, plan);
+    }
+    else if (spawn_backend == SPAWN_VFORK && plan->builtin == NULL && plan->body == NULL)
+    {
+        if ((child_pid = vfork()) == 0)
+        {
+            spawn_child(job, plan);
+        }
+        if (child_pid < 0)
+        {
+            perror("vfork()");
+        }
+    }
+    else
+    {
+        fflush(stdout);
+        if ((child_pid = fork()) == 0)
+        {
+            spawn_child(job, plan);
+        }
+        if (child_pid < 0)
+        {
+            perror("fork()");
+        }
+    }
+
+    if (child_pid > 0)
+    {
+        job_add_pid(job, child_pid);
+        if (job->num_procs > 0 && job->procs[job->num_procs - 1].pid == child_pid)
+        {
+            struct process *proc = &job->procs[job->num_procs - 1];
+
+            proc->name = strdup(plan->argv[0]);
+            proc->hashed = (plan->path != NULL);
+            proc->start = start;
+        }
+    }
+    return child_pid;
+}
+
+/* Child side of the fork and vfork backends: apply the
+   plan's file actions in order, then execute (or, for 
+   a builtin or compound command, run it and exit with
+   its status). Since a 
+   vfork child shares the shell's memory, nothing here
+   touches stdio buffers or returns; every failure ends
+   the child through child_perror_exit (closing an fd 
+   that is not open, as >&- may, is not a failure, as 
+   with posix_spawn). The affinity, nice and ionice 
+   settings are applied just before the file actions.
+   
+   With job control, each stage joins the job's process
+   group (the first stage leads it), a foreground one 
+   takes the terminal, and the job control signals the
+   shell ignores are reset. Without job control, only
+   background stages get a group of their own, with 
+   stdin read from /dev/null (any pipe or redirection 
+   in the plan replaces it). */
+
+void spawn_child(struct job *job, struct spawn_plan *plan)
+{
+    char *failed;
+    int fd;
+
+    if (sigprocmask(SIG_UNBLOCK, &sigchld_mask, NULL) < 0)
+    {
+        child_perror_exit("sigprocmask()");
+    }
+    if (job_own_group(job) && setpgid(0, job->pgid) < 0)
+    {
+        child_perror_exit("setpgid()");
+    }
+    if (job_control)
+    {
+        if (!job->background && tcsetpgrp(STDIN_FILENO, getpgrp()) < 0)
+        {
+            child_perror_exit("tcsetpgrp()");
+        }
+        signal(SIGINT, SIG_DFL);
+        signal(SIGQUIT, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGTTIN, SIG_DFL);
+        signal(SIGTTOU, SIG_DFL);
+    }
+    else if (job->background)
+    {
+        if ((fd = open("/dev/null", O_RDONLY)) < 0)
+        {
+            child_perror_exit("open()");
+        }
+        if (fd != STDIN_FILENO && (dup2(fd, STDIN_FILENO) < 0 || close(fd) < 0))
+        {
+            child_perror_exit("dup2()");
+        }
+    }
+    if ((failed = spawn_schedule(0, plan)) != NULL)
+    {
+        child_perror_exit(failed);
+    }
+
+    for (int i = 0; i < plan->num_actions; i++)
+    {
+        struct spawn_action *action = &plan->actions[i];
+
+        if (action->type == SPAWN_OPEN)
+        {
+            if ((fd = open(action->path, action->flags, 0666)) < 0)
+            {
+                child_perror_exit("open()");
+            }
+            if (fd != action->fd)
+            {
+                if (dup2(fd, action->fd) < 0)
+                {
+                    child_perror_exit("dup2()");
+                }
+                if (close(fd) < 0)
+                {
+                    child_perror_exit("close()");
+                }
+            }
+        }
+        else if (action->type == SPAWN_DUP2)
+        {
+            if (dup2(action->src_fd, action->fd) < 0)
+            {
+                child_perror_exit("dup2()");
+            }
+        }
+        else if (close(action->fd) < 0 && errno != EBADF)
+        {
+            child_perror_exit("close()");
+        }
+    }
+
+    if (job->coproc != NULL)
+    {
+        coproc_close_all();
+    }
+    /* A compound command or function runs shell code
+       that may start jobs of its own. */
+    if (plan->body != NULL || plan->builtin == &function_builtin)
+    {
+        subshell_init();
+    }
+    else if (plan->builtin != NULL)
+    {
+        init_events();
+    }
+    if (plan->body != NULL)
+    {
+        execute_list(plan->body);
+        fflush(stdout);
+        _exit(last_status);
+    }
+    if (plan->builtin != NULL)
+    {
+        int status = plan->builtin->func(plan->argv);
+
+        fflush(stdout);
+        _exit(status);
+    }
+    exec_and_handle_error(plan->path, plan->argv, plan->envp);
+}
+
+/* posix_spawn backend: the plan's actions become spawn
+   file actions, and the process group and signal mask
+   become spawn attributes, so the C library can use its
+   fastest clone path. posix_spawn has no attributes for
+   affinity, nice or ionice, so the parent applies them
+   to the new pid, which may already have run for a 
+   moment. Returns the pid of the child, or -1 after 
+   printing an error. */
+
+pid_t spawn_posix(struct job *job, struct spawn_plan *plan)
+{
+    posix_spawn_file_actions_t file_actions;
+    posix_spawnattr_t attr;
+    sigset_t child_mask;
+    short flags = POSIX_SPAWN_SETSIGMASK;
+    pid_t child_pid;
+    char *failed;
+    int error;
+
+    posix_spawn_file_actions_init(&file_actions);
+    posix_spawnattr_init(&attr);
+
+    if (job_own_group(job))
+    {
+        flags |= POSIX_SPAWN_SETPGROUP;
+        posix_spawnattr_setpgroup(&attr, job->pgid);
+    }
+    if (job_control)
+    {
+        sigset_t defaults;
+
+        sigemptyset(&defaults);
+        sigaddset(&defaults, SIGINT);
+        sigaddset(&defaults, SIGQUIT);
+        sigaddset(&defaults, SIGTSTP);
+        sigaddset(&defaults, SIGTTIN);
+        sigaddset(&defaults, SIGTTOU);
+        flags |= POSIX_SPAWN_SETSIGDEF;
+        posix_spawnattr_setsigdefault(&attr, &defaults);
+#ifdef POSIX_SPAWN_TCSETPGROUP_NP
+        if (!job->background)
+        {
+            posix_spawn_file_actions_addtcsetpgrp_np(&file_actions, STDIN_FILENO);
+        }
+#endif
+    }
+    else if (job->background)
+    {
+        posix_spawn_file_actions_addopen(&file_actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    }
+    for (int i = 0; i < plan->num_actions; i++)
+    {
+        struct spawn_action *action = &plan->actions[i];
+
+        if (action->type == SPAWN_OPEN)
+        {
+            posix_spawn_file_actions_addopen(&file_actions, action->fd, action->path, action->flags, 0666);
+        }
+        else if (action->type == SPAWN_DUP2)
+        {
+            posix_spawn_file_actions_adddup2(&file_actions, action->src_fd, action->fd);
+        }
+        else
+        {
+            posix_spawn_file_actions_addclose(&file_actions, action->fd);
+        }
+    }
+
+    sigprocmask(SIG_BLOCK, NULL, &child_mask);
+    sigdelset(&child_mask, SIGCHLD);
+    posix_spawnattr_setsigmask(&attr, &child_mask);
+    posix_spawnattr_setflags(&attr, flags);
+
+    /* A hashed path that has disappeared is forgotten 
+       and the program is searched for again. */
+    error = ENOENT;
+    if (plan->path != NULL)
+    {
+        error = posix_spawn(&child_pid, plan->path, &file_actions, &attr, plan->argv, plan->envp);
+        if (error == ENOENT)
+        {
+            hash_forget(plan->argv[0]);
+            plan->path = NULL;
+        }
+    }
+    if (error == ENOENT)
+    {
+        error = posix_spawnp(&child_pid, plan->argv[0], &file_actions, &attr, plan->argv, plan->envp);
+    }
+    if (error != 0)
+    {
+        fprintf(stderr, "%s posix_spawnp(): %s\n", plan->argv[0], strerror(error));
+        job_add_failed(job, plan->argv[0], W_EXITCODE((error == ENOENT) ? EXEC_NOT_FOUND : EXEC_NOT_EXECUTABLE, 0));
+        child_pid = -1;
+    }
+    else if ((failed = spawn_schedule(child_pid, plan)) != NULL)
+    {
+        fprintf(stderr, "%s %s: %s\n", plan->argv[0], failed, strerror(errno));
+    }
+
+    posix_spawn_file_actions_destroy(&file_actions);
+    posix_spawnattr_destroy(&attr);
+    return child_pid;
+}
+
+/* Choose the CPUs for the next stage of job, which 
+   is its stage number job->num_procs, from the 
+   affinity option. */
+
+void spawn_place(struct job *job, struct spawn_plan *plan)
+{
+    if (placement.mode == PLACE_SET)
+    {
+        plan->pinned = 1;
+        plan->cpus = placement.cpus;
+    }
+    else if (placement.mode == PLACE_COMPACT)
+    {
+        plan->pinned = 1;
+        CPU_ZERO(&plan->cpus);
+        CPU_SET(placement.order[job->num_procs % placement.num_cpus], &plan->cpus);
+    }
+}
+
+/* Apply the plan's CPUs and the nice and ionice options
+   to pid (0 for the calling process). Only system calls 
+   are made, so a vfork child may use it. Returns NULL,
+   or the name of the call that failed with errno set. */
+
+char *spawn_schedule(pid_t pid, struct spawn_plan *plan)
+{
+    if (plan->pinned && sched_setaffinity(pid, sizeof(plan->cpus), &plan->cpus) < 0)
+    {
+        return "sched_setaffinity()";
+    }
+    if (nice_request != NICE_DEFAULT && setpriority(PRIO_PROCESS, pid, nice_request) < 0)
+    {
+        return "setpriority()";
+    }
+    if (ioprio_request != IOPRIO_NONE && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, pid, ioprio_request) < 0)
+    {
+        return "ioprio_set()";
+    }
+    return NULL;
+}
+
+/* Parse a CPU list such as 0-3,8,10-11 into cpus. 
+   Returns -1 if it is malformed or names no CPU. */
+
+int parse_cpu_list(char *list, cpu_set_t *cpus)
+{
+    char *end = list;
+    long first, last;
+
+    CPU_ZERO(cpus);
+    while (*end != '\0' && *end != '\n')
+    {
+        first = strtol(list, &end, 10);
+        last = first;
+        if (end == list || first < 0)
+        {
+            return -1;
+        }
+        if (*end == '-')
+        {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if (end == list || last < first)
+            {
+                return -1;
+            }
+        }
+        if (last >= CPU_SETSIZE || (*end != ',' && *end != '\0' && *end != '\n'))
+        {
+            return -1;
+        }
+        for (long cpu = first; cpu <= last; cpu++)
+        {
+            CPU_SET(cpu, cpus);
+        }
+        list = end + (*end == ',');
+    }
+    return (CPU_COUNT(cpus) > 0) ? 0 : -1;
+}
+
+/* Read a CPU list from a sysfs file such as a NUMA 
+   node's cpulist. Returns -1 if it cannot be read. */
+
+int read_cpu_list(char *path, cpu_set_t *cpus)
+{
+    char list[4096];
+    ssize_t len;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+    {
+        return -1;
+    }
+    len = read(fd, list, sizeof(list) - 1);
+    close(fd);
+    if (len <= 0)
+    {
+        return -1;
+    }
+    list[len] = '\0';
+    return parse_cpu_list(list, cpus);
+}
+
+/* Read one of cpu's topology ids (core_id or 
+   physical_package_id) from sysfs, or -1. */
+
+int read_topology(int cpu, char *name)
+{
+    char path[MAX_PATH], value[32];
+    ssize_t len;
+    int fd;
+
+    snprintf(path, sizeof(path), CPU_SYSFS, cpu, name);
+    if ((fd = open(path, O_RDONLY)) < 0)
+    {
+        return -1;
+    }
+    len = read(fd, value, sizeof(value) - 1);
+    close(fd);
+    if (len <= 0)
+    {
+        return -1;
+    }
+    value[len] = '\0';
+    return atoi(value);
+}
+
+/* qsort comparator putting CPUs of one package, then of 
+   one core (its SMT siblings), next to each other. */
+
+int cpu_place_order(const void *a, const void *b)
+{
+    const struct cpu_place *x = a, *y = b;
+
+    if (x->package != y->package)
+    {
+        return (x->package < y->package) ? -1 : 1;
+    }
+    if (x->core != y->core)
+    {
+        return (x->core < y->core) ? -1 : 1;
+    }
+    return (x->cpu > y->cpu) - (x->cpu < y->cpu);
+}
+
+/* Print a list of CPU numbers, joining runs of 
+   consecutive ones into ranges. */
+
+void print_cpu_list(int *cpus, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        int j = i;
+
+        while (j + 1 < count && cpus[j + 1] == cpus[j] + 1)
+        {
+            j++;
+        }
+        printf((i == 0) ? "%d" : ",%d", cpus[i]);
+        if (j > i)
+        {
+            printf("-%d", cpus[j]);
+            i = j;
+        }
+    }
+}
+
+/* Hash a string for the command hash (djb2). */
+
+unsigned int hash_string(char *str)
+{
+    unsigned int hash = 5381;
+
+    while (*str != '\0')
+    {
+        hash = hash * 33 + (unsigned char) *str++;
+    }
+    return hash;
+}
+
+/* Look up the absolute path of a program. On a miss, 
+   PATH is searched once and the result is cached. The
+   whole table is dropped by var_set whenever PATH is 
+   assigned. Names containing a slash are 
+   never hashed. Returns NULL if the program is not 
+   found, leaving the search (and its error) to exec. */
+
+char *hash_lookup(char *name)
+{
+    char *path_env = var_get("PATH");
+    struct hash_entry *entry;
+    unsigned int bucket;
+    char *path;
+
+    if (strchr(name, '/') != NULL || path_env == NULL)
+    {
+        return NULL;
+    }
+
+    if ((entry = hash_find(name)) != NULL)
+    {
+        entry->hits++;
+        return entry->path;
+    }
+
+    /* Once completion has indexed PATH, resolve through the index. */
+    path = (command_dirs != NULL) ? command_index_lookup(name) : hash_search_path(name, path_env);
+    if (path == NULL)
+    {
+        return NULL;
+    }
+    if ((entry = malloc(sizeof(struct hash_entry))) == NULL || (entry->name = strdup(name)) == NULL)
+    {
+        free(entry);
+        free(path);
+        return NULL;
+    }
+    entry->path = path;
+    entry->hits = 1;
+    bucket = hash_string(name) % HASH_BUCKETS;
+    entry->next = command_hash[bucket];
+    command_hash[bucket] = entry;
+    return path;
+}
+
+/* Find the command hash entry for name, or NULL. */
+
+struct hash_entry *hash_find(char *name)
+{
+    struct hash_entry *entry = command_hash[hash_string(name) % HASH_BUCKETS];
+
+    while (entry != NULL && strcmp(entry->name, name) != 0)
+    {
+        entry = entry->next;
+    }
+    return entry;
+}
+
+/* Search each directory of path_env for an executable 
+   regular file called name, as execvp would. Returns 
+   a malloc'd absolute path, or NULL if none is found. */
+
+char *hash_search_path(char *name, char *path_env)
+{
+    char candidate[MAX_PATH + 1];
+    char *dir = path_env;
+    struct stat st;
+
+    while (dir != NULL)
+    {
+        char *end = strchr(dir, ':');
+        int dir_len = (end == NULL) ? (int) strlen(dir) : (int) (end - dir);
+
+        /* An empty PATH entry means the current directory. */
+        if (dir_len == 0)
+        {
+            snprintf(candidate, sizeof(candidate), "./%s", name);
+        }
+        else
+        {
+            snprintf(candidate, sizeof(candidate), "%.*s/%s", dir_len, dir, name);
+        }
+        if (access(candidate, X_OK) == 0 && stat(candidate, &st) == 0 && S_ISREG(st.st_mode))
+        {
+            return strdup(candidate);
+        }
+        dir = (end == NULL) ? NULL : end + 1;
+    }
+    return NULL;
+}
+
+/* Remove a single program from the command hash. */
+
+void hash_forget(char *name)
+{
+    struct hash_entry **link = &command_hash[hash_string(name) % HASH_BUCKETS];
+
+    while (*link != NULL)
+    {
+        struct hash_entry *entry = *link;
+
+        if (strcmp(entry->name, name) == 0)
+        {
+            *link = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            return;
+        }
+        link = &entry->next;
+    }
+}
+
+/* Empty the command hash. */
+
+void hash_clear()
+{
+    for (int i = 0; i < HASH_BUCKETS; i++)
+    {
+        while (command_hash[i] != NULL)
+        {
+            struct hash_entry *entry = command_hash[i];
+
+            command_hash[i] = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+        }
+    }
+    for (size_t i = 0; i < num_command_dirs; i++)
+    {
+        command_dir_free(&command_dirs[i]);
+    }
+    free(command_dirs);
+    command_dirs = NULL;
+    num_command_dirs = 0;
+}
+
+/* Build the executable index of PATH on first use and
+   re-read any directory whose mtime has changed since.
+   Names that appeared or vanished in a re-read 
+   directory are forgotten by the command hash, so a 
+   new program earlier in PATH takes over and a 
+   removed one is searched for again. Returns 0, or -1
+   if PATH is unset. */
+
+int command_index_refresh()
+{
+    char *path_env = var_get("PATH");
+    struct stat st;
+
+    if (path_env == NULL)
+    {
+        return -1;
+    }
+    if (command_dirs == NULL)
+    {
+        char *dir = path_env;
+
+        num_command_dirs = 1;
+        for (char *p = path_env; *p != '\0'; p++)
+        {
+            num_command_dirs += (*p == ':');
+        }
+        if ((command_dirs = calloc(num_command_dirs, sizeof(struct command_dir))) == NULL)
+        {
+            num_command_dirs = 0;
+            return -1;
+        }
+        for (size_t i = 0; i < num_command_dirs; i++)
+        {
+            char *end = strchr(dir, ':');
+            size_t len = (end == NULL) ? strlen(dir) : (size_t) (end - dir);
+
+            if ((command_dirs[i].path = strndup(dir, len)) == NULL)
+            {
+                perror_exit("strndup()");
+            }
+            dir = (end == NULL) ? dir + len : end + 1;
+        }
+    }
+
+    for (size_t i = 0; i < num_command_dirs; i++)
+    {
+        struct command_dir *dir = &command_dirs[i];
+
+        if (dir->path[0] == '\0' || stat(dir->path, &st) < 0)
+        {
+            continue;
+        }
+        if (!dir->scanned || st.st_mtim.tv_sec != dir->mtime.tv_sec || st.st_mtim.tv_nsec != dir->mtime.tv_nsec)
+        {
+            struct command_dir old = *dir;
+            size_t j = 0, k = 0;
+
+            dir->names = NULL;
+            dir->blob = NULL;
+            dir->count = 0;
+            dir->mtime = st.st_mtim;
+            dir->scanned = (command_dir_scan(dir) == 0);
+
+            /* Forget names that differ between the two listings. */
+            while (old.scanned && (j < old.count || k < dir->count))
+            {
+                int order = (j == old.count) ? 1 : (k == dir->count) ? -1 : strcmp(old.names[j], dir->names[k]);
+
+                if (order != 0)
+                {
+                    hash_forget(order < 0 ? old.names[j] : dir->names[k]);
+                }
+                j += (order <= 0);
+                k += (order >= 0);
+            }
+            old.path = NULL;
+            command_dir_free(&old);
+        }
+    }
+    return 0;
+}
+
+/* Read the names in dir, other than subdirectories, 
+   into one block and sort them. Whether each is 
+   executable is checked only when it is used, so a 
+   directory costs one readdir pass and no stat calls.
+   Returns 0, or -1 if it cannot be read. */
+
+int command_dir_scan(struct command_dir *dir)
+{
+    size_t blob_len = 0, blob_cap = INIT_DIR_NAMES * 16;
+    size_t cap = INIT_DIR_NAMES;
+    size_t *offsets;
+    struct dirent *ent;
+    DIR *stream;
+
+    if ((stream = opendir(dir->path)) == NULL)
+    {
+        return -1;
+    }
+    if ((offsets = malloc(cap * sizeof(size_t))) == NULL || (dir->blob = malloc(blob_cap)) == NULL)
+    {
+        perror_exit("malloc()");
+    }
+    while ((ent = readdir(stream)) != NULL)
+    {
+        size_t len = strlen(ent->d_name) + 1;
+
+        if (ent->d_type == DT_DIR || ent->d_name[0] == '.')
+        {
+            continue;
+        }
+        if (dir->count == cap)
+        {
+            cap *= 2;
+            if ((offsets = realloc(offsets, cap * sizeof(size_t))) == NULL)
+            {
+                perror_exit("realloc()");
+            }
+        }
+        buffer_reserve(&dir->blob, &blob_cap, blob_len + len);
+        memcpy(dir->blob + blob_len, ent->d_name, len);
+        offsets[dir->count++] = blob_len;
+        blob_len += len;
+    }
+    closedir(stream);
+
+    if ((dir->names = malloc((dir->count + 1) * sizeof(char *))) == NULL)
+    {
+        perror_exit("malloc()");
+    }
+    for (size_t i = 0; i < dir->count; i++)
+    {
+        dir->names[i] = dir->blob + offsets[i];
+    }
+    free(offsets);
+    qsort(dir->names, dir->count, sizeof(char *), name_order);
+    return 0;
+}
+
+/* Free the listing of an indexed directory, and its
+   path if it has one. */
+
+void command_dir_free(struct command_dir *dir)
+{
+    free(dir->names);
+    free(dir->blob);
+    free(dir->path);
+    dir->names = NULL;
+    dir->blob = NULL;
+    dir->path = NULL;
+    dir->count = 0;
+}
+
+/* qsort order of two name pointers. */
+
+int name_order(const void *a, const void *b)
+{
+    return strcmp(*(char **) a, *(char **) b);
+}
+
+/* Resolve name through the executable index: the 
+   first PATH directory listing it, by binary search,
+   whose file is an executable regular file. The 
+   current directory, never indexed, is checked 
+   directly. Returns a malloc'd path, or NULL. */
+
+char *command_index_lookup(char *name)
+{
+    char candidate[MAX_PATH + 1];
+    struct stat st;
+
+    if (command_index_refresh() < 0)
+    {
+        return NULL;
+    }
+    for (size_t i = 0; i < num_command_dirs; i++)
+    {
+        struct command_dir *dir = &command_dirs[i];
+
+        if (dir->path[0] != '\0' 
+            && (!dir->scanned || bsearch(&name, dir->names, dir->count, sizeof(char *), name_order) == NULL))
+        {
+            continue;
+        }
+        snprintf(candidate, sizeof(candidate), "%s/%s", (dir->path[0] == '\0') ? "." : dir->path, name);
+        if (access(candidate, X_OK) == 0 && stat(candidate, &st) == 0 && S_ISREG(st.st_mode))
+        {
+            return strdup(candidate);
+        }
+    }
+    return NULL;
+}
+
+/* The hash builtin. With no arguments, print every 
+   hashed program with its hit count; -r empties the
+   table; any other arguments are looked up and 
+   added to the table without being executed. */
+
+int builtin_hash(char *argv[])
+{
+    int status = EXIT_SUCCESS;
+    int empty = 1;
+
+    if (argv[1] == NULL)
+    {
+        for (int i = 0; i < HASH_BUCKETS; i++)
+        {
+            for (struct hash_entry *entry = command_hash[i]; entry != NULL; entry = entry->next)
+            {
+                if (empty)
+                {
+                    printf("hits\tcommand\n");
+                    empty = 0;
+                }
+                printf("%4d\t%s\n", entry->hits, entry->path);
+            }
+        }
+        if (empty)
+        {
+            printf("hash: hash table empty\n");
+        }
+        return EXIT_SUCCESS;
+    }
+
+    for (int i = 1; argv[i] != NULL; i++)
+    {
+        if (strcmp(argv[i], "-r") == 0)
+        {
+            hash_clear();
+        }
+        else if (hash_lookup(argv[i]) == NULL)
+        {
+            printf("hash: %s: not found\n", argv[i]);
+            status = EXIT_FAILURE;
+        }
+        else
+        {
+            /* Looking a name up is not a use of it. */
+            hash_find(argv[i])->hits--;
+        }
+    }
+    return status;
+}
+
+/* Load the variable store from the environment the 
+   shell was started with, every variable exported. */
+
+void init_vars()
+{
+    for (char **env = environ; *env != NULL; env++)
+    {
+        char *equals = strchr(*env, '=');
+
+        if (equals != NULL && equals > *env)
+        {
+            var_set(*env, equals - *env, equals + 1, 1);
+        }
+    }
+    env_update();
+    shell_pid = getpid();
+}
+
+/* Length of the variable name at the start of str: a
+   letter or _, then letters, digits and _. 0 if str 
+   does not start with a name. */
+
+int name_length(char *str)
+{
+    int len = 0;
+
+    if (!isalpha((unsigned char) str[0]) && str[0] != '_')
+    {
+        return 0;
+    }
+    while (isalnum((unsigned char) str[len]) || str[len] == '_')
+    {
+        len++;
+    }
+    return len;
+}
+
+/* Find the variable called by the first name_len bytes 
+   of name, or NULL if it is not set. */
+
+struct var *var_find(char *name, size_t name_len)
+{
+    for (struct var *var = var_table[hash_bytes(name, name_len) % VAR_BUCKETS]; var != NULL; var = var->next)
+    {
+        if (var->name_len == name_len && memcmp(var->entry, name, name_len) == 0)
+        {
+            return var;
+        }
+    }
+    return NULL;
+}
+
+/* Value of variable name, or NULL if it is not set. */
+
+char *var_get(char *name)
+{
+    struct var *var = var_find(name, strlen(name));
+
+    return (var == NULL) ? NULL : var->value;
+}
+
+/* Set the variable called by the first name_len bytes
+   of name to value, exporting it if export is set (an
+   exported variable stays exported). The environment 
+   is rebuilt only when an exported variable changes, 
+   and assigning PATH empties the command hash. Returns
+   0, or -1 after printing an error. */
+
+int var_set(char *name, size_t name_len, char *value, int export)
+{
+    struct var *var = var_find(name, name_len);
+    size_t value_len = strlen(value);
+    char *entry, *old_entry;
+
+    if ((entry = malloc(name_len + value_len + 2)) == NULL)
+    {
+        perror("malloc()");
+        return -1;
+    }
+    memcpy(entry, name, name_len);
+    entry[name_len] = '=';
+    memcpy(entry + name_len + 1, value, value_len + 1);
+
+    if (var == NULL)
+    {
+        unsigned int bucket = hash_bytes(name, name_len) % VAR_BUCKETS;
+
+        if ((var = malloc(sizeof(struct var))) == NULL)
+        {
+            perror("malloc()");
+            free(entry);
+            return -1;
+        }
+        var->entry = NULL;
+        var->name_len = name_len;
+        var->exported = 0;
+        var->next = var_table[bucket];
+        var_table[bucket] = var;
+    }
+    if (export && !var->exported)
+    {
+        var->exported = 1;
+        num_exported++;
+    }
+
+    /* The old entry is freed only once environ no longer holds it. */
+    old_entry = var->entry;
+    var->entry = entry;
+    var->value = entry + name_len + 1;
+    if (var->exported && env_cache != NULL)
+    {
+        env_update();
+    }
+    free(old_entry);
+    if (name_len == 4 && memcmp(name, "PATH", 4) == 0)
+    {
+        hash_clear();
+    }
+    return 0;
+}
+
+/* Remove the variable called by the first name_len 
+   bytes of name, if set. */
+
+void var_unset(char *name, size_t name_len)
+{
+    struct var *var = var_find(name, name_len);
+    struct var **link;
+
+    if (var == NULL)
+    {
+        return;
+    }
+    for (link = &var_table[hash_bytes(name, name_len) % VAR_BUCKETS]; *link != var; link = &(*link)->next)
+    {
+        ;
+    }
+    *link = var->next;
+    if (var->exported)
+    {
+        num_exported--;
+        env_update();
+    }
+    if (name_len == 4 && memcmp(name, "PATH", 4) == 0)
+    {
+        hash_clear();
+    }
+    free(var->entry);
+    free(var);
+}
+
+/* Apply name=value assignments to the shell's 
+   variables, exporting them if export is set. Returns 
+   the status of the assignments. */
+
+int var_assign(struct argv_vec *assigns, int export)
+{
+    int status = EXIT_SUCCESS;
+
+    for (int i = 0; i < assigns->len; i++)
+    {
+        char *equals = strchr(assigns->items[i], '=');
+
+        if (var_set(assigns->items[i], equals - assigns->items[i], equals + 1, export) < 0)
+        {
+            status = EXIT_FAILURE;
+        }
+    }
+    return status;
+}
+
+/* Rebuild the cached environment from the exported 
+   variables and make it environ, so every spawn (and 
+   getenv) uses it as it is until an export changes. */
+
+void env_update()
+{
+    char **env;
+    int n = 0;
+
+    if ((env = malloc((num_exported + 1) * sizeof(char *))) == NULL)
+    {
+        perror_exit("malloc()");
+    }
+    for (int i = 0; i < VAR_BUCKETS; i++)
+    {
+        for (struct var *var = var_table[i]; var != NULL; var = var->next)
+        {
+            if (var->exported)
+            {
+                env[n++] = var->entry;
+            }
+        }
+    }
+    env[n] = NULL;
+    free(env_cache);
+    env_cache = environ = env;
+}
+
+/* The environment of a command run with assignments
+   (name=value words) before its name: the cached one
+   with those names replaced or added, allocated from 
+   the line arena. */
+
+char **env_with(struct argv_vec *assigns)
+{
+    char **env = arena_alloc(&line_arena, (num_exported + assigns->len + 1) * sizeof(char *));
+    int n = 0;
+
+    for (char **entry = env_cache; *entry != NULL; entry++)
+    {
+        int replaced = 0;
+
+        for (int i = 0; i < assigns->len && !replaced; i++)
+        {
+            size_t name_len = strchr(assigns->items[i], '=') - assigns->items[i] + 1;
+
+            replaced = (strncmp(*entry, assigns->items[i], name_len) == 0);
+        }
+        if (!replaced)
+        {
+            env[n++] = *entry;
+        }
+    }
+    for (int i = 0; i < assigns->len; i++)
+    {
+        env[n++] = assigns->items[i];
+    }
+    env[n] = NULL;
+    return env;
+}
+
+/* Value of $name in a word: $? is the last status, $$
+   the shell's pid, $# the number of positional 
+   parameters, $0 the script's name, $1... the 
+   parameters themselves, and $@ and $* all of them 
+   joined by spaces; an unset variable is empty. */
+
+char *var_value(char *name)
+{
+    char *value;
+
+    if (strcmp(name, "?") == 0 || strcmp(name, "$") == 0 || strcmp(name, "#") == 0)
+    {
+        value = arena_alloc(&line_arena, 12);
+        snprintf(value, 12, "%d", (name[0] == '?') ? last_status : (name[0] == '#') ? num_positional : (int) shell_pid);
+        return value;
+    }
+    if (isdigit((unsigned char) name[0]))
+    {
+        int n = atoi(name);
+
+        return (n == 0) ? shell_name : (n <= num_positional) ? positional[n - 1] : "";
+    }
+    if (strcmp(name, "@") == 0 || strcmp(name, "*") == 0)
+    {
+        size_t len = 0;
+
+        for (int i = 0; i < num_positional; i++)
+        {
+            len += strlen(positional[i]) + 1;
+        }
+        value = arena_alloc(&line_arena, len + 1);
+        value[0] = '\0';
+        for (int i = 0, at = 0; i < num_positional; i++)
+        {
+            at += sprintf(value + at, (i > 0) ? " %s" : "%s", positional[i]);
+        }
+        return value;
+    }
+    return ((value = var_get(name)) == NULL) ? "" : value;
+}
+
+/* Copy ch, quoted, into *words: a glob character is 
+   written after GLOB_ESCAPE so that it only matches 
+   itself. Returns whether it was escaped. */
+
+int copy_quoted(char ch, char **words)
+{
+    int escaped = (strchr(GLOB_CHARS, ch) != NULL);
+
+    if (escaped)
+    {
+        *(*words)++ = GLOB_ESCAPE;
+    }
+    *(*words)++ = ch;
+    return escaped;
+}
+
+/* Remove the glob marks from word, in place, where it
+   is not globbed after all. Returns the word, without
+   its leading GLOB_MARK if it had one. */
+
+char *glob_literal(char *word)
+{
+    char *out;
+
+    if (*word == GLOB_MARK)
+    {
+        word++;
+    }
+    out = word;
+    for (char *c = word; *c != '\0'; c++)
+    {
+        if (*c != GLOB_ESCAPE)
+        {
+            *out++ = *c;
+        }
+    }
+    *out = '\0';
+    return word;
+}
+
+/* Expand one field of a word with unquoted glob 
+   characters into the paths it matches, sorted and 
+   pushed straight to argv, or into the field itself, 
+   with its quoting removed, if it matches none. As in
+   bash, a name starting with . is only matched by a 
+   pattern starting with ., and ** matches any number
+   of directories, other than hidden ones. */
+
+void glob_word(struct argv_vec *argv, char *pattern)
+{
+    size_t len = strlen(pattern), path_len = 0;
+    char *copy = arena_alloc(&line_arena, len + 1);
+    int start = argv->len;
+    struct glob glob;
+
+    glob.argv = argv;
+    glob.comps = arena_alloc(&line_arena, (len / 2 + 2) * sizeof(char *));
+    glob.kinds = arena_alloc(&line_arena, (len / 2 + 2) * sizeof(int));
+    glob.num_comps = 0;
+    glob.dir_only = (len > 0 && pattern[len - 1] == '/');
+    glob.descended = 0;
+    if (pattern[0] == '/')
+    {
+        glob.path[path_len++] = '/';
+    }
+    glob.path[path_len] = '\0';
+
+    /* Split at slashes, turning each escape into the
+       backslash fnmatch expects; a component with no 
+       glob characters is unescaped and only looked up. */
+    memcpy(copy, pattern, len + 1);
+    for (char *c = copy; *c != '\0'; )
+    {
+        int kind = GLOB_LITERAL;
+        char *comp;
+
+        while (*c == '/')
+        {
+            c++;
+        }
+        if (*c == '\0')
+        {
+            break;
+        }
+        for (comp = c; *c != '\0' && *c != '/'; c++)
+        {
+            if (*c == GLOB_ESCAPE)
+            {
+                *c++ = '\\';
+            }
+            else if (*c == '*' || *c == '?' || *c == '[')
+            {
+                kind = GLOB_PATTERN;
+            }
+        }
+        if (*c == '/')
+        {
+            *c++ = '\0';
+        }
+        if (strcmp(comp, "**") == 0)
+        {
+            kind = GLOB_STAR;
+        }
+        else if (kind == GLOB_LITERAL)
+        {
+            char *out = comp;
+
+            for (char *in = comp; *in != '\0'; in++)
+            {
+                in += (*in == '\\');
+                *out++ = *in;
+            }
+            *out = '\0';
+        }
+        glob.comps[glob.num_comps] = comp;
+        glob.kinds[glob.num_comps++] = kind;
+    }
+
+    if (glob.num_comps > 0)
+    {
+        glob_walk(&glob, 0, path_len);
+    }
+    if (argv->len == start)
+    {
+        argv_push(argv, glob_literal(pattern));
+        return;
+    }
+    qsort(argv->items + start, argv->len - start, sizeof(char *), name_order);
+}
+
+/* Match the components from comp on in the directory
+   glob->path[0..len), which is empty or ends in a 
+   slash, pushing each complete match. The directories
+   to descend into are copied out of the listing first,
+   since reading them may evict it. */
+
+void glob_walk(struct glob *glob, int comp, size_t len)
+{
+    int kind = glob->kinds[comp];
+    int last = (comp == glob->num_comps - 1);
+    int descended = glob->descended;
+    char *pattern = glob->comps[comp];
+    struct dir_listing *listing;
+    size_t num_subdirs = 0;
+    char **subdirs;
+
+    glob->descended = 0;
+    if (kind == GLOB_LITERAL)
+    {
+        size_t name_len = strlen(pattern);
+        struct stat st;
+
+        if (len + name_len + 2 > MAX_PATH)
+        {
+            return;
+        }
+        memcpy(glob->path + len, pattern, name_len + 1);
+        if (last)
+        {
+            if (lstat(glob->path, &st) == 0)
+            {
+                glob_match(glob, len, pattern, DT_UNKNOWN);
+            }
+            return;
+        }
+        glob->path[len + name_len] = '/';
+        glob->path[len + name_len + 1] = '\0';
+        glob_walk(glob, comp + 1, len + name_len + 1);
+        return;
+    }
+
+    /* ** first matches no directories at all, which as
+       the last component matches the directory itself. */
+    if (kind == GLOB_STAR && !last)
+    {
+        glob_walk(glob, comp + 1, len);
+    }
+    else if (kind == GLOB_STAR && !descended && len > 0 && (len > 1 || glob->path[0] != '/'))
+    {
+        glob_match(glob, len, "", DT_DIR);
+    }
+    glob->path[len] = '\0';
+    if ((listing = glob_listing(len == 0 ? "." : glob->path)) == NULL)
+    {
+        return;
+    }
+    subdirs = arena_alloc(&line_arena, (listing->count + 1) * sizeof(char *));
+    for (size_t i = 0; i < listing->count; i++)
+    {
+        char *name = listing->names[i];
+        int type = (unsigned char) name[-1];
+
+        if ((kind == GLOB_STAR) ? (name[0] == '.') : (fnmatch(pattern, name, FNM_PERIOD) != 0))
+        {
+            continue;
+        }
+        if (last)
+        {
+            glob_match(glob, len, name, type);
+        }
+        if ((kind == GLOB_STAR) ? (type == DT_DIR) : !last)
+        {
+            size_t name_len = strlen(name) + 2;
+
+            subdirs[num_subdirs] = arena_alloc(&line_arena, name_len);
+            memcpy(subdirs[num_subdirs++], name - 1, name_len);
+        }
+    }
+
+    /* ** then descends into every directory, again as
+       **; anything else matched a directory name. */
+    for (size_t i = 0; i < num_subdirs; i++)
+    {
+        char *name = subdirs[i] + 1;
+        size_t name_len = strlen(name);
+
+        if (len + name_len + 2 > MAX_PATH)
+        {
+            continue;
+        }
+        memcpy(glob->path + len, name, name_len + 1);
+        if (kind != GLOB_STAR && !glob_is_dir(glob->path, (unsigned char) subdirs[i][0]))
+        {
+            continue;
+        }
+        glob->path[len + name_len] = '/';
+        glob->path[len + name_len + 1] = '\0';
+        glob->descended = (kind == GLOB_STAR);
+        glob_walk(glob, (kind == GLOB_STAR) ? comp : comp + 1, len + name_len + 1);
+    }
+}
+
+/* Push the path glob->path[0..len) followed by name, 
+   of d_type type, as a match: with a trailing slash, 
+   and only if it is a directory, when the pattern 
+   ended in one. */
+
+void glob_match(struct glob *glob, size_t len, char *name, int type)
+{
+    size_t name_len = strlen(name);
+    char *match;
+
+    if (len + name_len + 2 > MAX_PATH)
+    {
+        return;
+    }
+    memcpy(glob->path + len, name, name_len + 1);
+    if (glob->dir_only && !glob_is_dir(glob->path, type))
+    {
+        return;
+    }
+    len += name_len;
+    match = arena_alloc(&line_arena, len + 2);
+    memcpy(match, glob->path, len);
+    if (glob->dir_only && match[len - 1] != '/')
+    {
+        match[len++] = '/';
+    }
+    match[len] = '\0';
+    argv_push(glob->argv, match);
+}
+
+/* Whether path, a listing entry of d_type type, is a 
+   directory or a symbolic link to one. */
+
+int glob_is_dir(char *path, int type)
+{
+    struct stat st;
+
+    if (type == DT_DIR)
+    {
+        return 1;
+    }
+    return type != DT_REG && stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+/* The sorted listing of dir, other than . and ..: the 
+   cached one if dir still has the device, inode and 
+   mtime it was read with, so a script globbing one 
+   directory again and again reads it once, or else a
+   new readdir pass into the least recently used slot.
+   A listing read within GLOB_CACHE_SLACK seconds of 
+   the directory's last change is not reused, since a
+   second change in the same clock tick would leave the
+   mtime as it was. The listing is only valid until the
+   next call. Returns NULL if dir cannot be read. */
+
+struct dir_listing *glob_listing(char *dir)
+{
+    struct dir_listing *listing = &glob_cache[0];
+    size_t blob_len = 0, blob_cap = INIT_DIR_NAMES * 16;
+    size_t cap = INIT_DIR_NAMES;
+    struct timespec now;
+    struct dirent *ent;
+    size_t *offsets;
+    struct stat st;
+    DIR *stream;
+
+    if (stat(dir, &st) < 0)
+    {
+        return NULL;
+    }
+    for (int i = 0; i < GLOB_CACHE_SIZE; i++)
+    {
+        struct dir_listing *slot = &glob_cache[i];
+
+        if (slot->cached && slot->ino == st.st_ino && slot->dev == st.st_dev
+            && slot->mtime.tv_sec == st.st_mtim.tv_sec && slot->mtime.tv_nsec == st.st_mtim.tv_nsec)
+        {
+            slot->used = ++glob_clock;
+            return slot;
+        }
+        if (slot->used < listing->used)
+        {
+            listing = slot;
+        }
+    }
+    if ((stream = opendir(dir)) == NULL)
+    {
+        return NULL;
+    }
+
+    free(listing->names);
+    free(listing->blob);
+    listing->count = 0;
+    if ((offsets = malloc(cap * sizeof(size_t))) == NULL || (listing->blob = malloc(blob_cap)) == NULL)
+    {
+        perror_exit("malloc()");
+    }
+    while ((ent = readdir(stream)) != NULL)
+    {
+        size_t len = strlen(ent->d_name) + 1;
+        unsigned char type = ent->d_type;
+        struct stat ent_st;
+
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+        {
+            continue;
+        }
+        if (type == DT_UNKNOWN && fstatat(dirfd(stream), ent->d_name, &ent_st, AT_SYMLINK_NOFOLLOW) == 0)
+        {
+            type = S_ISDIR(ent_st.st_mode) ? DT_DIR : S_ISLNK(ent_st.st_mode) ? DT_LNK : S_ISREG(ent_st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if (listing->count == cap)
+        {
+            cap *= 2;
+            if ((offsets = realloc(offsets, cap * sizeof(size_t))) == NULL)
+            {
+                perror_exit("realloc()");
+            }
+        }
+        buffer_reserve(&listing->blob, &blob_cap, blob_len + len + 1);
+        listing->blob[blob_len] = type;
+        memcpy(listing->blob + blob_len + 1, ent->d_name, len);
+        offsets[listing->count++] = blob_len + 1;
+        blob_len += len + 1;
+    }
+    closedir(stream);
+
+    if ((listing->names = malloc((listing->count + 1) * sizeof(char *))) == NULL)
+    {
+        perror_exit("malloc()");
+    }
+    for (size_t i = 0; i < listing->count; i++)
+    {
+        listing->names[i] = listing->blob + offsets[i];
+    }
+    free(offsets);
+    qsort(listing->names, listing->count, sizeof(char *), name_order);
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    listing->dev = st.st_dev;
+    listing->ino = st.st_ino;
+    listing->mtime = st.st_mtim;
+    listing->cached = (now.tv_sec - st.st_mtim.tv_sec >= GLOB_CACHE_SLACK);
+    listing->used = ++glob_clock;
+    return listing;
+}
+
+/* Open the history file, $MYSH_HISTFILE or ~/.mysh_history 
+   (an empty MYSH_HISTFILE disables history), and its 
+   offset index, history-file.idx. Both are mapped rather
+   than read, so startup costs the same for ten entries
+   or a million: only entries appended since the index 
+   was last written, by an older shell or by hand, are 
+   scanned for line breaks. */
+
+void init_history()
+{
+    char *path = getenv(HISTFILE_ENV);
+    char *index_path;
+
+    if (path == NULL)
+    {
+        if (prompt.home == NULL)
+        {
+            return;
+        }
+        if (asprintf(&path, "%s/%s", prompt.home, HISTFILE_NAME) < 0)
+        {
+            return;
+        }
+    }
+    else if (path[0] == '\0' || (path = strdup(path)) == NULL)
+    {
+        return;
+    }
+    if (asprintf(&index_path, "%s%s", path, HISTINDEX_SUFFIX) < 0)
+    {
+        free(path);
+        return;
+    }
+
+    if ((history.fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600)) < 0
+        || (history.index_fd = open(index_path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600)) < 0)
+    {
+        perror(history.fd < 0 ? path : index_path);
+        if (history.fd >= 0)
+        {
+            close(history.fd);
+            history.fd = -1;
+        }
+    }
+    else
+    {
+        flock(history.fd, LOCK_EX);
+        if (history_sync() < 0)
+        {
+            fprintf(stderr, "%s: history disabled.\n", path);
+            close(history.fd);
+            close(history.index_fd);
+            history.fd = history.index_fd = -1;
+        }
+        else
+        {
+            flock(history.fd, LOCK_UN);
+        }
+    }
+    free(index_path);
+    free(path);
+}
+
+/* Bring the mappings up to date with the files, which
+   other shells may have appended to. The index is 
+   trusted if its last offset starts a line; otherwise 
+   it is rebuilt. Must be called with the history file
+   locked. Returns 0, or -1 on failure. */
+
+int history_sync()
+{
+    struct stat text_stat, index_stat;
+    size_t count;
+    size_t last;
+
+    if (fstat(history.fd, &text_stat) < 0 || fstat(history.index_fd, &index_stat) < 0
+        || text_stat.st_size > UINT32_MAX)
+    {
+        return -1;
+    }
+    if ((history.text = history_remap(history.text, history.text_size, history.fd, text_stat.st_size)) == MAP_FAILED)
+    {
+        history.text = NULL;
+        history.text_size = 0;
+        return -1;
+    }
+    history.text_size = text_stat.st_size;
+    count = index_stat.st_size / sizeof(uint32_t);
+    if ((history.index = history_remap(history.index, history.count * sizeof(uint32_t), 
+                                       history.index_fd, count * sizeof(uint32_t))) == MAP_FAILED)
+    {
+        history.index = NULL;
+        history.count = 0;
+        return -1;
+    }
+    history.count = count;
+
+    /* Find the end of the last indexed entry. */
+    history.end = 0;
+    if (count > 0)
+    {
+        char *newline = NULL;
+
+        last = history.index[count - 1];
+        if (last < history.text_size && (last == 0 || history.text[last - 1] == '\n'))
+        {
+            newline = memchr(history.text + last, '\n', history.text_size - last);
+        }
+        if (newline == NULL)
+        {
+            /* Stale or torn index: start it again. */
+            if (ftruncate(history.index_fd, 0) < 0)
+            {
+                return -1;
+            }
+            munmap(history.index, count * sizeof(uint32_t));
+            history.index = NULL;
+            history.count = 0;
+            history_build_free();
+        }
+        else
+        {
+            history.end = newline + 1 - history.text;
+        }
+    }
+    return history_index_tail();
+}
+
+/* Map size bytes of fd, moving an existing mapping of
+   old_size bytes at addr if there is one. Returns the
+   new address, NULL for an empty file, or MAP_FAILED. */
+
+void *history_remap(void *addr, size_t old_size, int fd, size_t size)
+{
+    if (size == old_size)
+    {
+        return addr;
+    }
+    if (size == 0)
+    {
+        munmap(addr, old_size);
+        return NULL;
+    }
+    if (addr == NULL)
+    {
+        return mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    return mremap(addr, old_size, size, MREMAP_MAYMOVE);
+}
+
+/* Index every complete line after history.end and 
+   append the offsets to the index file in batches. 
+   Returns 0, or -1 on failure. */
+
+int history_index_tail()
+{
+    uint32_t batch[HISTINDEX_BATCH];
+    size_t added = 0;
+    size_t num = 0;
+    char *newline;
+
+    while (history.end < history.text_size 
+           && (newline = memchr(history.text + history.end, '\n', history.text_size - history.end)) != NULL)
+    {
+        batch[num++] = history.end;
+        history.end = newline + 1 - history.text;
+        if (num == HISTINDEX_BATCH || history.end == history.text_size)
+        {
+            if (write(history.index_fd, batch, num * sizeof(uint32_t)) < 0)
+            {
+                return -1;
+            }
+            added += num;
+            num = 0;
+        }
+    }
+    if (num > 0 && write(history.index_fd, batch, num * sizeof(uint32_t)) < 0)
+    {
+        return -1;
+    }
+    added += num;
+    if (added > 0)
+    {
+        history.index = history_remap(history.index, history.count * sizeof(uint32_t), history.index_fd,
+                                      (history.count + added) * sizeof(uint32_t));
+        if (history.index == MAP_FAILED)
+        {
+            history.index = NULL;
+            history.count = 0;
+            return -1;
+        }
+        history.count += added;
+    }
+    return 0;
+}
+
+/* Entry n, counting from 1, without its newline. The
+   text is not NUL-terminated; its length is stored in
+   len. Returns NULL, with len 0, if there is no such
+   entry. */
+
+char *history_entry(size_t n, size_t *len)
+{
+    size_t start, end;
+
+    if (n == 0 || n > history.count)
+    {
+        *len = 0;
+        return NULL;
+    }
+    start = history.index[n - 1];
+    end = (n < history.count) ? history.index[n] : history.end;
+    *len = end - start - 1;
+    return history.text + start;
+}
+
+/* Append line to the history file and its offset to
+   the index, with the file locked so that shells 
+   sharing a history never interleave entries. Blank
+   lines are not recorded. */
+
+void history_add(char *line)
+{
+    struct iovec iov[3];
+    uint32_t offset;
+    int num = 0;
+
+    if (history.fd < 0 || line[strspn(line, " \t")] == '\0')
+    {
+        return;
+    }
+    flock(history.fd, LOCK_EX);
+    if (history_sync() < 0)
+    {
+        flock(history.fd, LOCK_UN);
+        return;
+    }
+    offset = history.text_size;
+    if (history.end < history.text_size)
+    {
+        /* Terminate a partial line left by someone else. */
+        iov[num].iov_base = "\n";
+        iov[num++].iov_len = 1;
+        offset++;
+    }
+    iov[num].iov_base = line;
+    iov[num++].iov_len = strlen(line);
+    iov[num].iov_base = "\n";
+    iov[num++].iov_len = 1;
+    if (writev(history.fd, iov, num) < 0 || write(history.index_fd, &offset, sizeof(offset)) < 0)
+    {
+        perror("history");
+    }
+    history_sync();
+    flock(history.fd, LOCK_UN);
+}
+
+/* Expand history references in line: !! is the last 
+   entry, !n entry n, !-n the nth entry back and 
+   !prefix the latest entry starting with prefix. A ! 
+   in single quotes, after a backslash, or followed by
+   a blank, = or ( is left alone. The expanded line is
+   echoed and returned in the line arena; NULL is 
+   returned if an event could not be found. */
+
+char *history_expand(char *line)
+{
+    FILE *out;
+    char *buf = NULL, *expanded;
+    size_t buf_len = 0, len, n, entry_len;
+    int quoted = 0, failed = 0;
+    char *entry;
+    char *p;
+
+    if (strchr(line, HISTORY_CHAR) == NULL || (out = open_memstream(&buf, &buf_len)) == NULL)
+    {
+        return line;
+    }
+    for (p = line; *p != '\0'; p++)
+    {
+        if (*p == '\'')
+        {
+            quoted = !quoted;
+        }
+        else if (*p == '\\' && !quoted && p[1] != '\0')
+        {
+            fputc(*p++, out);
+        }
+        else if (*p == HISTORY_CHAR && !quoted && p[1] != '\0' && strchr(" \t=(", p[1]) == NULL)
+        {
+            if ((len = history_event(p + 1, &n)) == 0 || (entry = history_entry(n, &entry_len)) == NULL)
+            {
+                len = (len == 0) ? strcspn(p + 1, " \t") : len;
+                fprintf(stderr, "%.*s: event not found\n", (int) len + 1, p);
+                failed = 1;
+                break;
+            }
+            fwrite(entry, 1, entry_len, out);
+            p += len;
+            continue;
+        }
+        fputc(*p, out);
+    }
+    fclose(out);
+
+    if (failed)
+    {
+        free(buf);
+        return NULL;
+    }
+    len = strlen(buf);
+    expanded = arena_alloc(&line_arena, len + 1);
+    memcpy(expanded, buf, len + 1);
+    free(buf);
+    printf("%s\n", expanded);
+    return expanded;
+}
+
+/* Resolve the event designator after a ! to entry 
+   number n through the index. Returns the length of
+   the designator, or 0 if it matches no entry. */
+
+int history_event(char *event, size_t *n)
+{
+    size_t len, entry_len;
+    char *end, *entry;
+    long num;
+
+    if (event[0] == HISTORY_CHAR)
+    {
+        *n = history.count;
+        return 1;
+    }
+    if (isdigit((unsigned char) event[0]) || (event[0] == '-' && isdigit((unsigned char) event[1])))
+    {
+        num = strtol(event, &end, 10);
+        if (num < 0)
+        {
+            num += history.count + 1;
+        }
+        if (num <= 0 || (size_t) num > history.count)
+        {
+            return 0;
+        }
+        *n = num;
+        return end - event;
+    }
+
+    /* Prefix search, newest first. */
+    if ((len = strcspn(event, WORD_BREAKS "'\"")) == 0)
+    {
+        return 0;
+    }
+    for (size_t i = history.count; i > 0; i--)
+    {
+        entry = history_entry(i, &entry_len);
+        if (entry_len >= len && memcmp(entry, event, len) == 0)
+        {
+            *n = i;
+            return len;
+        }
+    }
+    return 0;
+}
+
+/* Start building the index used by reverse search:
+   a suffix array of every suffix of every distinct
+   entry among the current ones, in sorted segments.
+   Only the newest copy of a repeated entry is included
+   and marked in history.newest, so a search never
+   stops twice on the same text. history_build_step
+   does the work a slice at a time, while the editor
+   waits for keys; until it is done, entries it has not
+   covered (and any added later) are searched directly.
+   Without memory, nothing is built and every search
+   is direct. */
+
+void history_build_start()
+{
+    history_build_free();
+    history.seen_size = 1;
+    while (history.seen_size < history.count * 2)
+    {
+        history.seen_size <<= 1;
+    }
+    if ((history.newest = calloc(history.count + 1, 1)) == NULL
+        || (history.seen = calloc(history.seen_size, sizeof(uint32_t))) == NULL)
+    {
+        history_build_free();
+        return;
+    }
+    history.build_count = history.build_next = history.count;
+}
+
+/* Drop the search index and any build in progress. */
+
+void history_build_free()
+{
+    free(history.suffixes);
+    free(history.newest);
+    free(history.segments);
+    free(history.seen);
+    history.suffixes = NULL;
+    history.newest = NULL;
+    history.segments = NULL;
+    history.seen = NULL;
+    history.num_suffixes = history.suffix_entries = history.num_segments = 0;
+    history.build_count = history.build_next = history.build_suffixes = 0;
+}
+
+/* Do up to HISTORY_SLICE_MS of the index build: mark
+   the newest copy of each entry, newest first, then
+   add sorted segments of their suffixes, oldest first.
+   A build over more entries than the history now has
+   (whose file was started again) is dropped. Returns
+   whether work is left. */
+
+int history_build_step()
+{
+    struct timespec start, now;
+
+    if (history.build_count == 0 || history.build_count > history.count)
+    {
+        if (history.build_count != 0)
+        {
+            history_build_free();
+        }
+        return 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do
+    {
+        if (history.seen != NULL)
+        {
+            /* Mark the newest copy of each entry, counting suffixes. */
+            for (int batch = 0; batch < 256 && history.build_next > 0; batch++, history.build_next--)
+            {
+                size_t i = history.build_next, len, slot, mask = history.seen_size - 1;
+                char *entry = history_entry(i, &len);
+
+                for (slot = hash_bytes(entry, len) & mask; history.seen[slot] != 0; slot = (slot + 1) & mask)
+                {
+                    size_t other_len;
+                    char *other = history_entry(history.seen[slot], &other_len);
+
+                    if (other_len == len && memcmp(other, entry, len) == 0)
+                    {
+                        break;
+                    }
+                }
+                if (history.seen[slot] == 0)
+                {
+                    history.seen[slot] = i;
+                    history.newest[i - 1] = 1;
+                    history.build_suffixes += len;
+                }
+            }
+            if (history.build_next == 0)
+            {
+                free(history.seen);
+                history.seen = NULL;
+                history.suffixes = malloc((history.build_suffixes + 1) * sizeof(uint32_t));
+                history.segments = malloc((history.build_suffixes / HISTORY_SEGMENT + 2) * sizeof(size_t));
+                if (history.suffixes == NULL || history.segments == NULL)
+                {
+                    history_build_free();
+                    return 0;
+                }
+            }
+        }
+        else if (!history_segment_add())
+        {
+            return 0;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while (elapsed_ms(&start, &now) < HISTORY_SLICE_MS);
+    return 1;
+}
+
+/* Add the suffixes of the next entries, up to about
+   HISTORY_SEGMENT of them, to the index as one sorted
+   segment. Returns whether entries are left. */
+
+int history_segment_add()
+{
+    size_t first = history.num_suffixes, len;
+    char *entry;
+
+    while (history.suffix_entries < history.build_count && history.num_suffixes - first < HISTORY_SEGMENT)
+    {
+        if (history.newest[history.suffix_entries++])
+        {
+            entry = history_entry(history.suffix_entries, &len);
+            for (size_t j = 0; j < len; j++)
+            {
+                history.suffixes[history.num_suffixes++] = entry + j - history.text;
+            }
+        }
+    }
+    qsort(history.suffixes + first, history.num_suffixes - first, sizeof(uint32_t), suffix_order);
+    history.segments[history.num_segments++] = history.num_suffixes;
+    return history.suffix_entries < history.build_count;
+}
+
+/* qsort order of two suffixes, each ending at the 
+   newline that ends its entry. */
+
+int suffix_order(const void *a, const void *b)
+{
+    unsigned char *x = (unsigned char *) history.text + *(uint32_t *) a;
+    unsigned char *y = (unsigned char *) history.text + *(uint32_t *) b;
+
+    while (*x == *y && *x != '\n')
+    {
+        x++;
+        y++;
+    }
+    return *x - *y;
+}
+
+/* Compare the suffix at offset with the first len 
+   bytes of query: 0 if query is a prefix of it, and
+   otherwise its order relative to query. */
+
+int suffix_compare(uint32_t offset, char *query, size_t len)
+{
+    unsigned char *suffix = (unsigned char *) history.text + offset;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        if (suffix[i] == '\n' || suffix[i] != (unsigned char) query[i])
+        {
+            return (suffix[i] == '\n') ? -1 : suffix[i] - (unsigned char) query[i];
+        }
+    }
+    return 0;
+}
+
+/* Number of the entry containing offset, by binary 
+   search of the index. */
+
+size_t history_entry_at(uint32_t offset)
+{
+    size_t low = 0, high = history.count;
+
+    while (high - low > 1)
+    {
+        size_t mid = (low + high) / 2;
+
+        if (history.index[mid] <= offset)
+        {
+            low = mid;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return low + 1;
+}
+
+/* The range [first, last) of the sorted segment
+   history.suffixes[start, end) holding the suffixes
+   that start with the len bytes of query, by binary
+   search. */
+
+void suffix_range(size_t start, size_t end, char *query, size_t len, size_t *first, size_t *last)
+{
+    size_t low = start, high = end;
+
+    while (low < high)
+    {
+        size_t mid = (low + high) / 2;
+
+        if (suffix_compare(history.suffixes[mid], query, len) < 0)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    *first = low;
+    high = end;
+    while (low < high)
+    {
+        size_t mid = (low + high) / 2;
+
+        if (suffix_compare(history.suffixes[mid], query, len) <= 0)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    *last = low;
+}
+
+/* Find the newest entry before entry number before
+   that contains the len bytes of query, storing the
+   position of the match within it in pos. The first
+   search starts the index build, and each one moves
+   it on by a slice. Entries the index does not cover
+   yet are checked directly; older ones by binary
+   search of each segment for the suffixes starting
+   with query. A wide range means short, common text,
+   so then a walk back over the newest entries is
+   cheaper than visiting every suffix in it. Returns
+   the entry number, or 0 if there is none. */
+
+size_t history_search(char *query, size_t len, size_t before, size_t *pos)
+{
+    size_t first, last, start, total = 0, best = 0;
+    size_t entry_len;
+    char *entry, *found;
+
+    if (history.newest == NULL || history.build_count > history.count)
+    {
+        history_build_start();
+    }
+    history_build_step();
+    for (size_t i = before - 1; i > history.suffix_entries; i--)
+    {
+        entry = history_entry(i, &entry_len);
+        if ((found = memmem(entry, entry_len, query, len)) != NULL)
+        {
+            *pos = found - entry;
+            return i;
+        }
+    }
+    if (before > history.suffix_entries)
+    {
+        before = history.suffix_entries + 1;
+    }
+
+    start = 0;
+    for (size_t i = 0; i < history.num_segments; start = history.segments[i++])
+    {
+        suffix_range(start, history.segments[i], query, len, &first, &last);
+        total += last - first;
+    }
+    if (total > HISTORY_SCAN_LIMIT)
+    {
+        for (size_t i = before - 1; i > 0; i--)
+        {
+            entry = history_entry(i, &entry_len);
+            if (history.newest[i - 1] && (found = memmem(entry, entry_len, query, len)) != NULL)
+            {
+                *pos = found - entry;
+                return i;
+            }
+        }
+        return 0;
+    }
+    start = 0;
+    for (size_t i = 0; i < history.num_segments; start = history.segments[i++])
+    {
+        suffix_range(start, history.segments[i], query, len, &first, &last);
+        for (size_t j = first; j < last; j++)
+        {
+            size_t n = history_entry_at(history.suffixes[j]);
+            size_t offset = history.suffixes[j] - history.index[n - 1];
+
+            if (n < before && (n > best || (n == best && offset < *pos)))
+            {
+                best = n;
+                *pos = offset;
+            }
+        }
+    }
+    return best;
+}
+
+/* djb2 hash of len bytes, as hash_string. */
+
+unsigned int hash_bytes(char *str, size_t len)
+{
+    unsigned int hash = 5381;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        hash = hash * 33 + (unsigned char) str[i];
+    }
+    return hash;
+}
+
+/* Enable the line editor if stdin is a terminal whose
+   settings can be read; they are restored after every 
+   line, so programs always start in cooked mode. */
+
+void init_editor()
+{
+    editor.enabled = (tcgetattr(STDIN_FILENO, &editor.cooked) == 0);
+}
+
+/* Read one line from the terminal in raw mode, with 
+   emacs-style editing keys, history recall and Ctrl-R
+   reverse search. The line is copied into arena. 
+   Returns its length, READ_EOF on Ctrl-D at an empty
+   line, or READ_ERROR. */
+
+int editor_read_line(struct arena *arena, char **line)
+{
+    struct termios raw = editor.cooked;
+    struct winsize size;
+    int result = EDIT_CONTINUE;
+    int key;
+
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_cflag |= CS8;
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    if (tcsetattr(STDIN_FILENO, TCSADRAIN, &raw) < 0)
+    {
+        editor.enabled = 0;
+        return read_line(&shell_input, arena, line);
+    }
+    editor.cols = (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0) ? size.ws_col : EDITOR_COLUMNS;
+    editor.len = editor.cursor = editor.view = 0;
+    editor.hist_pos = history.count + 1;
+    editor.searching = 0;
+    editor.last_key = 0;
+
+    while (result == EDIT_CONTINUE)
+    {
+        if ((key = editor_key()) < 0)
+        {
+            result = (key == READ_EOF) ? EDIT_EOF : READ_ERROR;
+            break;
+        }
+        result = editor_edit(key);
+        editor.last_key = key;
+        /* Draw once the keys already typed are handled. */
+        if (result == EDIT_CONTINUE && editor.in_start == editor.in_end)
+        {
+            editor_render(0);
+        }
+    }
+    if (result == EDIT_ACCEPT)
+    {
+        editor_render(1);
+    }
+    else if (result == EDIT_INTERRUPT)
+    {
+        editor.len = 0;
+        editor_emit("^C\r\n", 4);
+        editor_flush();
+    }
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &editor.cooked);
+
+    if (result == EDIT_EOF)
+    {
+        return READ_EOF;
+    }
+    if (result == READ_ERROR)
+    {
+        return READ_ERROR;
+    }
+    *line = arena_alloc(arena, editor.len + 1);
+    memcpy(*line, editor.buf, editor.len);
+    (*line)[editor.len] = '\0';
+    return editor.len;
+}
+
+/* Next byte typed, reading more from the terminal 
+   once the buffered bytes are used up. Returns the 
+   byte, READ_EOF or READ_ERROR. */
+
+int editor_getc()
+{
+    ssize_t bytes;
+
+    while (editor.in_start == editor.in_end)
+    {
+        struct pollfd key = {STDIN_FILENO, POLLIN, 0};
+
+        /* Build more of the search index until a key comes. */
+        while (history_build_step() && poll(&key, 1, 0) == 0)
+        {
+            ;
+        }
+        event_wait_fd(STDIN_FILENO);
+        if ((bytes = read(STDIN_FILENO, editor.in, EDITOR_READ_SIZE)) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return READ_ERROR;
+        }
+        if (bytes == 0)
+        {
+            return READ_EOF;
+        }
+        editor.in_start = 0;
+        editor.in_end = bytes;
+    }
+    return (unsigned char) editor.in[editor.in_start++];
+}
+
+/* Next key typed, with escape sequences for arrows,
+   Home, End, Delete and Meta keys decoded into KEY_
+   codes. */
+
+int editor_key()
+{
+    int key, next;
+
+    if ((key = editor_getc()) != KEY_ESC)
+    {
+        return key;
+    }
+    if ((key = editor_getc()) < 0)
+    {
+        return key;
+    }
+    switch (key)
+    {
+        case 'b': return KEY_WORD_LEFT;
+        case 'f': return KEY_WORD_RIGHT;
+        case 'd': return KEY_KILL_WORD;
+        case KEY_BACKSPACE: return KEY_RUBOUT_WORD;
+        case '[': case 'O': break;
+        default: return KEY_ESC;
+    }
+    if ((next = editor_getc()) < 0)
+    {
+        return next;
+    }
+    if (isdigit(next))
+    {
+        /* ESC [ n ~ */
+        if ((key = editor_getc()) != '~')
+        {
+            return KEY_ESC;
+        }
+        switch (next)
+        {
+            case '1': case '7': return KEY_HOME;
+            case '4': case '8': return KEY_END;
+            case '3': return KEY_DELETE;
+            default: return KEY_ESC;
+        }
+    }
+    switch (next)
+    {
+        case 'A': return KEY_UP;
+        case 'B': return KEY_DOWN;
+        case 'C': return KEY_RIGHT;
+        case 'D': return KEY_LEFT;
+        case 'H': return KEY_HOME;
+        case 'F': return KEY_END;
+        default: return KEY_ESC;
+    }
+}
+
+/* Apply one key to the line. Returns EDIT_CONTINUE, 
+   or EDIT_ACCEPT, EDIT_EOF or EDIT_INTERRUPT when the
+   line is finished. */
+
+int editor_edit(int key)
+{
+    size_t pos;
+    char byte;
+
+    if (editor.searching)
+    {
+        if (key == CTRL_KEY('r') || key == CTRL_KEY('h') || key == KEY_BACKSPACE
+            || (key >= ' ' && key < KEY_BACKSPACE))
+        {
+            editor_search(key);
+            return EDIT_CONTINUE;
+        }
+        if (key == CTRL_KEY('g'))
+        {
+            /* Abandon the search, keeping the original line. */
+            editor.searching = 0;
+            return EDIT_CONTINUE;
+        }
+        editor_search_end();
+        if (key == KEY_ESC)
+        {
+            return EDIT_CONTINUE;
+        }
+    }
+
+    switch (key)
+    {
+        case '\r': case '\n':
+            return EDIT_ACCEPT;
+        case CTRL_KEY('c'):
+            return EDIT_INTERRUPT;
+        case CTRL_KEY('d'):
+            /* Ends input on an empty line, else deletes like Delete. */
+            if (editor.len == 0)
+            {
+                return EDIT_EOF;
+            }
+            /* Fall through. */
+        case KEY_DELETE:
+            if (editor.cursor < editor.len)
+            {
+                editor_delete(editor.cursor, editor.cursor + 1, 0);
+            }
+            break;
+        case CTRL_KEY('h'): case KEY_BACKSPACE:
+            if (editor.cursor > 0)
+            {
+                editor_delete(editor.cursor - 1, editor.cursor, 0);
+            }
+            break;
+        case CTRL_KEY('a'): case KEY_HOME:
+            editor.cursor = 0;
+            break;
+        case CTRL_KEY('e'): case KEY_END:
+            editor.cursor = editor.len;
+            break;
+        case CTRL_KEY('b'): case KEY_LEFT:
+            editor.cursor -= (editor.cursor > 0);
+            break;
+        case CTRL_KEY('f'): case KEY_RIGHT:
+            editor.cursor += (editor.cursor < editor.len);
+            break;
+        case KEY_WORD_LEFT: case KEY_RUBOUT_WORD:
+            for (pos = editor.cursor; pos > 0 && !isalnum((unsigned char) editor.buf[pos - 1]); pos--);
+            for (; pos > 0 && isalnum((unsigned char) editor.buf[pos - 1]); pos--);
+            if (key == KEY_RUBOUT_WORD)
+            {
+                editor_delete(pos, editor.cursor, 1);
+            }
+            editor.cursor = pos;
+            break;
+        case KEY_WORD_RIGHT: case KEY_KILL_WORD:
+            for (pos = editor.cursor; pos < editor.len && !isalnum((unsigned char) editor.buf[pos]); pos++);
+            for (; pos < editor.len && isalnum((unsigned char) editor.buf[pos]); pos++);
+            if (key == KEY_KILL_WORD)
+            {
+                editor_delete(editor.cursor, pos, 1);
+            }
+            else
+            {
+                editor.cursor = pos;
+            }
+            break;
+        case CTRL_KEY('w'):
+            for (pos = editor.cursor; pos > 0 && editor.buf[pos - 1] == ' '; pos--);
+            for (; pos > 0 && editor.buf[pos - 1] != ' '; pos--);
+            editor_delete(pos, editor.cursor, 1);
+            break;
+        case CTRL_KEY('k'):
+            editor_delete(editor.cursor, editor.len, 1);
+            break;
+        case CTRL_KEY('u'):
+            editor_delete(0, editor.cursor, 1);
+            break;
+        case CTRL_KEY('y'):
+            editor_insert(editor.kill, editor.kill_len);
+            break;
+        case CTRL_KEY('t'):
+            if (editor.cursor > 0 && editor.len > 1)
+            {
+                pos = (editor.cursor == editor.len) ? editor.cursor - 1 : editor.cursor;
+                byte = editor.buf[pos - 1];
+                editor.buf[pos - 1] = editor.buf[pos];
+                editor.buf[pos] = byte;
+                editor.cursor = pos + 1;
+            }
+            break;
+        case CTRL_KEY('p'): case KEY_UP:
+            if (editor.hist_pos > 1)
+            {
+                editor_history(editor.hist_pos - 1);
+            }
+            break;
+        case CTRL_KEY('n'): case KEY_DOWN:
+            if (editor.hist_pos <= history.count)
+            {
+                editor_history(editor.hist_pos + 1);
+            }
+            break;
+        case CTRL_KEY('l'):
+            editor.clear = 1;
+            break;
+        case '\t':
+            editor_complete();
+            break;
+        case CTRL_KEY('r'):
+            editor.searching = 1;
+            editor.failed = 0;
+            editor.query_len = 0;
+            editor.match = 0;
+            break;
+        default:
+            if (key >= ' ' && key < KEY_UP && key != KEY_BACKSPACE)
+            {
+                byte = key;
+                editor_insert(&byte, 1);
+            }
+            break;
+    }
+    return EDIT_CONTINUE;
+}
+
+/* Handle a key typed during reverse search: a byte 
+   extends the query, backspace shortens it and Ctrl-R 
+   moves on to the next older match. */
+
+void editor_search(int key)
+{
+    if (key == CTRL_KEY('r'))
+    {
+        if (editor.query_len > 0)
+        {
+            editor_search_update(editor.match > 0 ? editor.match : history.count + 1);
+        }
+        return;
+    }
+    if (key == CTRL_KEY('h') || key == KEY_BACKSPACE)
+    {
+        if (editor.query_len > 0)
+        {
+            editor.query_len--;
+        }
+        editor.match = 0;
+        editor.failed = 0;
+        if (editor.query_len > 0)
+        {
+            editor_search_update(history.count + 1);
+        }
+        return;
+    }
+    buffer_reserve(&editor.query, &editor.query_cap, editor.query_len + 1);
+    editor.query[editor.query_len++] = key;
+    /* The current match may still contain the longer query. */
+    editor_search_update(editor.match > 0 ? editor.match + 1 : history.count + 1);
+}
+
+/* Look for the query in entries older than before.
+   A failed search keeps the last match on screen. */
+
+void editor_search_update(size_t before)
+{
+    size_t pos = 0;
+    size_t match = history_search(editor.query, editor.query_len, before, &pos);
+
+    editor.failed = (match == 0);
+    if (match > 0)
+    {
+        editor.match = match;
+        editor.match_pos = pos;
+    }
+}
+
+/* Leave reverse search, editing the match in place
+   of the line with the cursor on the match. */
+
+void editor_search_end()
+{
+    editor.searching = 0;
+    if (editor.match > 0)
+    {
+        editor_history(editor.match);
+        editor.cursor = editor.match_pos;
+    }
+}
+
+/* Insert len bytes at the cursor. */
+
+void editor_insert(char *str, size_t len)
+{
+    buffer_reserve(&editor.buf, &editor.cap, editor.len + len);
+    memmove(editor.buf + editor.cursor + len, editor.buf + editor.cursor, editor.len - editor.cursor);
+    memcpy(editor.buf + editor.cursor, str, len);
+    editor.len += len;
+    editor.cursor += len;
+}
+
+/* Delete the bytes between from and to, saving them 
+   for Ctrl-Y if kill is set. The cursor is left at
+   from. */
+
+void editor_delete(size_t from, size_t to, int kill)
+{
+    if (from >= to)
+    {
+        return;
+    }
+    if (kill)
+    {
+        buffer_reserve(&editor.kill, &editor.kill_cap, to - from);
+        memcpy(editor.kill, editor.buf + from, to - from);
+        editor.kill_len = to - from;
+    }
+    memmove(editor.buf + from, editor.buf + to, editor.len - to);
+    editor.len -= to - from;
+    editor.cursor = from;
+}
+
+/* Replace the line with history entry n, or with the
+   line that was being typed if n is past the newest.
+   That line is saved when history is first entered. */
+
+void editor_history(size_t n)
+{
+    size_t len;
+    char *entry;
+
+    if (editor.hist_pos > history.count)
+    {
+        buffer_reserve(&editor.saved, &editor.saved_cap, editor.len);
+        memcpy(editor.saved, editor.buf, editor.len);
+        editor.saved_len = editor.len;
+    }
+    if ((entry = history_entry(n, &len)) == NULL)
+    {
+        entry = editor.saved;
+        len = editor.saved_len;
+    }
+    buffer_reserve(&editor.buf, &editor.cap, len);
+    memcpy(editor.buf, entry, len);
+    editor.len = editor.cursor = len;
+    editor.hist_pos = n;
+}
+
+/* Redraw the prompt's last line and the edited line,
+   or the search prompt and its match, then place the
+   cursor, after any output already pending. A final 
+   render draws the whole line ending in a new line. 
+   Everything goes out in one write. */
+
+void editor_render(int final)
+{
+    char *prompt_line = prompt.buf;
+    size_t prompt_len = prompt.len;
+    size_t width = 0, avail, cursor;
+    char *newline;
+    char *text = editor.buf;
+    size_t text_len = editor.len;
+    char move[32];
+
+    if ((newline = memrchr(prompt.buf, '\n', prompt.len)) != NULL)
+    {
+        prompt_line = newline + 1;
+        prompt_len = prompt.len - (prompt_line - prompt.buf);
+    }
+    if (editor.clear)
+    {
+        editor_emit("\x1b[H\x1b[2J", 7);
+    }
+    if (editor.clear || editor.reprint)
+    {
+        editor_emit(prompt.buf, prompt_line - prompt.buf);
+        editor.clear = editor.reprint = 0;
+    }
+    editor_emit("\r", 1);
+
+    if (editor.searching && !final)
+    {
+        char *lead = editor.failed ? SEARCH_FAILED_PROMPT : SEARCH_PROMPT;
+
+        editor_emit(lead, strlen(lead));
+        editor_emit(editor.query, editor.query_len);
+        editor_emit("': ", 3);
+        width = strlen(lead) + editor.query_len + 3;
+        cursor = 0;
+        if (editor.match > 0)
+        {
+            text = history_entry(editor.match, &text_len);
+            cursor = editor.match_pos;
+        }
+        editor.view = 0;
+    }
+    else
+    {
+        editor_emit(prompt_line, prompt_len);
+        for (size_t i = 0; i < prompt_len; i++)
+        {
+            /* Count characters, not UTF-8 continuation bytes. */
+            width += ((prompt_line[i] & 0xc0) != 0x80);
+        }
+        cursor = final ? editor.len : editor.cursor;
+    }
+
+    /* Scroll sideways to keep the cursor on screen. */
+    avail = (width + 1 < (size_t) editor.cols) ? editor.cols - width - 1 : 1;
+    if (cursor < editor.view)
+    {
+        editor.view = cursor;
+    }
+    else if (cursor - editor.view > avail)
+    {
+        editor.view = cursor - avail;
+    }
+    if (final)
+    {
+        editor.view = 0;
+        avail = text_len;
+    }
+    if (editor.view < text_len)
+    {
+        editor_emit(text + editor.view, (text_len - editor.view < avail) ? text_len - editor.view : avail);
+    }
+    editor_emit("\x1b[K", 3);
+    if (final)
+    {
+        editor_emit("\r\n", 2);
+    }
+    else
+    {
+        editor_emit(move, snprintf(move, sizeof(move), "\r\x1b[%zuC", width + cursor - editor.view));
+    }
+    editor_flush();
+}
+
+/* Add len bytes to the pending output. */
+
+void editor_emit(char *str, size_t len)
+{
+    buffer_reserve(&editor.out, &editor.out_cap, editor.out_len + len);
+    memcpy(editor.out + editor.out_len, str, len);
+    editor.out_len += len;
+}
+
+/* Write the pending output to the terminal. */
+
+void editor_flush()
+{
+    size_t written = 0;
+    ssize_t bytes;
+
+    while (written < editor.out_len)
+    {
+        if ((bytes = write(STDOUT_FILENO, editor.out + written, editor.out_len - written)) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        written += bytes;
+    }
+    editor.out_len = 0;
+}
+
+/* Complete the word before the cursor. In command 
+   position a word without a slash is completed from 
+   the builtins and the executable index; any other 
+   word is completed as a file name. A single match is
+   inserted whole; several insert their longest common
+   prefix, and a second Tab lists them. */
+
+void editor_complete()
+{
+    struct argv_vec matches;
+    size_t start, prefix, word_len = 0;
+    char *word;
+    int command;
+    size_t i;
+
+    start = editor.cursor;
+    while (start > 0)
+    {
+        /* An escaped break is part of the word. */
+        if (start > 1 && editor.buf[start - 2] == '\\')
+        {
+            start -= 2;
+        }
+        else if (strchr(COMPLETE_BREAKS, editor.buf[start - 1]) == NULL)
+        {
+            start--;
+        }
+        else
+        {
+            break;
+        }
+    }
+    for (i = start; i > 0 && (editor.buf[i - 1] == ' ' || editor.buf[i - 1] == '\t'); i--);
+    command = (i == 0 || strchr("|&;(", editor.buf[i - 1]) != NULL);
+
+    /* The word as the tokenizer will see it, without escapes. */
+    word = arena_alloc(&line_arena, editor.cursor - start + 1);
+    for (i = start; i < editor.cursor; i++)
+    {
+        if (editor.buf[i] == '\\' && i + 1 < editor.cursor)
+        {
+            i++;
+        }
+        word[word_len++] = editor.buf[i];
+    }
+    word[word_len] = '\0';
+
+    argv_init(&matches);
+    if (command && strchr(word, '/') == NULL)
+    {
+        complete_commands(&matches, word);
+    }
+    else
+    {
+        complete_files(&matches, word);
+    }
+    if (matches.len == 0)
+    {
+        return;
+    }
+    qsort(matches.items, matches.len, sizeof(char *), name_order);
+
+    /* Names found in more than one directory are listed once. */
+    i = 0;
+    for (int j = 1; j < matches.len; j++)
+    {
+        if (strcmp(matches.items[i], matches.items[j]) != 0)
+        {
+            matches.items[++i] = matches.items[j];
+        }
+    }
+    matches.len = i + 1;
+    matches.items[matches.len] = NULL;
+
+    /* Only the file part of a path is matched. */
+    if (!command || strchr(word, '/') != NULL)
+    {
+        char *slash = strrchr(word, '/');
+
+        word_len -= (slash == NULL) ? 0 : (size_t) (slash + 1 - word);
+    }
+    prefix = strlen(matches.items[0]);
+    for (int j = 1; j < matches.len; j++)
+    {
+        for (i = 0; i < prefix && matches.items[j][i] == matches.items[0][i]; i++);
+        prefix = i;
+    }
+
+    if (prefix > word_len)
+    {
+        editor_insert_escaped(matches.items[0] + word_len, prefix - word_len);
+        if (matches.len == 1 && matches.items[0][prefix - 1] != '/')
+        {
+            editor_insert(" ", 1);
+        }
+    }
+    else if (matches.len == 1 && matches.items[0][prefix - 1] != '/')
+    {
+        editor_insert(" ", 1);
+    }
+    else if (editor.last_key == '\t')
+    {
+        editor_list(&matches);
+    }
+}
+
+/* Add every builtin and every indexed executable whose
+   name starts with prefix to matches. */
+
+void complete_commands(struct argv_vec *matches, char *prefix)
+{
+    char candidate[MAX_PATH + 1];
+    size_t len = strlen(prefix);
+
+    for (struct builtin *builtin = builtins; builtin->name != NULL; builtin++)
+    {
+        if (strncmp(builtin->name, prefix, len) == 0)
+        {
+            argv_push(matches, builtin->name);
+        }
+    }
+    if (command_index_refresh() < 0)
+    {
+        return;
+    }
+    for (size_t i = 0; i < num_command_dirs; i++)
+    {
+        struct command_dir *dir = &command_dirs[i];
+        size_t low = 0, high = dir->count;
+
+        if (!dir->scanned)
+        {
+            continue;
+        }
+        /* First name not below prefix, then every name sharing it. */
+        while (low < high)
+        {
+            size_t mid = (low + high) / 2;
+
+            if (strncmp(dir->names[mid], prefix, len) < 0)
+            {
+                low = mid + 1;
+            }
+            else
+            {
+                high = mid;
+            }
+        }
+        for (; low < dir->count && strncmp(dir->names[low], prefix, len) == 0; low++)
+        {
+            snprintf(candidate, sizeof(candidate), "%s/%s", dir->path, dir->names[low]);
+            if (access(candidate, X_OK) == 0)
+            {
+                argv_push(matches, dir->names[low]);
+            }
+        }
+    }
+}
+
+/* Add the names in word's directory that start with
+   its last component to matches, with a / after each
+   directory. Dot files are only offered when that
+   component starts with a dot. */
+
+void complete_files(struct argv_vec *matches, char *word)
+{
+    char *slash = strrchr(word, '/');
+    char *base = (slash == NULL) ? word : slash + 1;
+    size_t len = strlen(base);
+    struct dirent *ent;
+    struct stat st;
+    char *dir_path;
+    DIR *stream;
+
+    if (slash == NULL)
+    {
+        dir_path = ".";
+    }
+    else
+    {
+        dir_path = arena_alloc(&line_arena, slash - word + 2);
+        memcpy(dir_path, word, slash - word + 1);
+        dir_path[slash - word + 1] = '\0';
+    }
+    if ((stream = opendir(dir_path)) == NULL)
+    {
+        return;
+    }
+    while ((ent = readdir(stream)) != NULL)
+    {
+        size_t name_len = strlen(ent->d_name);
+        int is_dir;
+        char *match;
+
+        if (strncmp(ent->d_name, base, len) != 0 || (ent->d_name[0] == '.' && base[0] != '.')
+            || strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+        {
+            continue;
+        }
+        is_dir = (ent->d_type == DT_DIR);
+        if (ent->d_type == DT_LNK || ent->d_type == DT_UNKNOWN)
+        {
+            is_dir = (fstatat(dirfd(stream), ent->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode));
+        }
+        match = arena_alloc(&line_arena, name_len + 2);
+        memcpy(match, ent->d_name, name_len);
+        match[name_len] = '/';
+        match[name_len + is_dir] = '\0';
+        argv_push(matches, match);
+    }
+    closedir(stream);
+}
+
+/* Insert len bytes of str at the cursor, escaping any
+   byte the tokenizer would treat specially. */
+
+void editor_insert_escaped(char *str, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        if (strchr(COMPLETE_ESCAPES, str[i]) != NULL)
+        {
+            editor_insert("\\", 1);
+        }
+        editor_insert(&str[i], 1);
+    }
+}
+
+/* List matches in columns below the line, asking first
+   if there are many. The line is drawn again after. */
+
+void editor_list(struct argv_vec *matches)
+{
+    size_t width = 0, columns, rows;
+    char line[64];
+    int key;
+
+    for (int i = 0; i < matches->len; i++)
+    {
+        size_t len = strlen(matches->items[i]);
+
+        width = (len > width) ? len : width;
+    }
+    width += 2;
+    if (matches->len > COMPLETE_ASK_LIMIT)
+    {
+        editor_emit(line, snprintf(line, sizeof(line), "\r\nDisplay all %d possibilities? (y or n)", matches->len));
+        editor_flush();
+        if ((key = editor_getc()) != 'y' && key != 'Y')
+        {
+            editor_emit("\r\n", 2);
+            editor.reprint = 1;
+            return;
+        }
+    }
+    columns = ((size_t) editor.cols > width) ? editor.cols / width : 1;
+    rows = (matches->len + columns - 1) / columns;
+    editor_emit("\r\n", 2);
+    for (size_t row = 0; row < rows; row++)
+    {
+        for (size_t column = 0; column < columns; column++)
+        {
+            size_t i = column * rows + row;
+            size_t len;
+
+            if (i >= (size_t) matches->len)
+            {
+                break;
+            }
+            len = strlen(matches->items[i]);
+            editor_emit(matches->items[i], len);
+            for (; len < width && column + 1 < columns && i + rows < (size_t) matches->len; len++)
+            {
+                editor_emit(" ", 1);
+            }
+        }
+        editor_emit("\r\n", 2);
+    }
+    editor.reprint = 1;
+}
+
+/* Grow the malloc'd buffer buf to hold at least size
+   bytes, doubling its capacity. */
+
+void buffer_reserve(char **buf, size_t *cap, size_t size)
+{
+    size_t new_cap = (*cap > 0) ? *cap : INIT_LINE_SIZE;
+
+    if (size <= *cap && *buf != NULL)
+    {
+        return;
+    }
+    while (new_cap < size)
+    {
+        new_cap *= 2;
+    }
+    if ((*buf = realloc(*buf, new_cap)) == NULL)
+    {
+        perror_exit("realloc()");
+    }
+    *cap = new_cap;
+}
+
+/* Allocate size bytes from the arena. The current block
+   is bumped if it has room; otherwise the next retained
+   block (or a new one, if none is big enough) is used. 
+   Allocation failure is fatal, since the shell cannot 
+   parse the line without memory. */
+
+void *arena_alloc(struct arena *arena, size_t size)
+{
+    struct arena_block *block = arena->current;
+
+    size = (size + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+    while (block != NULL && block->used + size > block->size)
+    {
+        block = block->next;
+        if (block != NULL)
+        {
+            block->used = 0;
+        }
+    }
+
+    if (block == NULL)
+    {
+        size_t block_size = (size > ARENA_BLOCK_SIZE) ? size : ARENA_BLOCK_SIZE;
+
+        if ((block = malloc(sizeof(struct arena_block) + block_size)) == NULL)
+        {
+            perror_exit("malloc()");
+        }
+        block->size = block_size;
+        block->used = 0;
+
+        /* Link after the current block, keeping older blocks for reuse. */
+        if (arena->current == NULL)
+        {
+            block->next = arena->head;
+            arena->head = block;
+        }
+        else
+        {
+            block->next = arena->current->next;
+            arena->current->next = block;
+        }
+    }
+
+    arena->current = block;
+    arena->last = block->data + block->used;
+    block->used += size;
+    return arena->last;
+}
+
+/* Grow an allocation from old_size to new_size bytes. 
+   The most recent allocation is extended in place when
+   its block has room; anything else is copied. */
+
+void *arena_grow(struct arena *arena, void *ptr, size_t old_size, size_t new_size)
+{
+    struct arena_block *block = arena->current;
+    void *new_ptr;
+
+    old_size = (old_size + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+    new_size = (new_size + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+    if (ptr == arena->last && block->used - old_size + new_size <= block->size)
+    {
+        block->used += new_size - old_size;
+        return ptr;
+    }
+    new_ptr = arena_alloc(arena, new_size);
+    memcpy(new_ptr, ptr, old_size);
+    return new_ptr;
+}
+
+/* Release everything allocated from the arena at once,
+   keeping its blocks for the next line. */
+
+void arena_reset(struct arena *arena)
+{
+    arena->current = arena->head;
+    arena->last = NULL;
+    if (arena->head != NULL)
+    {
+        arena->head->used = 0;
+    }
+}
+
+/* Record the arena's current position in mark. */
+
+void arena_mark(struct arena *arena, struct arena_mark *mark)
+{
+    mark->block = arena->current;
+    mark->used = (arena->current != NULL) ? arena->current->used : 0;
+    mark->last = arena->last;
+}
+
+/* Release everything allocated from the arena since 
+   mark was taken, keeping the blocks for reuse. */
+
+void arena_release(struct arena *arena, struct arena_mark *mark)
+{
+    if (mark->block == NULL)
+    {
+        arena_reset(arena);
+        return;
+    }
+    arena->current = mark->block;
+    arena->current->used = mark->used;
+    arena->last = mark->last;
+}
+
+/* Free the arena's blocks, leaving it empty. */
+
+void arena_free(struct arena *arena)
+{
+    while (arena->head != NULL)
+    {
+        struct arena_block *next = arena->head->next;
+
+        free(arena->head);
+        arena->head = next;
+    }
+    arena->current = NULL;
+    arena->last = NULL;
+}
+
+/* Copy str into the arena, or return NULL for NULL. */
+
+char *arena_strdup(struct arena *arena, char *str)
+{
+    size_t len;
+
+    if (str == NULL)
+    {
+        return NULL;
+    }
+    len = strlen(str) + 1;
+    return memcpy(arena_alloc(arena, len), str, len);
+}
+
+/* Initialize an empty argument vector in the line arena. */
+
+void argv_init(struct argv_vec *vec)
+{
+    vec->cap = INIT_ARGV_SIZE;
+    vec->len = 0;
+    vec->items = arena_alloc(&line_arena, vec->cap * sizeof(char *));
+    vec->items[0] = NULL;
+}
+
+/* Append an argument, keeping the vector NULL-terminated. */
+
+void argv_push(struct argv_vec *vec, char *arg)
+{
+    if (vec->len + 1 >= vec->cap)
+    {
+        vec->items = arena_grow(&line_arena, vec->items, vec->cap * sizeof(char *), vec->cap * 2 * sizeof(char *));
+        vec->cap *= 2;
+    }
+    vec->items[vec->len++] = arg;
+    vec->items[vec->len] = NULL;
+}
+
+/* Find the builtin that handles argv, or NULL if 
+   argv[0] is not a builtin or the builtin declines 
+   these arguments. A shell function comes before a 
+   builtin of the same name. */
+
+struct builtin *find_builtin(char *argv[])
+{
+    if (num_functions > 0 && function_find(argv[0]) != NULL)
+    {
+        return &function_builtin;
+    }
+    for (struct builtin *builtin = builtins; builtin->name != NULL; builtin++)
+    {
+        if (strcmp(builtin->name, argv[0]) == 0)
+        {
+            return (builtin->accepts == NULL || builtin->accepts(argv)) ? builtin : NULL;
+        }
+    }
+    return NULL;
+}
+
+/* Run a builtin command in the shell process. Its
+   redirections are applied to the shell's own fds, 
+   and its assignments to the shell's variables (as 
+   exported ones), around the call and undone 
+   afterwards. Returns the builtin's exit status. */
+
+int run_builtin(struct builtin *builtin, struct command *command)
+{
+    struct saved_fd saved[MAX_REDIRECTS];
+    struct argv_vec *env = &command->env;
+    char **saved_vars = NULL;
+    int *saved_exported = NULL;
+    int num_saved;
+    int status;
+
+    fflush(stdout);
+    if (redirect_shell(command, saved, &num_saved) < 0)
+    {
+        return EXIT_FAILURE;
+    }
+    if (env->len > 0)
+    {
+        saved_vars = arena_alloc(&line_arena, env->len * sizeof(char *));
+        saved_exported = arena_alloc(&line_arena, env->len * sizeof(int));
+        for (int i = 0; i < env->len; i++)
+        {
+            struct var *var = var_find(env->items[i], strchr(env->items[i], '=') - env->items[i]);
+
+            saved_vars[i] = (var == NULL) ? NULL : strdup(var->entry);
+            saved_exported[i] = (var != NULL && var->exported);
+        }
+        var_assign(env, 1);
+    }
+
+    status = builtin->func(command->argv.items);
+    fflush(stdout);
+
+    for (int i = env->len - 1; i >= 0; i--)
+    {
+        size_t name_len = strchr(env->items[i], '=') - env->items[i];
+
+        var_unset(env->items[i], name_len);
+        if (saved_vars[i] != NULL)
+        {
+            var_set(saved_vars[i], name_len, saved_vars[i] + name_len + 1, saved_exported[i]);
+            free(saved_vars[i]);
+        }
+    }
+    restore_shell(saved, num_saved);
+    return status;
+}
+
+/* Run a lone builtin in the shell process as 
+   run_builtin does, or with builtin NULL the lone
+   compound command as run_body does, measuring it like
+   a one-stage pipeline: the shell's own resource usage
+   during the call stands in for the child's, with that
+   of the children a compound command waited for added. */
+
+int run_builtin_timed(struct builtin *builtin, struct pipeline *pipeline)
+{
+    struct rusage before, after, children_before, children_after;
+    struct process proc;
+    struct timespec start;
+    char *command = strndup(pipeline->text, pipeline->text_len);
+
+    memset(&proc, 0, sizeof(proc));
+    proc.name = (builtin != NULL) ? builtin->name : pipeline->commands[0].argv.items[0];
+    getrusage(RUSAGE_SELF, &before);
+    getrusage(RUSAGE_CHILDREN, &children_before);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    proc.start = start;
+
+    if (builtin != NULL)
+    {
+        proc.status = W_EXITCODE(run_builtin(builtin, &pipeline->commands[0]), 0);
+    }
+    else
+    {
+        proc.status = W_EXITCODE(run_body(&pipeline->commands[0]), 0);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &proc.end);
+    getrusage(RUSAGE_SELF, &after);
+    getrusage(RUSAGE_CHILDREN, &children_after);
+    if (builtin == NULL)
+    {
+        timeradd(&after.ru_utime, &children_after.ru_utime, &after.ru_utime);
+        timeradd(&after.ru_stime, &children_after.ru_stime, &after.ru_stime);
+        timeradd(&before.ru_utime, &children_before.ru_utime, &before.ru_utime);
+        timeradd(&before.ru_stime, &children_before.ru_stime, &before.ru_stime);
+    }
+    proc.usage = after;
+    timersub(&after.ru_utime, &before.ru_utime, &proc.usage.ru_utime);
+    timersub(&after.ru_stime, &before.ru_stime, &proc.usage.ru_stime);
+    proc.usage.ru_nvcsw = after.ru_nvcsw - before.ru_nvcsw;
+    proc.usage.ru_nivcsw = after.ru_nivcsw - before.ru_nivcsw;
+
+    report_pipeline(command, &proc, 1, &start, pipeline->timed, 0);
+    free(command);
+    return WEXITSTATUS(proc.status);
+}
+
+/* exit [n]: exit the shell with status n, or with 
+   the status of the last command. */
+
+int builtin_exit(char *argv[])
+{
+    /* Warn once before leaving stopped jobs behind. */
+    for (int i = 0; interactive && !stopped_warned && i < num_jobs; i++)
+    {
+        if (job_table[i]->state == JOB_STOPPED)
+        {
+            fprintf(stderr, "There are stopped jobs.\n");
+            stopped_warned = 1;
+            return EXIT_FAILURE;
+        }
+    }
+    exit_shell((argv[1] != NULL) ? atoi(argv[1]) & 0xff : last_status);
+    return EXIT_SUCCESS;
+}
+
+/* cd [dir]: change the shell's working directory to
+   dir, $HOME without an argument or $OLDPWD for -.
+   PWD and OLDPWD are kept up to date. */
+
+int builtin_cd(char *argv[])
+{
+    char old_cwd[MAX_PATH + 1], new_cwd[MAX_PATH + 1];
+    char *dir = argv[1];
+
+    if (dir == NULL && (dir = var_get("HOME")) == NULL)
+    {
+        fprintf(stderr, "cd: HOME not set\n");
+        return EXIT_FAILURE;
+    }
+    if (strcmp(dir, "-") == 0)
+    {
+        if ((dir = var_get("OLDPWD")) == NULL)
+        {
+            fprintf(stderr, "cd: OLDPWD not set\n");
+            return EXIT_FAILURE;
+        }
+        printf("%s\n", dir);
+    }
+
+    if (getcwd(old_cwd, sizeof(old_cwd)) == NULL)
+    {
+        old_cwd[0] = '\0';
+    }
+    if (chdir(dir) < 0)
+    {
+        fprintf(stderr, "cd: %s: %s\n", dir, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    if (old_cwd[0] != '\0')
+    {
+        var_set("OLDPWD", strlen("OLDPWD"), old_cwd, 1);
+    }
+    if (getcwd(new_cwd, sizeof(new_cwd)) != NULL)
+    {
+        var_set("PWD", strlen("PWD"), new_cwd, 1);
+    }
+    prompt_update_cwd();
+    return EXIT_SUCCESS;
+}
+
+/* pwd: print the working directory. */
+
+int builtin_pwd(char *argv[])
+{
+    char cwd[MAX_PATH + 1];
+
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+    {
+        perror("pwd");
+        return EXIT_FAILURE;
+    }
+    printf("%s\n", cwd);
+    return EXIT_SUCCESS;
+}
+
+/* echo [-n] [arg ...]: print the arguments separated 
+   by spaces, followed by a new line unless -n. */
+
+int builtin_echo(char *argv[])
+{
+    int newline = 1;
+    int i = 1;
+
+    if (argv[1] != NULL && strcmp(argv[1], "-n") == 0)
+    {
+        newline = 0;
+        i++;
+    }
+    for (int first = i; argv[i] != NULL; i++)
+    {
+        if (i > first)
+        {
+            putchar(' ');
+        }
+        fputs(argv[i], stdout);
+    }
+    if (newline)
+    {
+        putchar('\n');
+    }
+    return EXIT_SUCCESS;
+}
+
+/* true and : do nothing, successfully. */
+
+int builtin_true(char *argv[])
+{
+    return EXIT_SUCCESS;
+}
+
+/* false does nothing, unsuccessfully. */
+
+int builtin_false(char *argv[])
+{
+    return EXIT_FAILURE;
+}
+
+/* test expr and [ expr ]: evaluate a conditional 
+   expression. Supports ! and the usual unary file 
+   (-e -f -d -r -w -x -s) and string (-n -z) tests,
+   and the binary string (= !=) and integer (-eq -ne
+   -lt -le -gt -ge) comparisons. Returns 0 if the 
+   expression is true, 1 if false and 2 on error. */
+
+int builtin_test(char *argv[])
+{
+    int argc = 0;
+
+    while (argv[argc] != NULL)
+    {
+        argc++;
+    }
+    if (strcmp(argv[0], "[") == 0)
+    {
+        if (argc < 2 || strcmp(argv[argc - 1], "]") != 0)
+        {
+            fprintf(stderr, "[: missing ']'\n");
+            return TEST_ERROR;
+        }
+        argc--;
+    }
+    return test_expr(argv + 1, argc - 1);
+}
+
+/* Evaluate the argc words of a test expression. */
+
+int test_expr(char *argv[], int argc)
+{
+    struct stat st;
+
+    if (argc > 0 && strcmp(argv[0], "!") == 0)
+    {
+        int result = test_expr(argv + 1, argc - 1);
+
+        return (result == TEST_ERROR) ? TEST_ERROR : !result;
+    }
+    if (argc == 0)
+    {
+        return EXIT_FAILURE;
+    }
+    if (argc == 1)
+    {
+        return argv[0][0] == '\0';
+    }
+    if (argc == 2)
+    {
+        char *op = argv[0], *arg = argv[1];
+
+        if (strcmp(op, "-n") == 0)
+        {
+            return arg[0] == '\0';
+        }
+        if (strcmp(op, "-z") == 0)
+        {
+            return arg[0] != '\0';
+        }
+        if (strlen(op) != 2 || op[0] != '-' || strchr("efdrwxs", op[1]) == NULL)
+        {
+            fprintf(stderr, "test: %s: unary operator expected\n", op);
+            return TEST_ERROR;
+        }
+        switch (op[1])
+        {
+            case 'r':
+                return access(arg, R_OK) != 0;
+            case 'w':
+                return access(arg, W_OK) != 0;
+            case 'x':
+                return access(arg, X_OK) != 0;
+        }
+        if (stat(arg, &st) < 0)
+        {
+            return EXIT_FAILURE;
+        }
+        switch (op[1])
+        {
+            case 'f':
+                return !S_ISREG(st.st_mode);
+            case 'd':
+                return !S_ISDIR(st.st_mode);
+            case 's':
+                return st.st_size == 0;
+        }
+        return EXIT_SUCCESS;
+    }
+    if (argc == 3)
+    {
+        char *op = argv[1];
+        char *end_left, *end_right;
+        long left, right;
+
+        if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0)
+        {
+            return strcmp(argv[0], argv[2]) != 0;
+        }
+        if (strcmp(op, "!=") == 0)
+        {
+            return strcmp(argv[0], argv[2]) == 0;
+        }
+        left = strtol(argv[0], &end_left, 10);
+        right = strtol(argv[2], &end_right, 10);
+        if (*argv[0] == '\0' || *end_left != '\0' || *argv[2] == '\0' || *end_right != '\0')
+        {
+            fprintf(stderr, "test: integer expression expected\n");
+            return TEST_ERROR;
+        }
+        if (strcmp(op, "-eq") == 0)
+        {
+            return !(left == right);
+        }
+        if (strcmp(op, "-ne") == 0)
+        {
+            return !(left != right);
+        }
+        if (strcmp(op, "-lt") == 0)
+        {
+            return !(left < right);
+        }
+        if (strcmp(op, "-le") == 0)
+        {
+            return !(left <= right);
+        }
+        if (strcmp(op, "-gt") == 0)
+        {
+            return !(left > right);
+        }
+        if (strcmp(op, "-ge") == 0)
+        {
+            return !(left >= right);
+        }
+        fprintf(stderr, "test: %s: binary operator expected\n", op);
+        return TEST_ERROR;
+    }
+    fprintf(stderr, "test: too many arguments\n");
+    return TEST_ERROR;
+}
+
+/* cat is only run as a builtin when every argument is
+   a file name (or -), so any option gets the real cat. */
+
+int cat_accepts(char *argv[])
+{
+    for (int i = 1; argv[i] != NULL; i++)
+    {
+        if (argv[i][0] == '-' && argv[i][1] != '\0')
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* cat [file ...]: copy each file (stdin for none or
+   -) to stdout. Bytes are moved inside the kernel 
+   wherever the fd types allow it: splice when either
+   side is a pipe, copy_file_range between regular 
+   files and sendfile from a regular file, with 
+   read/write as the fallback. */
+
+int builtin_cat(char *argv[])
+{
+    int status = EXIT_SUCCESS;
+
+    fflush(stdout);
+    if (argv[1] == NULL)
+    {
+        if (copy_fd(STDIN_FILENO, STDOUT_FILENO) < 0)
+        {
+            fprintf(stderr, "cat: %s\n", strerror(errno));
+            status = EXIT_FAILURE;
+        }
+        return status;
+    }
+
+    for (int i = 1; argv[i] != NULL; i++)
+    {
+        int is_stdin = (strcmp(argv[i], "-") == 0);
+        int fd = is_stdin ? STDIN_FILENO : open(argv[i], O_RDONLY | O_CLOEXEC);
+
+        if (fd < 0)
+        {
+            fprintf(stderr, "cat: %s: %s\n", argv[i], strerror(errno));
+            status = EXIT_FAILURE;
+            continue;
+        }
+        if (copy_fd(fd, STDOUT_FILENO) < 0)
+        {
+            fprintf(stderr, "cat: %s: %s\n", argv[i], strerror(errno));
+            status = EXIT_FAILURE;
+        }
+        if (!is_stdin)
+        {
+            close(fd);
+        }
+    }
+    return status;
+}
+
+/* Copy everything from in_fd to out_fd with the 
+   cheapest method the two fd types support. Returns
+   0 on success, or -1 with errno set. */
+
+int copy_fd(int in_fd, int out_fd)
+{
+    struct stat in_st, out_st;
+    int result = COPY_UNSUPPORTED;
+
+    if (fstat(in_fd, &in_st) < 0 || fstat(out_fd, &out_st) < 0)
+    {
+        return -1;
+    }
+    if (S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode))
+    {
+        result = copy_with(COPY_SPLICE, in_fd, out_fd);
+    }
+    if (result == COPY_UNSUPPORTED && S_ISREG(in_st.st_mode) && S_ISREG(out_st.st_mode))
+    {
+        result = copy_with(COPY_RANGE, in_fd, out_fd);
+    }
+    if (result == COPY_UNSUPPORTED && S_ISREG(in_st.st_mode))
+    {
+        result = copy_with(COPY_SENDFILE, in_fd, out_fd);
+    }
+    if (result == COPY_UNSUPPORTED)
+    {
+        result = copy_with(COPY_READ_WRITE, in_fd, out_fd);
+    }
+    return (result == COPY_DONE) ? 0 : -1;
+}
+
+/* Copy in_fd to out_fd with one method, in chunks of
+   COPY_CHUNK bytes, until end of input. Returns 
+   COPY_DONE, COPY_ERROR, or COPY_UNSUPPORTED if the 
+   method was refused before anything was copied. */
+
+int copy_with(int method, int in_fd, int out_fd)
+{
+    static char buf[COPY_BUF_SIZE];
+    int copied = 0;
+
+    while (1)
+    {
+        ssize_t bytes;
+
+        switch (method)
+        {
+            case COPY_SPLICE:
+                bytes = splice(in_fd, NULL, out_fd, NULL, COPY_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+                break;
+            case COPY_RANGE:
+                bytes = copy_file_range(in_fd, NULL, out_fd, NULL, COPY_CHUNK, 0);
+                break;
+            case COPY_SENDFILE:
+                bytes = sendfile(out_fd, in_fd, NULL, COPY_CHUNK);
+                break;
+            default:
+                if ((bytes = read(in_fd, buf, sizeof(buf))) > 0)
+                {
+                    for (ssize_t done = 0, written; done < bytes; done += written)
+                    {
+                        if ((written = write(out_fd, buf + done, bytes - done)) < 0)
+                        {
+                            if (errno == EINTR)
+                            {
+                                written = 0;
+                                continue;
+                            }
+                            return COPY_ERROR;
+                        }
+                    }
+                }
+                break;
+        }
+
+        if (bytes == 0)
+        {
+            return COPY_DONE;
+        }
+        if (bytes < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (!copied && (errno == EINVAL || errno == ENOSYS || errno == EXDEV || errno == EBADF || errno == EOPNOTSUPP))
+            {
+                return COPY_UNSUPPORTED;
+            }
+            return COPY_ERROR;
+        }
+        copied = 1;
+    }
+}
+
+/* Builtin set: with no arguments, print every shell 
+   option; otherwise apply each name=value argument. */
+
+int builtin_set(char *argv[])
+{
+    int status = EXIT_SUCCESS;
+    struct shell_option *option;
+    char *value;
+
+    if (argv[1] == NULL)
+    {
+        for (option = shell_options; option->name != NULL; option++)
+        {
+            option->show();
+        }
+        return EXIT_SUCCESS;
+    }
+
+    for (int i = 1; argv[i] != NULL; i++)
+    {
+        if ((value = strchr(argv[i], '=')) == NULL)
+        {
+            fprintf(stderr, "set: usage: set [name=value ...]\n");
+            return TEST_ERROR;
+        }
+        for (option = shell_options; option->name != NULL; option++)
+        {
+            if (strncmp(option->name, argv[i], value - argv[i]) == 0 && option->name[value - argv[i]] == '\0')
+            {
+                break;
+            }
+        }
+        if (option->name == NULL)
+        {
+            fprintf(stderr, "set: %.*s: unknown option\n", (int) (value - argv[i]), argv[i]);
+            status = EXIT_FAILURE;
+        }
+        else if (option->set(value + 1) < 0)
+        {
+            fprintf(stderr, "set: %s: invalid value\n", argv[i]);
+            status = EXIT_FAILURE;
+        }
+        else
+        {
+            option->show();
+        }
+    }
+    return status;
+}
+
+/* export [name[=value]...]: mark each variable for 
+   the environment of commands, first setting it to 
+   value if given (an unset name is exported empty). 
+   With no arguments, list the exported variables. */
+
+int builtin_export(char *argv[])
+{
+    int status = EXIT_SUCCESS;
+
+    if (argv[1] == NULL)
+    {
+        char **sorted = arena_alloc(&line_arena, (num_exported + 1) * sizeof(char *));
+
+        memcpy(sorted, env_cache, (num_exported + 1) * sizeof(char *));
+        qsort(sorted, num_exported, sizeof(char *), var_order);
+        for (int i = 0; i < num_exported; i++)
+        {
+            printf("export %s\n", sorted[i]);
+        }
+        return EXIT_SUCCESS;
+    }
+    for (int i = 1; argv[i] != NULL; i++)
+    {
+        int name_len = name_length(argv[i]);
+        char *value = argv[i] + name_len;
+        struct var *var;
+
+        if (name_len == 0 || (*value != '=' && *value != '\0'))
+        {
+            fprintf(stderr, "export: %s: not a valid name\n", argv[i]);
+            status = EXIT_FAILURE;
+            continue;
+        }
+        if (*value == '\0')
+        {
+            var = var_find(argv[i], name_len);
+            value = (var == NULL) ? "" : var->value;
+        }
+        else
+        {
+            value++;
+        }
+        if (var_set(argv[i], name_len, value, 1) < 0)
+        {
+            status = EXIT_FAILURE;
+        }
+    }
+    return status;
+}
+
+/* Order environment entries by name for export. */
+
+int var_order(const void *a, const void *b)
+{
+    return strcmp(*(char **) a, *(char **) b);
+}
+
+/* unset name...: remove each variable. */
+
+int builtin_unset(char *argv[])
+{
+    for (int i = 1; argv[i] != NULL; i++)
+    {
+        var_unset(argv[i], strlen(argv[i]));
+    }
+    return EXIT_SUCCESS;
+}
+
+/* Set the capacity given to every pipe the shell 
+   creates: a size such as 65536, 256K or 1M, or 
+   "default" for the kernel's default capacity. */
+
+int set_pipesize(char *value)
+{
+    int size;
+
+    if (strcmp(value, "default") == 0)
+    {
+        size = PIPESIZE_DEFAULT;
+    }
+    else if (parse_size(value, &size) < 0)
+    {
+        return -1;
+    }
+    pipe_size_request = size;
+    pipe_size_warned = 0;
+    return 0;
+}
+
+/* Print the pipesize option with the capacity a new 
+   pipe actually gets, measured on a probe pipe. The 
+   kernel rounds sizes up to a power-of-two number of 
+   pages and caps them at /proc/sys/fs/pipe-max-size. */
+
+void show_pipesize()
+{
+    int probe[2];
+    int achieved = 0;
+
+    if (pipe(probe) == 0)
+    {
+        if (pipe_size_request == PIPESIZE_DEFAULT || (achieved = fcntl(probe[1], F_SETPIPE_SZ, pipe_size_request)) < 0)
+        {
+            achieved = pipe_size_get(probe[1]);
+        }
+        close_pipes(probe);
+    }
+    if (pipe_size_request == PIPESIZE_DEFAULT)
+    {
+        printf("pipesize=default (achieved %d)\n", achieved);
+    }
+    else
+    {
+        printf("pipesize=%d (achieved %d)\n", pipe_size_request, achieved);
+    }
+}
+
+/* Builtin history: list every entry with its number,
+   or only the last n with history n. */
+
+int builtin_history(char *argv[])
+{
+    size_t first = 1;
+    size_t len;
+    char *entry;
+    char *end;
+    long num;
+
+    if (argv[1] != NULL)
+    {
+        num = strtol(argv[1], &end, 10);
+        if (*end != '\0' || num < 0 || argv[2] != NULL)
+        {
+            fprintf(stderr, "history: usage: history [n]\n");
+            return TEST_ERROR;
+        }
+        if ((size_t) num < history.count)
+        {
+            first = history.count - num + 1;
+        }
+    }
+    for (size_t i = first; i <= history.count; i++)
+    {
+        entry = history_entry(i, &len);
+        printf("%5zu  %.*s\n", i, (int) len, entry);
+    }
+    return EXIT_SUCCESS;
+}
+
+/* Builtin jobs: list every background or stopped job
+   with its state, and -l adds its process group. 
+   Finished jobs are listed once and then freed. */
+
+int builtin_jobs(char *argv[])
+{
+    int show_pgid = (argv[1] != NULL && strcmp(argv[1], "-l") == 0);
+
+    event_poll();
+    for (int i = 0; i < num_jobs; i++)
+    {
+        struct job *job = job_table[i];
+
+        if (job->state == JOB_FREE || !job->background)
+        {
+            continue;
+        }
+        if (show_pgid)
+        {
+            printf("%d ", (int) job->pgid);
+        }
+        job_report(job, job_state(job));
+        job->notified = 1;
+        if (job->state == JOB_DONE)
+        {
+            report_pipeline(job->command, job->procs, job->num_procs, &job->start, job->timed, job->pipe_size);
+            job_free(job);
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/* Builtin fg: continue a job in the foreground and 
+   wait for it, returning its status. */
+
+int builtin_fg(char *argv[])
+{
+    struct job *job;
+
+    if (!job_control)
+    {
+        fprintf(stderr, "fg: no job control\n");
+        return EXIT_FAILURE;
+    }
+    if ((job = job_find(argv[1], "fg")) == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+    printf("%s\n", job->command);
+    fflush(stdout);
+    job_continue(job, 0);
+    return last_status;
+}
+
+/* Builtin bg: continue each stopped job named, or the
+   current one, in the background. */
+
+int builtin_bg(char *argv[])
+{
+    int status = EXIT_SUCCESS;
+    int i = 1;
+
+    if (!job_control)
+    {
+        fprintf(stderr, "bg: no job control\n");
+        return EXIT_FAILURE;
+    }
+    do
+    {
+        struct job *job = job_find(argv[i], "bg");
+
+        if (job == NULL)
+        {
+            status = EXIT_FAILURE;
+        }
+        else
+        {
+            job_continue(job, 1);
+            printf("[%d] %s &\n", job->id, job->command);
+        }
+    } while (argv[i] != NULL && argv[++i] != NULL);
+    return status;
+}
+
+/* Builtin kill: send a signal (TERM unless -sig, -s 
+   sig or -n num is given) to each pid, or to the 
+   process group of each %job. A stopped job is also
+   continued so it can act on the signal. kill -l 
+   lists the signal names. */
+
+int builtin_kill(char *argv[])
+{
+    int status = EXIT_SUCCESS;
+    int sig = SIGTERM;
+    int i = 1;
+
+    if (argv[1] != NULL && strcmp(argv[1], "-l") == 0)
+    {
+        for (struct signal_name *name = signal_names; name->name != NULL; name++)
+        {
+            printf("%2d) SIG%s\n", name->number, name->name);
+        }
+        return EXIT_SUCCESS;
+    }
+    if (argv[1] != NULL && (strcmp(argv[1], "-s") == 0 || strcmp(argv[1], "-n") == 0))
+    {
+        sig = (argv[2] != NULL) ? parse_signal(argv[2]) : -1;
+        i = 3;
+    }
+    else if (argv[1] != NULL && argv[1][0] == '-' && argv[1][1] != '\0')
+    {
+        sig = parse_signal(argv[1] + 1);
+        i = 2;
+    }
+    if (sig < 0 || argv[i] == NULL)
+    {
+        fprintf(stderr, "kill: usage: kill [-s sig | -sig] pid | %%job ...\n");
+        return TEST_ERROR;
+    }
+
+    for (; argv[i] != NULL; i++)
+    {
+        if (argv[i][0] == '%')
+        {
+            struct job *job = job_find(argv[i], "kill");
+
+            if (job == NULL)
+            {
+                status = EXIT_FAILURE;
+            }
+            else if (kill(-job->pgid, sig) < 0)
+            {
+                fprintf(stderr, "kill: %s: %s\n", argv[i], strerror(errno));
+                status = EXIT_FAILURE;
+            }
+            else if (job->state == JOB_STOPPED && sig != SIGSTOP && sig != SIGTSTP && sig != SIGCONT)
+            {
+                kill(-job->pgid, SIGCONT);
+            }
+        }
+        else
+        {
+            char *end;
+            long pid = strtol(argv[i], &end, 10);
+
+            if (*end != '\0' || end == argv[i])
+            {
+                fprintf(stderr, "kill: %s: arguments must be process or job IDs\n", argv[i]);
+                status = EXIT_FAILURE;
+            }
+            else if (kill(pid, sig) < 0)
+            {
+                fprintf(stderr, "kill: (%ld): %s\n", pid, strerror(errno));
+                status = EXIT_FAILURE;
+            }
+        }
+    }
+    return status;
+}
+
+/* Signal number for a name such as TERM, SIGTERM or 
+   15, or -1 if there is none. */
+
+int parse_signal(char *name)
+{
+    char *end;
+    long number = strtol(name, &end, 10);
+
+    if (*end == '\0' && end != name)
+    {
+        return (number >= 0 && number < NSIG) ? (int) number : -1;
+    }
+    if (strncasecmp(name, "SIG", 3) == 0)
+    {
+        name += 3;
+    }
+    for (struct signal_name *signal = signal_names; signal->name != NULL; signal++)
+    {
+        if (strcasecmp(signal->name, name) == 0)
+        {
+            return signal->number;
+        }
+    }
+    return -1;
 }
 
-/* Redirect input or output for a command depending 
-   on the given mode. If exec_redirection is 0, command
-   may point to NULL. Else, the file for I/O redirection
-   will be opened, the command run with redirection, and 
-   the file will be closed. If exec_redirection is 0 and
-   mode is any output mode, the corresponding io_file will
-   be opened, created if it does not yet exist, and closed,  */
+/* Set where pipeline stages run: "none", a CPU list 
+   such as 0-3,8 or node:N (every stage may use those 
+   CPUs), or compact[:cpus], which pins each stage to 
+   one CPU of the set (by default every CPU the shell 
+   may use) so that neighbouring stages share a core's
+   caches, and then a package's. CPUs the shell may not
+   use are dropped from the set. */
 
-void redirect_io(int mode, char *command[], char *io_file, int exec_redirection)
+int set_affinity(char *value)
 {
-    int flags = O_WRONLY | O_CREAT; 
-    int io_file_fd;
-    
-    if (mode == INPUT)
+    struct placement place = {PLACE_SET};
+    struct cpu_place *places;
+    cpu_set_t allowed;
+    long node;
+    char *end;
+
+    if (strcmp(value, "none") == 0)
+    {
+        free(placement.order);
+        placement.order = NULL;
+        placement.mode = PLACE_NONE;
+        return 0;
+    }
+    if (strncmp(value, "compact", 7) == 0 && (value[7] == '\0' || value[7] == ':'))
+    {
+        place.mode = PLACE_COMPACT;
+        value += 7 + (value[7] == ':');
+    }
+    if (place.mode == PLACE_COMPACT && *value == '\0')
     {
-        if (!exec_redirection)
+        CPU_ZERO(&place.cpus);
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
         {
-            return;
+            CPU_SET(cpu, &place.cpus);
+        }
+    }
+    else if (strncmp(value, "node:", 5) == 0)
+    {
+        char path[MAX_PATH];
+
+        node = strtol(value + 5, &end, 10);
+        if (end == value + 5 || *end != '\0' || node < 0)
+        {
+            return -1;
+        }
+        snprintf(path, sizeof(path), NODE_SYSFS, (int) node);
+        if (read_cpu_list(path, &place.cpus) < 0)
+        {
+            return -1;
         }
-        flags = O_RDONLY;
     }
-    else if (mode == OUTPUT)
+    else if (parse_cpu_list(value, &place.cpus) < 0)
     {
-        flags = flags | O_TRUNC;
+        return -1;
     }
-    else if (mode == OUTPUT_APPEND)
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
     {
-        flags = flags | O_APPEND;
+        CPU_AND(&place.cpus, &place.cpus, &allowed);
+    }
+    if (CPU_COUNT(&place.cpus) == 0)
+    {
+        return -1;
     }
 
-    /* Open, execute (if exec_redirection), and close.*/
-    if ((io_file_fd = open(io_file, flags, 0666)) < 0)
+    place.num_cpus = CPU_COUNT(&place.cpus);
+    if ((place.order = malloc(place.num_cpus * sizeof(int))) == NULL
+        || (places = malloc(place.num_cpus * sizeof(struct cpu_place))) == NULL)
     {
-        perror("open()");
-        return;
+        perror_exit("malloc()");
     }
-    if (exec_redirection)
+    for (int cpu = 0, n = 0; n < place.num_cpus; cpu++)
     {
-        exec_command(mode, command, io_file_fd);
+        if (CPU_ISSET(cpu, &place.cpus))
+        {
+            places[n].cpu = cpu;
+            places[n].package = (place.mode == PLACE_COMPACT) ? read_topology(cpu, "physical_package_id") : 0;
+            places[n].core = (place.mode == PLACE_COMPACT) ? read_topology(cpu, "core_id") : cpu;
+            n++;
+        }
     }
-    if (close(io_file_fd) < 0)
+    qsort(places, place.num_cpus, sizeof(struct cpu_place), cpu_place_order);
+    for (int n = 0; n < place.num_cpus; n++)
     {
-        perror("close()");
+        place.order[n] = places[n].cpu;
     }
+    free(places);
+
+    free(placement.order);
+    placement = place;
+    return 0;
 }
 
-/* Redirect input, then output, assuming no pipes.
-   Will accept commands in the form of:
-   program < input_file > output_file 
-   Input redirection may only occur once, but
-   output redirection may be of either type and
-   can take in as many output files as needed, with
-   the only file being written to being the final one. */
+/* Print the affinity option with the CPUs it uses, in
+   stage order for compact. */
 
-void exec_redir_bothio(int output_mode, char *command[], char *input_file, char *output_file)
+void show_affinity()
 {
-    pid_t child_pid;
-    int input_fd, output_fd;
-    int output_flags = O_WRONLY | O_CREAT;
+    if (placement.mode == PLACE_NONE)
+    {
+        printf("affinity=none\n");
+        return;
+    }
+    printf("affinity=%s", (placement.mode == PLACE_COMPACT) ? "compact " : "");
+    print_cpu_list(placement.order, placement.num_cpus);
+    printf("\n");
+}
 
-    if ((child_pid = fork()) == -1)
+/* Set the nice value every command starts with, from
+   -20 to 19, or "default" to inherit the shell's. */
+
+int set_nice(char *value)
+{
+    char *end;
+    long nice;
+
+    if (strcmp(value, "default") == 0)
     {
-        perror("fork()");
+        nice_request = NICE_DEFAULT;
+        return 0;
     }
-    else if (child_pid == 0)
+    nice = strtol(value, &end, 10);
+    if (end == value || *end != '\0' || nice < -20 || nice > 19)
     {
-        /* Get correct flags for output. */
-        (output_mode == OUTPUT_APPEND) ? (output_flags = output_flags | O_APPEND) : (output_flags = output_flags | O_TRUNC); 
+        return -1;
+    }
+    nice_request = (int) nice;
+    return 0;
+}
 
-        /* Open files, redirect input and output, then execute. */
-        if ((input_fd = open(input_file, O_RDONLY, 0666)) < 0)
-        {
-            perror_exit("open()");
-        }
-        if ((output_fd = open(output_file, output_flags, 0666)) < 0)
-        {
-            perror_exit("open()");
-        }
-        if (dup2(input_fd, STDIN_FILENO) < 0)
-        {
-            perror_exit("dup2()");
-        }
-        if (dup2(output_fd, STDOUT_FILENO) < 0)
-        {
-            perror_exit("dup2()");
-        }
-        if (close(input_fd) < 0)
-        {
-            perror_exit("close()");
-        }
-        if (close(output_fd) < 0)
-        {
-            perror_exit("close()");
-        }
-        execvp_and_handle_error(command[0], command);
+/* Print the nice option. */
+
+void show_nice()
+{
+    if (nice_request == NICE_DEFAULT)
+    {
+        printf("nice=default\n");
     }
     else
     {
-        wait(NULL);
+        printf("nice=%d\n", nice_request);
     }
 }
 
-/* Execute the first piped command. */
+/* Set the I/O scheduling class every command starts 
+   with: "none" to inherit the shell's, idle, or 
+   best-effort or realtime with an optional level from
+   0 (highest) to 7, as in best-effort:7. */
 
-void input_pipe(int *pipe_fds, char *pipe_cmd[])
+int set_ionice(char *value)
 {
-    pid_t child_pid; 
+    char *level = strchr(value, ':');
+    size_t len = (level != NULL) ? (size_t) (level - value) : strlen(value);
+    long data = 4;
+    int class;
+    char *end;
 
-    /* Create first pipe. */
-    if (pipe(pipe_fds) < 0)
+    if (strcmp(value, "none") == 0)
     {
-        perror_exit("pipe()");
+        ioprio_request = IOPRIO_NONE;
+        return 0;
     }
-
-    /* Fork. */
-    if ((child_pid = fork()) < 0)
+    if (len == 4 && strncmp(value, "idle", len) == 0 && level == NULL)
     {
-        perror("fork()");
+        class = IOPRIO_CLASS_IDLE;
+        data = 0;
+    }
+    else if (len == 11 && strncmp(value, "best-effort", len) == 0)
+    {
+        class = IOPRIO_CLASS_BE;
+    }
+    else if (len == 8 && strncmp(value, "realtime", len) == 0)
+    {
+        class = IOPRIO_CLASS_RT;
+    }
+    else
+    {
+        return -1;
     }
-    else if (child_pid == 0)
+    if (level != NULL)
     {
-        /* Child process dups stdout, closes, and executes. */
-        if (dup2(pipe_fds[1], STDOUT_FILENO) < 0)
+        data = strtol(level + 1, &end, 10);
+        if (end == level + 1 || *end != '\0' || data < 0 || data > 7)
         {
-            perror_exit("dup2()");
+            return -1;
         }
-        close_pipes(pipe_fds);
-        execvp_and_handle_error(pipe_cmd[0], pipe_cmd);
+    }
+    ioprio_request = (class << IOPRIO_CLASS_SHIFT) | (int) data;
+    return 0;
+}
+
+/* Print the ionice option. */
+
+void show_ionice()
+{
+    int class = ioprio_request >> IOPRIO_CLASS_SHIFT;
+
+    if (ioprio_request == IOPRIO_NONE)
+    {
+        printf("ionice=none\n");
+    }
+    else if (class == IOPRIO_CLASS_IDLE)
+    {
+        printf("ionice=idle\n");
     }
     else
     {
-        wait(NULL);
+        printf("ionice=%s:%d\n", (class == IOPRIO_CLASS_RT) ? "realtime" : "best-effort", ioprio_request & 7);
     }
 }
 
-/* Execute any intermediary piped commands. */
+/* Set the size of the buffer stage put in front of 
+   output files: a size such as 65536, 256K or 1M, 
+   optionally followed by ",direct" to write truncated 
+   files with O_DIRECT and ",tee" to send one fd's 
+   output to every file it is redirected to, or 
+   "default" for no stage. */
 
-void inter_pipe(int *pipe_fds, char *pipe_cmd[])
+int set_outbuf(char *value)
 {
-    pid_t child_pid; 
-    int input_pipe_fds[2];
-
-    /* Save old pipe to input_pipe_fds. */
-    input_pipe_fds[0] = pipe_fds[0];
-    input_pipe_fds[1] = pipe_fds[1];
+    size_t len = strcspn(value, ",");
+    char digits[32];
+    int direct = 0, tee = 0;
+    int size;
 
-    /* Create new pipe. */
-    if (pipe(pipe_fds) < 0)
+    if (strcmp(value, "default") == 0)
     {
-        perror_exit("pipe()");
+        outbuf_size = OUTBUF_DEFAULT;
+        outbuf_direct = outbuf_tee = 0;
+        return 0;
     }
-
-    /* Fork. */
-    if ((child_pid = fork()) < 0)
+    if (len >= sizeof(digits))
     {
-        perror("fork()");
+        return -1;
+    }
+    memcpy(digits, value, len);
+    digits[len] = '\0';
+    if (parse_size(digits, &size) < 0 || size == 0)
+    {
+        return -1;
     }
-    else if (child_pid == 0)
+    for (char *flag = value + len; *flag == ','; flag += len)
     {
-        /* Child process dups stdin and stdout, closes, then executes. */
-        if (dup2(input_pipe_fds[0], STDIN_FILENO) < 0)
+        len = strcspn(++flag, ",");
+        if (len == strlen(OUTBUF_DIRECT) && strncmp(flag, OUTBUF_DIRECT, len) == 0)
         {
-            perror_exit("dup2()");
+            direct = 1;
         }
-        if (dup2(pipe_fds[1], STDOUT_FILENO) < 0)
+        else if (len == strlen(OUTBUF_TEE) && strncmp(flag, OUTBUF_TEE, len) == 0)
         {
-            perror_exit("dup2()");
+            tee = 1;
         }
-        close_pipes(input_pipe_fds);
-        close_pipes(pipe_fds);
-        execvp_and_handle_error(pipe_cmd[0], pipe_cmd);
+        else
+        {
+            return -1;
+        }
+    }
+    outbuf_size = size;
+    outbuf_direct = direct;
+    outbuf_tee = tee;
+    return 0;
+}
+
+/* Print the outbuf option. */
+
+void show_outbuf()
+{
+    if (outbuf_size == OUTBUF_DEFAULT)
+    {
+        printf("outbuf=default\n");
     }
     else
     {
-        /* Parent closes input pipe and waits once. */
-        close_pipes(input_pipe_fds);
-        wait(NULL);
+        printf("outbuf=%d%s%s%s%s\n", outbuf_size, outbuf_direct ? "," : "", outbuf_direct ? OUTBUF_DIRECT : "",
+               outbuf_tee ? "," : "", outbuf_tee ? OUTBUF_TEE : "");
     }
 }
 
-/* Execute the final piped command. */
+/* break [n] and continue [n]: leave the nth enclosing
+   loop, or go on with its next iteration. The loops 
+   are unwound by execute_list once this returns. */
 
-void output_pipe(int *pipe_fds, char *pipe_cmd[])
+int builtin_break(char *argv[])
 {
-    pid_t child_pid;
+    int count = (argv[1] != NULL) ? atoi(argv[1]) : 1;
 
-    /* Fork. */
-    if ((child_pid = fork()) < 0)
+    if (loop_depth == 0)
     {
-        perror("fork()");
+        fprintf(stderr, "%s: only meaningful in a loop.\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (count < 1)
+    {
+        fprintf(stderr, "%s: bad loop count '%s'.\n", argv[0], argv[1]);
+        return EXIT_FAILURE;
     }
-    else if (child_pid == 0)
+    unwind_type = (strcmp(argv[0], "break") == 0) ? UNWIND_BREAK : UNWIND_CONTINUE;
+    unwind_count = (count < loop_depth) ? count : loop_depth;
+    return EXIT_SUCCESS;
+}
+
+/* return [n]: leave the function being run with 
+   status n, or the status of the last command. */
+
+int builtin_return(char *argv[])
+{
+    if (function_depth == 0)
+    {
+        fprintf(stderr, "return: not in a function.\n");
+        return EXIT_FAILURE;
+    }
+    unwind_type = UNWIND_RETURN;
+    return (argv[1] != NULL) ? atoi(argv[1]) & 0xff : last_status;
+}
+
+/* shift [n]: drop the first n positional parameters
+   (1 by default). */
+
+int builtin_shift(char *argv[])
+{
+    int count = (argv[1] != NULL) ? atoi(argv[1]) : 1;
+
+    if (count < 0 || count > num_positional)
+    {
+        fprintf(stderr, "shift: count out of range.\n");
+        return EXIT_FAILURE;
+    }
+    positional += count;
+    num_positional -= count;
+    return EXIT_SUCCESS;
+}
+
+/* read [-r] [-u fd] [name...]: read one line from fd
+   (stdin by default) and give its blank-separated 
+   words to the names in turn, the last name taking the
+   rest of the line, or the whole line to REPLY if no 
+   name is given. Backslashes are not special, as with 
+   -r. A seekable fd is read in blocks and its offset 
+   put back after the line; anything else, such as a 
+   coprocess's output, a byte at a time, so that what 
+   follows the line is left for the next read. Returns
+   1 at end of input with nothing read. */
+
+int builtin_read(char *argv[])
+{
+    size_t len = 0, cap = 2 * READ_CHUNK;
+    char *line = arena_alloc(&line_arena, cap);
+    int fd = STDIN_FILENO, seekable, i = 1;
+    char *end, **names;
+    ssize_t n;
+
+    for (; argv[i] != NULL && argv[i][0] == '-'; i++)
     {
-        /* Child process dups stdin, closes, then executes to stdout. */
-        if (dup2(pipe_fds[0], STDIN_FILENO) < 0)
+        if (strcmp(argv[i], "-u") == 0 && argv[i + 1] != NULL && (fd = parse_fd(argv[i + 1])) >= 0)
         {
-            perror_exit("dup2()");
+            i++;
+        }
+        else if (strcmp(argv[i], "-r") != 0)
+        {
+            fprintf(stderr, "Usage: read [-r] [-u fd] [name...]\n");
+            return EXIT_FAILURE;
         }
-        close_pipes(pipe_fds);
-        execvp_and_handle_error(pipe_cmd[0], pipe_cmd);
     }
-    else
+    names = &argv[i];
+    for (i = 0; names[i] != NULL; i++)
     {
-        /* Parent closes final pipe and waits once. */
-        close_pipes(pipe_fds);
-        wait(NULL);
+        if (name_length(names[i]) != (int) strlen(names[i]))
+        {
+            fprintf(stderr, "read: bad variable name '%s'.\n", names[i]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    seekable = lseek(fd, 0, SEEK_CUR) >= 0;
+    while (1)
+    {
+        if (len + READ_CHUNK >= cap)
+        {
+            line = arena_grow(&line_arena, line, cap, cap * 2);
+            cap *= 2;
+        }
+        if ((n = read(fd, line + len, seekable ? READ_CHUNK : 1)) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("read()");
+            return EXIT_FAILURE;
+        }
+        if (n == 0)
+        {
+            break;
+        }
+        if ((end = memchr(line + len, '\n', n)) != NULL)
+        {
+            if (seekable && lseek(fd, end + 1 - (line + len + n), SEEK_CUR) < 0)
+            {
+                perror("lseek()");
+            }
+            len = end - line;
+            break;
+        }
+        len += n;
+    }
+    line[len] = '\0';
+
+    if (names[0] == NULL)
+    {
+        var_set("REPLY", strlen("REPLY"), line, 0);
+    }
+    for (i = 0; names[i] != NULL; i++)
+    {
+        char *word = line + strspn(line, " \t");
+
+        line = (names[i + 1] == NULL) ? word + strlen(word) : word + strcspn(word, " \t");
+        if (names[i + 1] == NULL)
+        {
+            while (line > word && (line[-1] == ' ' || line[-1] == '\t'))
+            {
+                line--;
+            }
+        }
+        if (*line != '\0')
+        {
+            *line++ = '\0';
+        }
+        var_set(names[i], strlen(names[i]), word, 0);
     }
+    return (n == 0 && len == 0) ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
-/* Execute the first piped command with 
-   input redirection. */
+/* Run the shell function argv[0], found for it by 
+   find_builtin. */
 
-void input_pipe_redirect(int *pipe_fds, char *input_cmd[], char *input_file)
+int builtin_function(char *argv[])
 {
-    pid_t child_pid; 
-    int input_fd;
+    return function_call(function_find(argv[0]), argv);
+}
 
-    /* Pipe fds. */
-    if (pipe(pipe_fds) < 0)
+/* Builtin parallel: parallel [-j n] [-k] command 
+   [arg...] ::: input... runs command once per input, 
+   with the input in place of each {} argument or, 
+   without one, appended. Inputs are read one per line
+   from stdin when there is no :::. Every task belongs 
+   to a single job and at most n (by default one per 
+   online CPU) are in flight; a free slot is refilled 
+   as soon as the event loop reaps a task. With 
+   -k, each task's output goes to its own memfd and is
+   copied to stdout in input order, as soon as every 
+   earlier task has finished. -j n may also be written
+   -jn; any other option is a usage error. Returns the
+   number of failed tasks, capped at 101. */
+
+int builtin_parallel(char *argv[])
+{
+    int slots = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    int keep_order = 0, failed = 0, interrupted = 0;
+    int count = 0, next = 0, next_output = 0, scan = 0;
+    int *outputs = NULL;
+    char **command, **inputs;
+    struct job *job;
+    size_t len = 0;
+    char *text;
+    int i = 1;
+
+    for (; argv[i] != NULL && argv[i][0] == '-'; i++)
     {
-        perror_exit("pipe()");
+        if (strcmp(argv[i], "-k") == 0)
+        {
+            keep_order = 1;
+        }
+        else if (strcmp(argv[i], "-j") == 0 && argv[i + 1] != NULL && (slots = atoi(argv[i + 1])) > 0)
+        {
+            i++;
+        }
+        else if (strncmp(argv[i], "-j", 2) == 0 && (slots = atoi(argv[i] + 2)) > 0)
+        {
+            continue;
+        }
+        else
+        {
+            /* An unknown option is a usage error, not the command. */
+            slots = 0;
+            break;
+        }
+    }
+    command = &argv[i];
+    while (argv[i] != NULL && strcmp(argv[i], PARALLEL_SEPARATOR) != 0)
+    {
+        i++;
+    }
+    if (command[0] == NULL || command == &argv[i] || slots <= 0)
+    {
+        fprintf(stderr, "parallel: usage: parallel [-j n] [-k] command [arg...] [::: input...]\n");
+        return TEST_ERROR;
+    }
+    if (argv[i] != NULL)
+    {
+        argv[i] = NULL;
+        inputs = &argv[i + 1];
+        while (inputs[count] != NULL)
+        {
+            count++;
+        }
+    }
+    else if ((inputs = parallel_read_args(&count)) == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+    if (count == 0)
+    {
+        return EXIT_SUCCESS;
     }
 
-    /* Fork. */
-    if ((child_pid = fork()) < 0)
+    for (int j = 0; command[j] != NULL; j++)
     {
-        perror("fork()");
+        len += strlen(command[j]) + 1;
+    }
+    if ((text = malloc(len + strlen("parallel "))) == NULL || (keep_order && (outputs = malloc(count * sizeof(int))) == NULL))
+    {
+        perror_exit("malloc()");
+    }
+    strcpy(text, "parallel");
+    for (int j = 0; command[j] != NULL; j++)
+    {
+        strcat(strcat(text, " "), command[j]);
+    }
+    job = job_create(text, strlen(text), 0);
+    free(text);
+    if (job == NULL)
+    {
+        free(outputs);
+        return EXIT_FAILURE;
     }
-    else if (child_pid == 0)
+
+    fflush(stdout);
+    while (job->state != JOB_STOPPED)
     {
-        /* Child process dups stdout, closes, and executes. */
-        if ((input_fd = open(input_file, O_RDONLY, 0666)) < 0)
+        /* Fill every free slot, then sleep until a task is reaped. */
+        while (!interrupted && next < count && job->num_live < slots)
         {
-            perror_exit("open()");
+            int out_fd = STDOUT_FILENO;
+
+            if (keep_order && (out_fd = outputs[next] = memfd_create("parallel", 0)) < 0)
+            {
+                perror("memfd_create()");
+                out_fd = outputs[next] = STDOUT_FILENO;
+            }
+            interrupted = (parallel_spawn(job, command, inputs[next], out_fd) < 0);
+            next++;
         }
-        if (dup2(input_fd, STDIN_FILENO) < 0)
+        if (job->num_live == 0)
         {
-            perror_exit("dup2()");
+            break;
         }
-        if (dup2(pipe_fds[1], STDOUT_FILENO) < 0)
+        event_wait(-1, -1, NULL);
+
+        /* Stop starting tasks once one is interrupted. Only 
+           tasks past the oldest unfinished one need a look. */
+        for (int j = scan; j < job->num_procs; j++)
         {
-            perror_exit("dup2()");
+            int status = job->procs[j].status;
+
+            interrupted |= (job->procs[j].done && WIFSIGNALED(status) && WTERMSIG(status) == SIGINT);
+        }
+        while (scan < job->num_procs && job->procs[scan].done)
+        {
+            scan++;
+        }
+        if (keep_order)
+        {
+            parallel_emit(job, outputs, &next_output);
         }
-        close_pipes(pipe_fds);
-        execvp_and_handle_error(input_cmd[0], input_cmd);
     }
-    else
+    if (keep_order)
+    {
+        parallel_emit(job, outputs, &next_output);
+    }
+
+    for (int j = 0; j < job->num_procs; j++)
+    {
+        failed += (job->procs[j].done && job->procs[j].status != 0);
+    }
+    failed += count - job->num_procs;
+    if (keep_order)
     {
-        wait(NULL);
+        for (; next_output < next; next_output++)
+        {
+            if (outputs[next_output] != STDOUT_FILENO)
+            {
+                close(outputs[next_output]);
+            }
+        }
+        free(outputs);
     }
+    job_wait(job);
+    return (failed < PARALLEL_MAX_FAILED) ? failed : PARALLEL_MAX_FAILED;
 }
 
-/* Execute the final piped command
-   with output redirection. */
+/* Read parallel's inputs from stdin, one per line, 
+   into a single malloc'd block that stays allocated
+   until the next call. Returns NULL on a read error. */
 
-void output_pipe_redirect(int *pipe_fds, int output_mode, char *output_cmd[], char *output_file)
+char **parallel_read_args(int *count)
 {
-    pid_t child_pid;
-    int flags = O_CREAT | O_WRONLY;
-    int output_fd; 
+    static char *data;
+    static char **lines;
+    size_t size = 0, cap = 0;
+    ssize_t got;
 
-    /* Fork. */
-    if ((child_pid = fork()) < 0)
+    free(data);
+    free(lines);
+    data = NULL;
+    lines = NULL;
+    do
     {
-        perror("fork()");
+        if (size == cap)
+        {
+            cap = (cap == 0) ? COPY_BUF_SIZE : cap * 2;
+            if ((data = realloc(data, cap + 1)) == NULL)
+            {
+                perror_exit("realloc()");
+            }
+        }
+        got = read(STDIN_FILENO, data + size, cap - size);
+        size += (got > 0) ? got : 0;
+    } while (got > 0 || (got < 0 && errno == EINTR));
+    if (got < 0)
+    {
+        perror("parallel: read()");
+        return NULL;
+    }
+    data[size] = '\0';
+
+    *count = 0;
+    for (size_t i = 0; i < size; i++)
+    {
+        *count += (data[i] == '\n' || i == size - 1);
+    }
+    if ((lines = malloc((*count + 1) * sizeof(char *))) == NULL)
+    {
+        perror_exit("malloc()");
     }
-    else if (child_pid == 0)
+    *count = 0;
+    for (char *line = data; line < data + size; )
     {
-        /* Open file with corresponding flags. */
-        (output_mode == OUTPUT_APPEND) ? (flags = flags | O_APPEND) : (flags = flags | O_TRUNC);
-        if ((output_fd = open(output_file, flags, 0666)) < 0)
+        char *end = strchr(line, '\n');
+
+        if (end != NULL)
         {
-            perror_exit("open()");
+            *end = '\0';
         }
-
-        /* Dup, close pipes, execute, then close output fd. */
-        if (dup2(pipe_fds[0], STDIN_FILENO) < 0)
+        if (*line != '\0')
         {
-            perror_exit("dup2()");
+            lines[(*count)++] = line;
         }
-        if (dup2(output_fd, STDOUT_FILENO) < 0)
+        line = (end != NULL) ? end + 1 : data + size;
+    }
+    lines[*count] = NULL;
+    return lines;
+}
+
+/* Start one parallel task: command with arg in place
+   of each {}, or appended, with stdin from /dev/null
+   and stdout on out_fd. A new process group is started
+   whenever no earlier task is still unreaped, since the
+   old one may be gone. Returns
+   -1 if the task could not be started, or recorded 
+   as a failed one. */
+
+int parallel_spawn(struct job *job, char *command[], char *arg, int out_fd)
+{
+    struct spawn_plan plan;
+    int argc = 0, replaced = 0, num_procs;
+    char **task_argv;
+    pid_t pid;
+
+    while (command[argc] != NULL)
+    {
+        argc++;
+    }
+    if ((task_argv = malloc((argc + 2) * sizeof(char *))) == NULL)
+    {
+        perror_exit("malloc()");
+    }
+    for (int i = 0; i < argc; i++)
+    {
+        if (strcmp(command[i], PARALLEL_ARG) == 0)
         {
-            perror_exit("dup2()");
+            task_argv[i] = arg;
+            replaced = 1;
         }
-        close_pipes(pipe_fds);
-        execvp_and_handle_error(output_cmd[0], output_cmd);
-        if (close(output_fd) < 0)
+        else
         {
-            perror_exit("close()");
+            task_argv[i] = command[i];
         }
     }
-    else
+    task_argv[argc] = replaced ? NULL : arg;
+    task_argv[argc + 1] = NULL;
+
+    /* A job whose tasks have all been reaped is marked
+       done; it comes back to life with the next one. */
+    if (job->num_live == 0)
     {
-        /* Parent closes pipes and waits once. */
-        close_pipes(pipe_fds);
-        wait(NULL);
+        job->state = JOB_RUNNING;
+        job->pgid = job_own_group(job) ? 0 : job->pgid;
+    }
+    spawn_plan_init(&plan, task_argv);
+    spawn_add_open(&plan, STDIN_FILENO, "/dev/null", O_RDONLY);
+    if (out_fd != STDOUT_FILENO)
+    {
+        spawn_add_dup2(&plan, out_fd, STDOUT_FILENO);
+        spawn_add_close(&plan, out_fd);
+    }
+    num_procs = job->num_procs;
+    pid = spawn_command(job, &plan);
+    free(task_argv);
+    return (pid < 0 && job->num_procs == num_procs) ? -1 : 0;
+}
+
+/* Copy the output of every finished task that follows
+   the last one copied, in input order, to stdout. */
+
+void parallel_emit(struct job *job, int *outputs, int *next_output)
+{
+    while (*next_output < job->num_procs && job->procs[*next_output].done)
+    {
+        int fd = outputs[*next_output];
+
+        if (fd != STDOUT_FILENO)
+        {
+            if (lseek(fd, 0, SEEK_SET) < 0 || copy_fd(fd, STDOUT_FILENO) < 0)
+            {
+                perror("parallel");
+            }
+            close(fd);
+        }
+        (*next_output)++;
     }
 }